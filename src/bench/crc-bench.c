@@ -0,0 +1,126 @@
+#include "iotctrl/crc.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// The bit-at-a-time loops that temp-sensor.c and dht31.c used to carry, kept
+// here as the baseline the table-driven versions are measured against.
+static uint16_t bitwise_crc16_modbus(const uint8_t *buf, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for (size_t pos = 0; pos < len; pos++) {
+    crc ^= (uint16_t)buf[pos];
+    for (int i = 8; i != 0; i--) {
+      if ((crc & 0x0001) != 0) {
+        crc >>= 1;
+        crc ^= 0xA001;
+      } else
+        crc >>= 1;
+    }
+  }
+  return crc;
+}
+
+static uint8_t bitwise_crc8_sht31(const uint8_t *data, size_t len) {
+  const uint8_t POLYNOMIAL = 0x31;
+  uint8_t crc = 0xFF;
+  for (size_t j = len; j; --j) {
+    crc ^= *data++;
+    for (int i = 8; i; --i) {
+      crc = (crc & 0x80) ? (crc << 1) ^ POLYNOMIAL : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+static uint16_t wrap_bitwise_crc8(const uint8_t *buf, size_t len) {
+  return bitwise_crc8_sht31(buf, len);
+}
+static uint16_t wrap_table_crc8(const uint8_t *buf, size_t len) {
+  return iotctrl_crc8_sht31(buf, len);
+}
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, uint16_t (*fn)(const uint8_t *, size_t),
+                const uint8_t *buf, size_t chunk_len, size_t total_len) {
+  // Accumulate the results so that the compiler can't drop the calls
+  volatile uint16_t sink = 0;
+  const size_t iters = total_len / chunk_len;
+  const double start = now_sec();
+  for (size_t i = 0; i < iters; ++i) {
+    sink ^= fn(buf + (i * chunk_len) % (total_len - chunk_len + 1), chunk_len);
+  }
+  const double elapsed = now_sec() - start;
+  printf("%-16s chunk=%-6zu %10.2f MB/s\n", name, chunk_len,
+         iters * chunk_len / elapsed / 1e6);
+  (void)sink;
+}
+
+void print_help_then_exit(char **argv) {
+  // clang-format off
+  printf("Usage: %s\n"
+         "    -s, --size <bytes>  Bytes checksummed per kernel/chunk size combination (default: 64MB)\n"
+         "    -h, --help          Print this help message then exit\n",
+         argv[0]);
+  // clang-format on
+  _exit(0);
+}
+
+int main(int argc, char **argv) {
+  size_t total_len = 64 * 1024 * 1024;
+  static struct option long_options[] = {{"size", required_argument, 0, 's'},
+                                         {"help", no_argument, 0, 'h'},
+                                         {NULL, 0, NULL, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "s:h", long_options, NULL)) != -1) {
+    switch (c) {
+    case 's':
+      total_len = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      print_help_then_exit(argv);
+    }
+  }
+  // The largest chunk must fit in the buffer
+  if (total_len < 4096)
+    total_len = 4096;
+
+  uint8_t *buf = malloc(total_len);
+  if (buf == NULL) {
+    perror("malloc()");
+    return 1;
+  }
+  srand(time(NULL));
+  for (size_t i = 0; i < total_len; ++i)
+    buf[i] = rand();
+
+  // Sanity check before measuring anything
+  for (size_t len = 0; len < 64; ++len) {
+    if (iotctrl_crc16_modbus(buf, len) != bitwise_crc16_modbus(buf, len) ||
+        iotctrl_crc8_sht31(buf, len) != bitwise_crc8_sht31(buf, len)) {
+      fprintf(stderr, "CRC mismatch at length %zu\n", len);
+      free(buf);
+      return 1;
+    }
+  }
+
+  // 2 bytes is a SHT31 word, 9 bytes is a two-sensor DL11-MC reply and 4096
+  // bytes stands for bulk-checking a recorded bus capture.
+  const size_t chunk_lens[] = {2, 9, 4096};
+  for (size_t i = 0; i < sizeof(chunk_lens) / sizeof(chunk_lens[0]); ++i) {
+    run("crc16/bitwise", bitwise_crc16_modbus, buf, chunk_lens[i], total_len);
+    run("crc16/table", iotctrl_crc16_modbus, buf, chunk_lens[i], total_len);
+    run("crc8/bitwise", wrap_bitwise_crc8, buf, chunk_lens[i], total_len);
+    run("crc8/table", wrap_table_crc8, buf, chunk_lens[i], total_len);
+  }
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+#include "iotctrl/7segment-display.h"
+#include "iotctrl/crc.h"
+#include "iotctrl/dht31.h"
+#include "iotctrl/relay.h"
+#include "iotctrl/sim.h"
+#include "iotctrl/temp-sensor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// End-to-end benchmarks of the drivers' hot paths against simulated devices,
+// i.e., "sim:" GPIO chips and I2C buses and pseudoterminals standing in for
+// serial devices. Results are written as one JSON document so that they can
+// be tracked across releases.
+
+#define SIM_GPIOCHIP "sim:bench-gpiochip"
+#define SIM_I2C_BUS "sim:bench-i2c"
+
+static FILE *out;
+static int result_count = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_time_ns(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+// Every result is an object with a name, the number of iterations it is
+// based on and benchmark-specific metrics
+static void begin_result(const char *name, uint64_t iterations) {
+  fprintf(out, "%s\n    {\"name\": \"%s\", \"iterations\": %" PRIu64,
+          result_count++ > 0 ? "," : "", name, iterations);
+}
+
+static void add_metric(const char *key, double value) {
+  fprintf(out, ", \"%s\": %.3f", key, value);
+}
+
+static void add_count(const char *key, uint64_t value) {
+  fprintf(out, ", \"%s\": %" PRIu64, key, value);
+}
+
+static void end_result(void) { fprintf(out, "}"); }
+
+static int cmp_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void report_latencies(const char *name, uint64_t *samples_ns,
+                             size_t count, size_t failures) {
+  begin_result(name, count);
+  if (count > 0) {
+    qsort(samples_ns, count, sizeof(uint64_t), cmp_u64);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; ++i)
+      sum += samples_ns[i];
+    add_metric("mean_us", sum / 1000.0 / count);
+    add_metric("p50_us", samples_ns[count / 2] / 1000.0);
+    add_metric("p99_us", samples_ns[count * 99 / 100] / 1000.0);
+    add_metric("max_us", samples_ns[count - 1] / 1000.0);
+  }
+  add_count("failures", failures);
+  end_result();
+}
+
+// -------------------------------------------------------------------- CRC
+
+static void bench_crc(size_t total_len) {
+  uint8_t *buf = malloc(total_len);
+  if (buf == NULL) {
+    perror("malloc()");
+    return;
+  }
+  for (size_t i = 0; i < total_len; ++i)
+    buf[i] = rand();
+  // 9 bytes is a two-sensor DL11-MC reply, 2 bytes is a SHT31 word
+  const size_t chunk_lens[] = {2, 9, 4096};
+  for (size_t c = 0; c < sizeof(chunk_lens) / sizeof(chunk_lens[0]); ++c) {
+    const size_t chunk_len = chunk_lens[c];
+    const size_t iters = total_len / chunk_len;
+    char name[64];
+    for (int kernel = 0; kernel < 2; ++kernel) {
+      // Accumulate the results so that the compiler can't drop the calls
+      volatile uint16_t sink = 0;
+      const uint64_t start = now_ns();
+      for (size_t i = 0; i < iters; ++i)
+        sink ^= kernel == 0
+                    ? iotctrl_crc16_modbus(buf + i * chunk_len, chunk_len)
+                    : iotctrl_crc8_sht31(buf + i * chunk_len, chunk_len);
+      const uint64_t elapsed_ns = now_ns() - start;
+      (void)sink;
+      snprintf(name, sizeof(name), "%s/chunk_%zu",
+               kernel == 0 ? "crc16_modbus" : "crc8_sht31", chunk_len);
+      begin_result(name, iters);
+      add_metric("mb_per_s", iters * chunk_len * 1e3 / elapsed_ns);
+      add_metric("ns_per_call", (double)elapsed_ns / iters);
+      end_result();
+    }
+  }
+  free(buf);
+}
+
+// ------------------------------------------------------------ 7-segment
+
+static struct iotctrl_7seg_disp_connection seven_seg_conn(
+    enum iotctrl_7seg_disp_transport transport, uint16_t refresh_rate_hz) {
+  struct iotctrl_7seg_disp_connection conn = {0};
+  conn.data_pin_num = 17;
+  conn.clock_pin_num = 11;
+  conn.latch_pin_num = 18;
+  conn.chain_num = 2;
+  conn.refresh_rate_hz = refresh_rate_hz;
+  conn.transport = transport;
+  strcpy(conn.gpiochip_path, SIM_GPIOCHIP);
+  return conn;
+}
+
+static void bench_7seg_encode(uint64_t iterations) {
+  // The refresh thread hardly ever runs at 1Hz, so this measures composing
+  // and compiling frames on the writer's side
+  struct iotctrl_7seg_disp_handle *h = iotctrl_7seg_disp_init(
+      seven_seg_conn(IOTCTRL_7SEG_DISP_TRANSPORT_MOCK, 1));
+  if (h == NULL)
+    return;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < iterations; ++i) {
+    iotctrl_7seg_disp_begin_frame(h);
+    for (int d = 0; d < 8; ++d)
+      iotctrl_7seg_disp_update_digit(
+          h, d, iotctrl_7seg_disp_chars_table[(i + d) % 10]);
+    iotctrl_7seg_disp_commit_frame(h);
+  }
+  uint64_t elapsed_ns = now_ns() - start;
+  begin_result("7seg/frame_encode", iterations);
+  add_metric("ns_per_frame", (double)elapsed_ns / iterations);
+  end_result();
+
+  start = now_ns();
+  for (uint64_t i = 0; i < iterations; ++i)
+    iotctrl_7seg_disp_update_as_four_digit_float(h, (i % 10000) / 10.0 - 99.9,
+                                                 i % 2);
+  elapsed_ns = now_ns() - start;
+  begin_result("7seg/update_as_four_digit_float", iterations);
+  add_metric("updates_per_s", iterations * 1e9 / elapsed_ns);
+  add_metric("ns_per_update", (double)elapsed_ns / iterations);
+  end_result();
+  iotctrl_7seg_disp_destroy(h);
+}
+
+static void bench_7seg_refresh(uint32_t duration_ms,
+                               uint16_t refresh_rate_hz) {
+  // Bit-bangs a simulated GPIO chip while the main thread sleeps, so the
+  // process' CPU time is almost entirely spent shifting words out
+  iotctrl_sim_gpio_reset(SIM_GPIOCHIP);
+  struct iotctrl_7seg_disp_handle *h = iotctrl_7seg_disp_init(
+      seven_seg_conn(IOTCTRL_7SEG_DISP_TRANSPORT_GPIO, refresh_rate_hz));
+  if (h == NULL)
+    return;
+  iotctrl_7seg_disp_update_as_four_digit_float(h, 12.3, 0);
+  iotctrl_7seg_disp_update_as_four_digit_float(h, 45.6, 1);
+  struct iotctrl_7seg_disp_stats before, after;
+  struct iotctrl_sim_gpio_stats gpio_before, gpio_after;
+  iotctrl_7seg_disp_get_stats(h, &before);
+  iotctrl_sim_gpio_get_stats(SIM_GPIOCHIP, &gpio_before);
+  const uint64_t cpu_start = cpu_time_ns();
+  usleep(duration_ms * 1000);
+  const uint64_t cpu_ns = cpu_time_ns() - cpu_start;
+  iotctrl_7seg_disp_get_stats(h, &after);
+  iotctrl_sim_gpio_get_stats(SIM_GPIOCHIP, &gpio_after);
+  iotctrl_7seg_disp_destroy(h);
+
+  const uint64_t refreshes =
+      after.digit_refresh_count - before.digit_refresh_count;
+  begin_result("7seg/refresh_gpio", refreshes);
+  if (refreshes > 0) {
+    add_metric("cpu_ns_per_refresh", (double)cpu_ns / refreshes);
+    add_metric("gpio_writes_per_refresh",
+               (double)(gpio_after.write_count - gpio_before.write_count) /
+                   refreshes);
+  }
+  add_count("target_refresh_hz", refresh_rate_hz);
+  add_metric("achieved_refresh_hz", refreshes * 1000.0 / duration_ms);
+  add_count("deadline_misses",
+             after.deadline_miss_count - before.deadline_miss_count);
+  add_metric("mean_jitter_us", after.mean_jitter_ns / 1000.0);
+  add_metric("max_jitter_us", after.max_jitter_ns / 1000.0);
+  end_result();
+}
+
+// ------------------------------------------------------- Serial devices
+
+// The master side of a pseudoterminal pair, run by a responder thread that
+// either answers DL11-MC requests or just drains what the relay driver writes
+struct pty_peer {
+  int master_fd;
+  char slave_path[64];
+  bool answer_modbus;
+  volatile bool stop;
+  pthread_t th;
+};
+
+static void *pty_peer_thread(void *arg) {
+  struct pty_peer *p = arg;
+  uint8_t req[256];
+  size_t req_len = 0;
+  struct pollfd pfd = {.fd = p->master_fd, .events = POLLIN};
+  while (!p->stop) {
+    if (poll(&pfd, 1, 50) <= 0)
+      continue;
+    const ssize_t n = read(p->master_fd, req + req_len, sizeof(req) - req_len);
+    if (n <= 0)
+      continue;
+    req_len += n;
+    if (!p->answer_modbus) {
+      req_len = 0;
+      continue;
+    }
+    // Function 0x04 requests are 8 bytes: address, function, register (2),
+    // register count (2), CRC (2)
+    while (req_len >= 8) {
+      const uint8_t count = req[5];
+      uint8_t rsp[5 + 2 * UINT8_MAX] = {req[0], 0x04, 2 * count};
+      for (uint8_t i = 0; i < count; ++i) {
+        const int16_t temp = 200 + i;
+        rsp[3 + 2 * i] = temp >> 8;
+        rsp[4 + 2 * i] = temp & 0xFF;
+      }
+      const uint16_t crc = iotctrl_crc16_modbus(rsp, 3 + 2 * count);
+      rsp[3 + 2 * count] = crc & 0xFF;
+      rsp[4 + 2 * count] = crc >> 8;
+      if (write(p->master_fd, rsp, 5 + 2 * count) < 0)
+        perror("write()");
+      memmove(req, req + 8, req_len - 8);
+      req_len -= 8;
+    }
+  }
+  return NULL;
+}
+
+static int pty_peer_start(struct pty_peer *p, bool answer_modbus) {
+  p->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (p->master_fd < 0 || grantpt(p->master_fd) != 0 ||
+      unlockpt(p->master_fd) != 0 ||
+      ptsname_r(p->master_fd, p->slave_path, sizeof(p->slave_path)) != 0) {
+    fprintf(stderr, "Failed to create a pseudoterminal: %d(%s)\n", errno,
+            strerror(errno));
+    if (p->master_fd >= 0)
+      close(p->master_fd);
+    return -1;
+  }
+  struct termios tty;
+  tcgetattr(p->master_fd, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(p->master_fd, TCSANOW, &tty);
+  p->answer_modbus = answer_modbus;
+  p->stop = false;
+  if (pthread_create(&p->th, NULL, pty_peer_thread, p) != 0) {
+    fprintf(stderr, "pthread_create() failed\n");
+    close(p->master_fd);
+    return -1;
+  }
+  return 0;
+}
+
+static void pty_peer_stop(struct pty_peer *p) {
+  p->stop = true;
+  pthread_join(p->th, NULL);
+  close(p->master_fd);
+}
+
+static void bench_modbus(uint64_t iterations) {
+  struct pty_peer peer;
+  if (pty_peer_start(&peer, true) != 0)
+    return;
+  uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+  struct iotctrl_temp_sensor_handle *h =
+      iotctrl_temp_sensor_open(peer.slave_path, 0);
+  if (samples != NULL && h != NULL) {
+    size_t count = 0, failures = 0;
+    int16_t readings[2];
+    for (uint64_t i = 0; i < iterations; ++i) {
+      const uint64_t start = now_ns();
+      if (iotctrl_temp_sensor_read(h, 2, readings) == 0)
+        samples[count++] = now_ns() - start;
+      else
+        ++failures;
+    }
+    report_latencies("modbus/dl11_read_2_sensors", samples, count, failures);
+  }
+  iotctrl_temp_sensor_close(h);
+  free(samples);
+  pty_peer_stop(&peer);
+}
+
+static void bench_relay(uint64_t iterations) {
+  struct pty_peer peer;
+  if (pty_peer_start(&peer, false) != 0)
+    return;
+  uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+  struct iotctrl_relay_handle *h = iotctrl_relay_open(peer.slave_path);
+  if (samples != NULL && h != NULL) {
+    size_t count = 0, failures = 0;
+    for (uint64_t i = 0; i < iterations; ++i) {
+      const uint64_t start = now_ns();
+      if (iotctrl_relay_set(h, i % 2) == 0)
+        samples[count++] = now_ns() - start;
+      else
+        ++failures;
+    }
+    report_latencies("relay/set", samples, count, failures);
+    count = failures = 0;
+    for (uint64_t i = 0; i < iterations; ++i) {
+      const uint64_t start = now_ns();
+      if (iotctrl_relay_set_mask(h, IOTCTRL_RELAY_MAX_CHANNELS, i) == 0)
+        samples[count++] = now_ns() - start;
+      else
+        ++failures;
+    }
+    report_latencies("relay/set_mask_8_channels", samples, count, failures);
+  }
+  iotctrl_relay_close(h);
+  free(samples);
+  pty_peer_stop(&peer);
+}
+
+// ------------------------------------------------------------------ SHT31
+
+static void bench_sht31(uint64_t iterations) {
+  uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+  struct iotctrl_dht31_handle *h = iotctrl_dht31_open(SIM_I2C_BUS, 0x44);
+  if (samples != NULL && h != NULL) {
+    // With clock stretching the simulated sensor answers at once, i.e., this
+    // is the driver's own overhead per measurement
+    size_t count = 0, failures = 0;
+    float temp_celsius, relative_humidity;
+    for (uint64_t i = 0; i < iterations; ++i) {
+      const uint64_t start = now_ns();
+      if (iotctrl_dht31_measure(h, &temp_celsius, &relative_humidity) == 0)
+        samples[count++] = now_ns() - start;
+      else
+        ++failures;
+    }
+    report_latencies("sht31/measure_clock_stretching", samples, count,
+                     failures);
+
+    // Without it the driver sleeps for the sensor's max. conversion time, a
+    // few iterations are enough
+    const struct iotctrl_dht31_config config = {
+        IOTCTRL_DHT31_SINGLE_SHOT, IOTCTRL_DHT31_REPEATABILITY_LOW, false};
+    const uint64_t sleeping_iterations = iterations < 50 ? iterations : 50;
+    count = failures = 0;
+    if (iotctrl_dht31_configure(h, &config) == 0) {
+      for (uint64_t i = 0; i < sleeping_iterations; ++i) {
+        const uint64_t start = now_ns();
+        if (iotctrl_dht31_measure(h, &temp_celsius, &relative_humidity) == 0)
+          samples[count++] = now_ns() - start;
+        else
+          ++failures;
+      }
+      report_latencies("sht31/measure_low_repeatability_polling", samples,
+                       count, failures);
+    }
+  }
+  iotctrl_dht31_close(h);
+  free(samples);
+}
+
+void print_help_then_exit(char **argv) {
+  // clang-format off
+  printf("Usage: %s\n"
+         "    -i, --iterations <count> Iterations of each latency/throughput benchmark (default: 10000)\n"
+         "    -s, --crc-size   <bytes> Bytes checksummed per CRC kernel/chunk size combination (default: 16MB)\n"
+         "    -d, --duration   <ms>    How long the 7-segment refresh thread is measured (default: 1000)\n"
+         "    -r, --refresh-rate <hz>  Refresh rate of the 7-segment display, raise it to saturate a core (default: 8000)\n"
+         "    -o, --output     <path>  Write the JSON results to a file instead of stdout\n"
+         "    -h, --help               Print this help message then exit\n",
+         argv[0]);
+  // clang-format on
+  _exit(0);
+}
+
+int main(int argc, char **argv) {
+  uint64_t iterations = 10000;
+  size_t crc_size = 16 * 1024 * 1024;
+  uint32_t duration_ms = 1000;
+  uint16_t refresh_rate_hz = 8000;
+  const char *output_path = NULL;
+  static struct option long_options[] = {
+      {"iterations", required_argument, 0, 'i'},
+      {"crc-size", required_argument, 0, 's'},
+      {"duration", required_argument, 0, 'd'},
+      {"refresh-rate", required_argument, 0, 'r'},
+      {"output", required_argument, 0, 'o'},
+      {"help", no_argument, 0, 'h'},
+      {NULL, 0, NULL, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "i:s:d:r:o:h", long_options, NULL)) !=
+         -1) {
+    switch (c) {
+    case 'i':
+      iterations = strtoull(optarg, NULL, 10);
+      break;
+    case 's':
+      crc_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'd':
+      duration_ms = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      refresh_rate_hz = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    default:
+      print_help_then_exit(argv);
+    }
+  }
+  if (iterations == 0 || duration_ms == 0 || refresh_rate_hz == 0)
+    print_help_then_exit(argv);
+  // The largest chunk must fit in the buffer
+  if (crc_size < 4096)
+    crc_size = 4096;
+
+  out = stdout;
+  if (output_path != NULL && (out = fopen(output_path, "w")) == NULL) {
+    fprintf(stderr, "fopen(%s) failed: %d(%s)\n", output_path, errno,
+            strerror(errno));
+    return 1;
+  }
+
+  struct utsname uts;
+  uname(&uts);
+  fprintf(out,
+          "{\n  \"timestamp\": %ld,\n  \"host\": {\"sysname\": \"%s\", "
+          "\"release\": \"%s\", \"machine\": \"%s\", \"cpus\": %ld},\n"
+          "  \"results\": [",
+          (long)time(NULL), uts.sysname, uts.release, uts.machine,
+          sysconf(_SC_NPROCESSORS_ONLN));
+  bench_crc(crc_size);
+  bench_7seg_encode(iterations);
+  bench_7seg_refresh(duration_ms, refresh_rate_hz);
+  bench_modbus(iterations);
+  bench_relay(iterations);
+  bench_sht31(iterations);
+  fprintf(out, "\n  ]\n}\n");
+
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
@@ -3,7 +3,7 @@
     {
       "target_name": "temp_sensor",
       "sources": [ "temp_sensor_node.c" ],
-      "libraries":  [ "-liotctrl", "-lmodbus" ]
+      "libraries":  [ "-liotctrl", "-lmodbus", "-lgpiod", "-lpthread", "-lrt" ]
     },{
          "target_name": "copy_binary",
          "type":"none",
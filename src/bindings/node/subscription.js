@@ -0,0 +1,113 @@
+const { EventEmitter } = require('events');
+const native = require('./temp_sensor.node');
+
+// Samples a DL11-MC device on a native thread and emits its readings.
+//
+// Events:
+// - 'data' (sample): one per sampling attempt, sample is
+//   { result, timestamp, readings }. result is 0 or the error code of
+//   iotctrl_get_temperature(), readings is an Int16Array (temperature x 10 in
+//   degree Celsius) or null if result is not 0.
+// - 'drop' (count): count readings were dropped because the consumer did not
+//   keep up, see pause()
+// - 'close'
+//
+// The subscription is also an async iterator of samples. Iteration applies
+// backpressure: once highWaterMark samples are waiting to be consumed,
+// delivery is paused until the consumer catches up. Sampling itself goes on
+// at the requested interval, at most maxBuffered readings are kept meanwhile.
+class TemperatureSubscription extends EventEmitter {
+  constructor(devicePath, sensorCount, intervalMs, options = {}) {
+    super();
+    this.maxBuffered = options.maxBuffered ?? 64;
+    this.highWaterMark = options.highWaterMark ?? 64;
+    this._queue = [];
+    this._waiters = [];
+    this._iterating = false;
+    this._userPaused = false;
+    this._backpressure = false;
+    this._handle = native.subscribe(devicePath, sensorCount, intervalMs,
+      this.maxBuffered, (samples, dropped) => this._onBatch(samples, dropped));
+  }
+
+  _onBatch(samples, dropped) {
+    if (dropped > 0) this.emit('drop', dropped);
+    for (const sample of samples) {
+      this.emit('data', sample);
+      if (!this._iterating) continue;
+      const waiter = this._waiters.shift();
+      if (waiter) waiter({ value: sample, done: false });
+      else this._queue.push(sample);
+    }
+    if (this._queue.length >= this.highWaterMark && !this._backpressure) {
+      this._backpressure = true;
+      this._updatePaused();
+    }
+  }
+
+  _updatePaused() {
+    if (this._handle === null) return;
+    if (this._userPaused || this._backpressure) native.pause(this._handle);
+    else native.resume(this._handle);
+  }
+
+  // Stop delivering readings until resume(). Readings taken meanwhile are
+  // delivered as one batch on resume(), the oldest ones are dropped if more
+  // than maxBuffered accumulate.
+  pause() {
+    this._userPaused = true;
+    this._updatePaused();
+    return this;
+  }
+
+  resume() {
+    this._userPaused = false;
+    this._updatePaused();
+    return this;
+  }
+
+  // Stop sampling and release the device
+  close() {
+    if (this._handle === null) return;
+    native.unsubscribe(this._handle);
+    this._handle = null;
+    for (const waiter of this._waiters.splice(0))
+      waiter({ value: undefined, done: true });
+    this.emit('close');
+  }
+
+  [Symbol.asyncIterator]() {
+    this._iterating = true;
+    return {
+      next: () => {
+        if (this._queue.length > 0) {
+          const value = this._queue.shift();
+          if (this._backpressure && this._queue.length < this.highWaterMark / 2) {
+            this._backpressure = false;
+            this._updatePaused();
+          }
+          return Promise.resolve({ value, done: false });
+        }
+        if (this._handle === null)
+          return Promise.resolve({ value: undefined, done: true });
+        return new Promise((resolve) => this._waiters.push(resolve));
+      },
+      return: () => {
+        this.close();
+        return Promise.resolve({ value: undefined, done: true });
+      },
+      [Symbol.asyncIterator]() { return this; },
+    };
+  }
+}
+
+function subscribe(devicePath, sensorCount, intervalMs, options) {
+  return new TemperatureSubscription(devicePath, sensorCount, intervalMs,
+    options);
+}
+
+module.exports = {
+  get_temperature: native.get_temperature,
+  subscribe,
+  TemperatureSubscription,
+};
@@ -1,3 +1,10 @@
 const temp_sensors = require('./temp_sensor.node');
 
-console.log(temp_sensors.get_temperature("/dev/ttyUSB1", 0));  // base32("Hello world!")
\ No newline at end of file
+temp_sensors.get_temperature("/dev/ttyUSB1", 2)
+  .then((readings) => {
+    // Readings are temperature x 10 in degree Celsius
+    console.log(Array.from(readings, (r) => r / 10));
+  })
+  .catch((err) => {
+    console.error(`${err.message} (code: ${err.code})`);
+  });
@@ -1,17 +1,176 @@
 #include <assert.h>
 #include <node_api.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <iotctrl/poller.h>
 #include <iotctrl/temp-sensor.h>
 #include <string.h>
+#include <time.h>
 
 // Refer to here for more examples: https://github.com/nodejs/node-addon-examples
 
+// Every call becomes a napi_async_work, i.e., the Modbus round trip runs on
+// libuv's thread pool and the event loop keeps going. Calls on the same port
+// would only contend for the tty, so they are queued per port and the next
+// one is handed to the pool when the previous one completes. This way they
+// neither block the JS thread nor park pool threads on a lock.
 
+struct request {
+  struct request *next;
+  struct port *port;
+  napi_async_work work;
+  napi_deferred deferred;
+  uint8_t sensor_count;
+  int enable_debug_output;
+  // Handed over to the resolved Int16Array, which frees it when collected
+  int16_t *readings;
+  int result;
+};
+
+struct port {
+  struct port *next;
+  char *device_path;
+  // Whether a request of this port is queued on or running in the pool
+  bool busy;
+  struct request *pending_head;
+  struct request *pending_tail;
+};
+
+// Per napi_env, so that the addon also works in worker_threads
+struct addon_data {
+  struct port *ports;
+};
+
+static struct port *get_port(napi_env env, const char *device_path) {
+  struct addon_data *data;
+  napi_status status = napi_get_instance_data(env, (void **)&data);
+  assert(status == napi_ok);
+  struct port *p = data->ports;
+  for (; p != NULL; p = p->next)
+    if (strcmp(p->device_path, device_path) == 0)
+      return p;
+  p = calloc(1, sizeof(struct port));
+  if (p == NULL)
+    return NULL;
+  p->device_path = strdup(device_path);
+  if (p->device_path == NULL) {
+    free(p);
+    return NULL;
+  }
+  p->next = data->ports;
+  data->ports = p;
+  return p;
+}
+
+static void execute_get_temperature(napi_env env, void *data) {
+  (void)env;
+  struct request *req = data;
+  // Runs on a pool thread, must not touch any napi_value
+  req->result =
+      iotctrl_get_temperature(req->port->device_path, req->sensor_count,
+                              req->readings, req->enable_debug_output);
+}
+
+static void free_readings(napi_env env, void *finalize_data, void *hint) {
+  (void)env;
+  (void)hint;
+  free(finalize_data);
+}
+
+static napi_value create_readings_array(napi_env env, struct request *req) {
+  const size_t byte_length = req->sensor_count * sizeof(int16_t);
+  napi_value array_buffer;
+  napi_status status =
+      napi_create_external_arraybuffer(env, req->readings, byte_length,
+                                       free_readings, NULL, &array_buffer);
+  if (status == napi_ok) {
+    req->readings = NULL;
+  } else {
+    // Some runtimes (e.g., Electron) refuse external buffers, copy instead
+    void *buf;
+    status = napi_create_arraybuffer(env, byte_length, &buf, &array_buffer);
+    assert(status == napi_ok);
+    memcpy(buf, req->readings, byte_length);
+  }
+  napi_value array;
+  status = napi_create_typedarray(env, napi_int16_array, req->sensor_count,
+                                  array_buffer, 0, &array);
+  assert(status == napi_ok);
+  return array;
+}
+
+static napi_value create_error(napi_env env, int result) {
+  char msg[64];
+  snprintf(msg, sizeof(msg), "iotctrl_get_temperature() failed: %d", result);
+  napi_value msg_napi, code_napi, error;
+  napi_status status = napi_create_string_utf8(env, msg, NAPI_AUTO_LENGTH,
+                                               &msg_napi);
+  assert(status == napi_ok);
+  status = napi_create_error(env, NULL, msg_napi, &error);
+  assert(status == napi_ok);
+  // Same as the return value of the C API
+  status = napi_create_int32(env, result, &code_napi);
+  assert(status == napi_ok);
+  status = napi_set_named_property(env, error, "code", code_napi);
+  assert(status == napi_ok);
+  return error;
+}
+
+static void complete_get_temperature(napi_env env, napi_status work_status,
+                                     void *data) {
+  struct request *req = data;
+  struct port *p = req->port;
+  napi_status status;
+
+  if (work_status == napi_ok && req->result == 0)
+    status = napi_resolve_deferred(env, req->deferred,
+                                   create_readings_array(env, req));
+  else
+    status = napi_reject_deferred(
+        env, req->deferred,
+        create_error(env, work_status == napi_ok ? req->result : -1));
+  assert(status == napi_ok);
+  status = napi_delete_async_work(env, req->work);
+  assert(status == napi_ok);
+  free(req->readings);
+  free(req);
+
+  struct request *next = p->pending_head;
+  if (next == NULL) {
+    p->busy = false;
+    return;
+  }
+  p->pending_head = next->next;
+  if (p->pending_head == NULL)
+    p->pending_tail = NULL;
+  status = napi_queue_async_work(env, next->work);
+  assert(status == napi_ok);
+}
+
+static char *get_string(napi_env env, napi_value value) {
+  size_t length;
+  napi_status status =
+      napi_get_value_string_utf8(env, value, NULL, 0, &length);
+  assert(status == napi_ok);
+  char *str = malloc(length + 1);
+  if (str == NULL)
+    return NULL;
+  status = napi_get_value_string_utf8(env, value, str, length + 1, &length);
+  assert(status == napi_ok);
+  return str;
+}
+
+// get_temperature(devicePath, sensorCount[, enableDebugOutput]) returns a
+// Promise that resolves to an Int16Array with sensorCount readings, or rejects
+// with an Error whose code is the return value of iotctrl_get_temperature()
 static napi_value get_temperature_napi(napi_env env, napi_callback_info info) {
   napi_status status;
 
-  size_t argc = 2;
-  napi_value args[2];
+  size_t argc = 3;
+  napi_value args[3];
   status = napi_get_cb_info(env, info, &argc, args, NULL, NULL);
   assert(status == napi_ok);
 
@@ -28,31 +187,404 @@ static napi_value get_temperature_napi(napi_env env, napi_callback_info info) {
   status = napi_typeof(env, args[1], &valuetype1);
   assert(status == napi_ok);
 
-  if (valuetype0 != napi_string || valuetype1 != napi_number) {
+  // Missing arguments are filled with undefined by napi_get_cb_info()
+  napi_valuetype valuetype2;
+  status = napi_typeof(env, args[2], &valuetype2);
+  assert(status == napi_ok);
+
+  if (valuetype0 != napi_string || valuetype1 != napi_number ||
+      (valuetype2 != napi_number && valuetype2 != napi_undefined)) {
     napi_throw_type_error(env, NULL, "Wrong arguments");
     return NULL;
   }
 
-  const size_t buf_size = PATH_MAX + 1;
-  size_t result;
-  char device_path[buf_size];
-  status = napi_get_value_string_latin1(env, args[0], device_path, buf_size, &result);
-  if (result >= buf_size - 1) {
-    fprintf(stderr, "WARNING: device_path will be truncated to %lu characters\n", buf_size - 1);
+  int64_t sensor_count;
+  status = napi_get_value_int64(env, args[1], &sensor_count);
+  assert(status == napi_ok);
+  if (sensor_count < 1 || sensor_count > UINT8_MAX) {
+    napi_throw_range_error(env, NULL, "sensorCount must be in [1, 255]");
+    return NULL;
+  }
+
+  int enable_debug_output = 0;
+  if (valuetype2 == napi_number) {
+    status = napi_get_value_int32(env, args[2], &enable_debug_output);
+    assert(status == napi_ok);
   }
+
+  char *device_path = get_string(env, args[0]);
+  struct port *p = device_path == NULL ? NULL : get_port(env, device_path);
+  free(device_path);
+  struct request *req = calloc(1, sizeof(struct request));
+  if (p == NULL || req == NULL ||
+      (req->readings = malloc(sensor_count * sizeof(int16_t))) == NULL) {
+    free(req);
+    napi_throw_error(env, NULL, "Out of memory");
+    return NULL;
+  }
+  req->port = p;
+  req->sensor_count = sensor_count;
+  req->enable_debug_output = enable_debug_output;
+
+  napi_value promise, resource_name;
+  status = napi_create_promise(env, &req->deferred, &promise);
+  assert(status == napi_ok);
+  status = napi_create_string_utf8(env, "iotctrl:get_temperature",
+                                   NAPI_AUTO_LENGTH, &resource_name);
+  assert(status == napi_ok);
+  status = napi_create_async_work(env, NULL, resource_name,
+                                  execute_get_temperature,
+                                  complete_get_temperature, req, &req->work);
   assert(status == napi_ok);
 
-  int debug_mode;
-  status = napi_get_value_int32(env, args[1], &debug_mode);
+  if (p->busy) {
+    if (p->pending_tail != NULL)
+      p->pending_tail->next = req;
+    else
+      p->pending_head = req;
+    p->pending_tail = req;
+  } else {
+    p->busy = true;
+    status = napi_queue_async_work(env, req->work);
+    assert(status == napi_ok);
+  }
+  return promise;
+}
+
+// A subscription samples one device on a native poller thread. Readings are
+// buffered in a bounded ring and handed to JS through a threadsafe function,
+// one call per batch of whatever accumulated since the previous call, so a
+// slow event loop means bigger batches rather than more calls. While paused
+// (the JS side is not keeping up) sampling goes on and the oldest buffered
+// readings are dropped.
+
+struct sample {
+  // Date.now() compatible
+  double timestamp_ms;
+  struct iotctrl_poller_reading reading;
+};
+
+struct subscription {
+  napi_threadsafe_function tsfn;
+  struct iotctrl_poller *poller;
+  uint8_t sensor_count;
+  pthread_mutex_t mutex;
+  // Ring of buffered samples, protected by mutex like the fields below
+  struct sample *samples;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  // Number of samples dropped since the previous batch
+  uint64_t dropped;
+  // Whether a call to the threadsafe function is queued
+  bool delivery_pending;
+  bool paused;
+  bool closed;
+  // Owners of this struct, the threadsafe function and the JS handle. Only
+  // touched on the JS thread, where both of them are finalized.
+  int refs;
+};
+
+static double realtime_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Must be called with mutex held
+static void schedule_delivery(struct subscription *s) {
+  if (s->delivery_pending || s->paused || s->closed || s->count == 0)
+    return;
+  // Non-blocking, the queue of the threadsafe function is unbounded and never
+  // holds more than one call of this subscription anyway
+  if (napi_call_threadsafe_function(s->tsfn, s, napi_tsfn_nonblocking) ==
+      napi_ok)
+    s->delivery_pending = true;
+}
+
+// Called on the poller's thread
+static void on_reading(const struct iotctrl_poller_reading *reading,
+                       void *user_data) {
+  struct subscription *s = user_data;
+  pthread_mutex_lock(&s->mutex);
+  if (s->count == s->capacity) {
+    s->head = (s->head + 1) % s->capacity;
+    --s->count;
+    ++s->dropped;
+  }
+  struct sample *sample = &s->samples[(s->head + s->count) % s->capacity];
+  sample->timestamp_ms = realtime_ms();
+  sample->reading = *reading;
+  ++s->count;
+  schedule_delivery(s);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static void set_number(napi_env env, napi_value object, const char *name,
+                       double value) {
+  napi_value value_napi;
+  napi_status status = napi_create_double(env, value, &value_napi);
+  assert(status == napi_ok);
+  status = napi_set_named_property(env, object, name, value_napi);
   assert(status == napi_ok);
+}
+
+// Calls onBatch(samples, dropped) on the JS thread. samples is an array of
+// { result, timestamp, readings }, all readings of a batch are views of one
+// ArrayBuffer and readings is null if result is not 0.
+static void deliver_batch(napi_env env, napi_value js_cb, void *context,
+                          void *data) {
+  (void)context;
+  struct subscription *s = data;
+  // env is NULL while the environment is being torn down
+  if (env == NULL)
+    return;
 
-  int temp_raw = get_temperature(device_path, debug_mode);
+  pthread_mutex_lock(&s->mutex);
+  s->delivery_pending = false;
+  const size_t count = s->closed || s->paused ? 0 : s->count;
+  struct sample *batch = malloc(count * sizeof(struct sample) + 1);
+  if (batch == NULL) {
+    pthread_mutex_unlock(&s->mutex);
+    return;
+  }
+  for (size_t i = 0; i < count; ++i)
+    batch[i] = s->samples[(s->head + i) % s->capacity];
+  s->head = (s->head + count) % s->capacity;
+  s->count -= count;
+  const uint64_t dropped = count > 0 ? s->dropped : 0;
+  if (count > 0)
+    s->dropped = 0;
+  pthread_mutex_unlock(&s->mutex);
+  if (count == 0) {
+    free(batch);
+    return;
+  }
 
-  napi_value temp_raw_napi;
-  status = napi_create_int32(env, temp_raw, &temp_raw_napi);
+  napi_status status;
+  napi_value samples, array_buffer;
+  int16_t *readings;
+  status = napi_create_array_with_length(env, count, &samples);
+  assert(status == napi_ok);
+  status = napi_create_arraybuffer(env, count * s->sensor_count *
+                                            sizeof(int16_t),
+                                   (void **)&readings, &array_buffer);
+  assert(status == napi_ok);
+  for (size_t i = 0; i < count; ++i) {
+    napi_value sample, readings_napi;
+    status = napi_create_object(env, &sample);
+    assert(status == napi_ok);
+    set_number(env, sample, "result", batch[i].reading.result);
+    set_number(env, sample, "timestamp", batch[i].timestamp_ms);
+    if (batch[i].reading.result == 0) {
+      memcpy(readings + i * s->sensor_count, batch[i].reading.dl11.readings,
+             s->sensor_count * sizeof(int16_t));
+      status = napi_create_typedarray(env, napi_int16_array, s->sensor_count,
+                                      array_buffer,
+                                      i * s->sensor_count * sizeof(int16_t),
+                                      &readings_napi);
+    } else {
+      status = napi_get_null(env, &readings_napi);
+    }
+    assert(status == napi_ok);
+    status = napi_set_named_property(env, sample, "readings", readings_napi);
+    assert(status == napi_ok);
+    status = napi_set_element(env, samples, i, sample);
+    assert(status == napi_ok);
+  }
+  free(batch);
+
+  napi_value argv[2], undefined;
+  argv[0] = samples;
+  status = napi_create_double(env, dropped, &argv[1]);
+  assert(status == napi_ok);
+  status = napi_get_undefined(env, &undefined);
+  assert(status == napi_ok);
+  // An exception thrown by onBatch surfaces as an uncaught exception
+  (void)napi_call_function(env, undefined, js_cb, 2, argv, NULL);
+}
+
+static void unref_subscription(struct subscription *s) {
+  if (--s->refs > 0)
+    return;
+  pthread_mutex_destroy(&s->mutex);
+  free(s->samples);
+  free(s);
+}
+
+static void finalize_subscription(napi_env env, void *finalize_data,
+                                  void *finalize_hint) {
+  (void)env;
+  (void)finalize_hint;
+  struct subscription *s = finalize_data;
+  // Also reached without unsubscribe() when the environment goes away
+  iotctrl_poller_destroy(s->poller);
+  s->poller = NULL;
+  // The handle may outlive the threadsafe function, later calls with it have
+  // to find the subscription closed
+  s->closed = true;
+  unref_subscription(s);
+}
+
+static void finalize_handle(napi_env env, void *finalize_data,
+                            void *finalize_hint) {
+  (void)env;
+  (void)finalize_hint;
+  unref_subscription(finalize_data);
+}
+
+static struct subscription *get_subscription(napi_env env, napi_value value) {
+  struct subscription *s = NULL;
+  napi_valuetype valuetype;
+  napi_status status = napi_typeof(env, value, &valuetype);
+  assert(status == napi_ok);
+  if (valuetype == napi_external) {
+    status = napi_get_value_external(env, value, (void **)&s);
+    assert(status == napi_ok);
+  }
+  if (s == NULL || s->closed) {
+    napi_throw_type_error(env, NULL, "Not an active subscription");
+    return NULL;
+  }
+  return s;
+}
+
+// subscribe(devicePath, sensorCount, intervalMs, maxBuffered, onBatch)
+// returns an opaque handle for pause()/resume()/unsubscribe()
+static napi_value subscribe_napi(napi_env env, napi_callback_info info) {
+  napi_status status;
+
+  size_t argc = 5;
+  napi_value args[5];
+  status = napi_get_cb_info(env, info, &argc, args, NULL, NULL);
+  assert(status == napi_ok);
+
+  if (argc < 5) {
+    napi_throw_type_error(env, NULL, "Wrong number of arguments");
+    return NULL;
+  }
+
+  const napi_valuetype expected[] = {napi_string, napi_number, napi_number,
+                                     napi_number, napi_function};
+  for (size_t i = 0; i < argc; ++i) {
+    napi_valuetype valuetype;
+    status = napi_typeof(env, args[i], &valuetype);
+    assert(status == napi_ok);
+    if (valuetype != expected[i]) {
+      napi_throw_type_error(env, NULL, "Wrong arguments");
+      return NULL;
+    }
+  }
+
+  int64_t sensor_count, interval_ms, max_buffered;
+  status = napi_get_value_int64(env, args[1], &sensor_count);
+  assert(status == napi_ok);
+  status = napi_get_value_int64(env, args[2], &interval_ms);
+  assert(status == napi_ok);
+  status = napi_get_value_int64(env, args[3], &max_buffered);
+  assert(status == napi_ok);
+  if (sensor_count < 1 || sensor_count > IOTCTRL_POLLER_DL11_MAX_SENSORS ||
+      interval_ms < 1 || interval_ms > UINT32_MAX || max_buffered < 1) {
+    napi_throw_range_error(env, NULL, "Argument out of range");
+    return NULL;
+  }
+
+  struct subscription *s = calloc(1, sizeof(struct subscription));
+  if (s == NULL ||
+      (s->samples = calloc(max_buffered, sizeof(struct sample))) == NULL) {
+    free(s);
+    napi_throw_error(env, NULL, "Out of memory");
+    return NULL;
+  }
+  s->sensor_count = sensor_count;
+  s->capacity = max_buffered;
+  s->refs = 1;
+  pthread_mutex_init(&s->mutex, NULL);
+
+  napi_value resource_name;
+  status = napi_create_string_utf8(env, "iotctrl:subscription",
+                                   NAPI_AUTO_LENGTH, &resource_name);
+  assert(status == napi_ok);
+  // From here on the subscription is freed by unref_subscription()
+  status = napi_create_threadsafe_function(
+      env, args[4], NULL, resource_name, 0, 1, s, finalize_subscription, NULL,
+      deliver_batch, &s->tsfn);
   assert(status == napi_ok);
 
-  return temp_raw_napi;
+  char *device_path = get_string(env, args[0]);
+  s->poller = iotctrl_poller_create();
+  if (device_path == NULL || s->poller == NULL ||
+      iotctrl_poller_add_dl11(s->poller, device_path, sensor_count,
+                              interval_ms, on_reading, s) < 0) {
+    free(device_path);
+    s->closed = true;
+    (void)napi_release_threadsafe_function(s->tsfn, napi_tsfn_abort);
+    napi_throw_error(env, NULL, "Failed to start polling the device");
+    return NULL;
+  }
+  free(device_path);
+
+  napi_value handle;
+  status = napi_create_external(env, s, finalize_handle, NULL, &handle);
+  assert(status == napi_ok);
+  ++s->refs;
+  return handle;
+}
+
+static napi_value set_paused(napi_env env, napi_callback_info info,
+                             bool paused) {
+  size_t argc = 1;
+  napi_value args[1];
+  napi_status status = napi_get_cb_info(env, info, &argc, args, NULL, NULL);
+  assert(status == napi_ok);
+  struct subscription *s = get_subscription(env, args[0]);
+  if (s == NULL)
+    return NULL;
+  pthread_mutex_lock(&s->mutex);
+  s->paused = paused;
+  // Whatever accumulated while paused goes out as one batch
+  schedule_delivery(s);
+  pthread_mutex_unlock(&s->mutex);
+  return NULL;
+}
+
+static napi_value pause_napi(napi_env env, napi_callback_info info) {
+  return set_paused(env, info, true);
+}
+
+static napi_value resume_napi(napi_env env, napi_callback_info info) {
+  return set_paused(env, info, false);
+}
+
+static napi_value unsubscribe_napi(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value args[1];
+  napi_status status = napi_get_cb_info(env, info, &argc, args, NULL, NULL);
+  assert(status == napi_ok);
+  struct subscription *s = get_subscription(env, args[0]);
+  if (s == NULL)
+    return NULL;
+  pthread_mutex_lock(&s->mutex);
+  s->closed = true;
+  pthread_mutex_unlock(&s->mutex);
+  // The poller is stopped by finalize_subscription() once no call is pending,
+  // on_reading() no longer schedules any in the meantime
+  status = napi_release_threadsafe_function(s->tsfn, napi_tsfn_release);
+  assert(status == napi_ok);
+  return NULL;
+}
+
+static void free_addon_data(napi_env env, void *finalize_data, void *hint) {
+  (void)env;
+  (void)hint;
+  struct addon_data *data = finalize_data;
+  while (data->ports != NULL) {
+    struct port *p = data->ports;
+    data->ports = p->next;
+    free(p->device_path);
+    free(p);
+  }
+  free(data);
 }
 
 #define DECLARE_NAPI_METHOD(name, func)                                        \
@@ -60,10 +592,25 @@ static napi_value get_temperature_napi(napi_env env, napi_callback_info info) {
 
 napi_value Init(napi_env env, napi_value exports) {
   napi_status status;
-  napi_property_descriptor get_temperature_descriptor = DECLARE_NAPI_METHOD("get_temperature", get_temperature_napi);
-  status = napi_define_properties(env, exports, 1, &get_temperature_descriptor);
+  struct addon_data *data = calloc(1, sizeof(struct addon_data));
+  if (data == NULL) {
+    napi_throw_error(env, NULL, "Out of memory");
+    return NULL;
+  }
+  status = napi_set_instance_data(env, data, free_addon_data, NULL);
+  assert(status == napi_ok);
+
+  napi_property_descriptor descriptors[] = {
+      DECLARE_NAPI_METHOD("get_temperature", get_temperature_napi),
+      DECLARE_NAPI_METHOD("subscribe", subscribe_napi),
+      DECLARE_NAPI_METHOD("pause", pause_napi),
+      DECLARE_NAPI_METHOD("resume", resume_napi),
+      DECLARE_NAPI_METHOD("unsubscribe", unsubscribe_napi),
+  };
+  status = napi_define_properties(
+      env, exports, sizeof(descriptors) / sizeof(descriptors[0]), descriptors);
   assert(status == napi_ok);
   return exports;
 }
 
-NAPI_MODULE(NODE_GYP_MODULE_NAME, Init)
\ No newline at end of file
+NAPI_MODULE(NODE_GYP_MODULE_NAME, Init)
@@ -1,18 +1,13 @@
-import ctypes as ct
-import os
+from _iotctrl import (DHT31, IotctrlError, Readings, Relay, SevenSegmentDisplay,
+                      TempSensor, read_temperature, INVALID_TEMP,
+                      DEFAULT_SLAVE, SINGLE_SHOT, PERIODIC_0_5_MPS,
+                      PERIODIC_1_MPS, PERIODIC_2_MPS, PERIODIC_4_MPS,
+                      PERIODIC_10_MPS, REPEATABILITY_HIGH,
+                      REPEATABILITY_MEDIUM, REPEATABILITY_LOW, TRANSPORT_GPIO,
+                      TRANSPORT_SPI, TRANSPORT_MOCK)
 
 
-so_file_path = '/usr/local/lib/libiotctrl.so'
-iotctrl = ct.CDLL(so_file_path)
-INVALID_TEMP = ct.c_int16.in_dll(iotctrl, "iotctrl_invalid_temp").value
-
-iotctrl.iotctrl_control_relay.argtypes = [ct.c_char_p, ct.c_bool]
-iotctrl.iotctrl_control_relay.restype = ct.c_int
-iotctrl.iotctrl_get_temperature.argtypes = [ct.c_char_p, ct.c_int]
-iotctrl.iotctrl_get_temperature.restype = ct.c_int16
-
-
-def get_temperature(device_path: str, debug_mode: int) -> int:
+def get_temperature(device_path: str, debug_mode: int = 0) -> float:
     """
         Get temperature in degree celsius from sensor
 
@@ -25,15 +20,16 @@ def get_temperature(device_path: str, debug_mode: int) -> int:
 
         Returns
         -------
-        the temperature reading in degree celsius
+        the temperature reading in degree celsius of the first sensor. Use
+        read_temperature() or TempSensor to read more sensors at once.
     """
 
-    temp = iotctrl.iotctrl_get_temperature(
-        ct.create_string_buffer(str.encode(device_path)), debug_mode)
-    if temp == INVALID_TEMP:
+    try:
+        readings = read_temperature(device_path, 1, bool(debug_mode))
+    except IotctrlError as e:
         raise RuntimeError('Failed to read temperature '
-                           '(some error messages could be sent to stderr)')
-    return temp / 10.0
+                           '(some error messages could be sent to stderr)') from e
+    return readings[0] / 10.0
 
 
 def set_relay(relay_path: str, state: bool) -> None:
@@ -51,7 +47,5 @@ def set_relay(relay_path: str, state: bool) -> None:
         -------
         None
     """
-    turn_on = ct.c_bool()
-    turn_on.value = state
-    return iotctrl.iotctrl_control_relay(
-        ct.create_string_buffer(str.encode(relay_path)), turn_on)
+    with Relay(relay_path) as relay:
+        relay.set(state)
@@ -0,0 +1,1023 @@
+// Native CPython binding of libiotctrl, imported as _iotctrl and re-exported
+// by iotctrl.py.
+//
+// Every call that touches a bus releases the GIL, so Python threads reading
+// different ports run in parallel. A handle is guarded by its own lock, taken
+// with the GIL released, so sharing one handle between threads is safe too.
+// Temperature readings are returned as Readings objects, which expose the C
+// array through the buffer protocol (format "h"), e.g., numpy.asarray() and
+// memoryview() wrap them without copying or boxing each element.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+#include <iotctrl/7segment-display.h>
+#include <iotctrl/dht31.h>
+#include <iotctrl/relay.h>
+#include <iotctrl/temp-sensor.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static PyObject *iotctrl_error;
+
+// Raises IotctrlError(code, message), with the C return value as .code
+static PyObject *raise_error(int code, const char *func) {
+  PyObject *exc = PyObject_CallFunction(iotctrl_error, "is", code, func);
+  if (exc == NULL)
+    return NULL;
+  PyObject *code_obj = PyLong_FromLong(code);
+  if (code_obj != NULL) {
+    PyObject_SetAttrString(exc, "code", code_obj);
+    Py_DECREF(code_obj);
+  }
+  PyErr_SetObject(iotctrl_error, exc);
+  Py_DECREF(exc);
+  return NULL;
+}
+
+static PyObject *raise_closed(void) {
+  PyErr_SetString(PyExc_ValueError, "I/O operation on closed device");
+  return NULL;
+}
+
+// Runs stmt with the GIL released and lock held
+#define WITH_LOCK_NOGIL(lock, stmt)                                            \
+  do {                                                                         \
+    PyThreadState *_save = PyEval_SaveThread();                                \
+    PyThread_acquire_lock((lock), WAIT_LOCK);                                  \
+    stmt;                                                                      \
+    PyThread_release_lock((lock));                                             \
+    PyEval_RestoreThread(_save);                                               \
+  } while (0)
+
+// ---------------------------------------------------------------- Readings
+
+typedef struct {
+  PyObject_HEAD
+  int16_t *data;
+  int ndim;
+  Py_ssize_t shape[2];
+  Py_ssize_t strides[2];
+} ReadingsObject;
+
+static PyTypeObject Readings_Type;
+
+// A C-contiguous rows x cols array of int16_t, 1-dimensional if rows is 0
+static ReadingsObject *readings_new(Py_ssize_t rows, Py_ssize_t cols) {
+  ReadingsObject *r = PyObject_New(ReadingsObject, &Readings_Type);
+  if (r == NULL)
+    return NULL;
+  const Py_ssize_t count = (rows > 0 ? rows : 1) * cols;
+  r->data = PyMem_Calloc(count > 0 ? count : 1, sizeof(int16_t));
+  if (r->data == NULL) {
+    Py_DECREF(r);
+    return (ReadingsObject *)PyErr_NoMemory();
+  }
+  if (rows > 0) {
+    r->ndim = 2;
+    r->shape[0] = rows;
+    r->shape[1] = cols;
+    r->strides[0] = cols * sizeof(int16_t);
+    r->strides[1] = sizeof(int16_t);
+  } else {
+    r->ndim = 1;
+    r->shape[0] = cols;
+    r->strides[0] = sizeof(int16_t);
+  }
+  return r;
+}
+
+static Py_ssize_t readings_count(const ReadingsObject *r) {
+  return r->ndim == 2 ? r->shape[0] * r->shape[1] : r->shape[0];
+}
+
+static void Readings_dealloc(ReadingsObject *r) {
+  PyMem_Free(r->data);
+  PyObject_Free(r);
+}
+
+static int Readings_getbuffer(ReadingsObject *r, Py_buffer *view, int flags) {
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "Readings are read-only");
+    view->obj = NULL;
+    return -1;
+  }
+  Py_INCREF(r);
+  view->obj = (PyObject *)r;
+  view->buf = r->data;
+  view->len = readings_count(r) * sizeof(int16_t);
+  view->readonly = 1;
+  view->itemsize = sizeof(int16_t);
+  view->format = (flags & PyBUF_FORMAT) ? "h" : NULL;
+  view->ndim = r->ndim;
+  view->shape = (flags & PyBUF_ND) ? r->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) ? r->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static Py_ssize_t Readings_length(ReadingsObject *r) {
+  return readings_count(r);
+}
+
+// Indexes the flattened array, use memoryview() or numpy for rows
+static PyObject *Readings_item(ReadingsObject *r, Py_ssize_t i) {
+  if (i < 0 || i >= readings_count(r)) {
+    PyErr_SetString(PyExc_IndexError, "Readings index out of range");
+    return NULL;
+  }
+  return PyLong_FromLong(r->data[i]);
+}
+
+static PyObject *Readings_get_shape(ReadingsObject *r, void *closure) {
+  (void)closure;
+  return r->ndim == 2 ? Py_BuildValue("(nn)", r->shape[0], r->shape[1])
+                      : Py_BuildValue("(n)", r->shape[0]);
+}
+
+static PyObject *Readings_repr(ReadingsObject *r) {
+  PyObject *list = PySequence_List((PyObject *)r);
+  if (list == NULL)
+    return NULL;
+  PyObject *repr = PyUnicode_FromFormat("Readings(%R)", list);
+  Py_DECREF(list);
+  return repr;
+}
+
+static PyBufferProcs Readings_as_buffer = {
+    .bf_getbuffer = (getbufferproc)Readings_getbuffer,
+};
+
+static PySequenceMethods Readings_as_sequence = {
+    .sq_length = (lenfunc)Readings_length,
+    .sq_item = (ssizeargfunc)Readings_item,
+};
+
+static PyGetSetDef Readings_getset[] = {
+    {"shape", (getter)Readings_get_shape, NULL, "shape of the array", NULL},
+    {NULL},
+};
+
+static PyTypeObject Readings_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_iotctrl.Readings",
+    .tp_doc = "Temperature readings (x 10 in degree Celsius) as a read-only "
+              "int16 buffer",
+    .tp_basicsize = sizeof(ReadingsObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)Readings_dealloc,
+    .tp_repr = (reprfunc)Readings_repr,
+    .tp_as_buffer = &Readings_as_buffer,
+    .tp_as_sequence = &Readings_as_sequence,
+    .tp_getset = Readings_getset,
+};
+
+static int check_sensor_count(int sensor_count) {
+  if (sensor_count < 1 || sensor_count > UINT8_MAX) {
+    PyErr_SetString(PyExc_ValueError, "sensor_count must be in [1, 255]");
+    return -1;
+  }
+  return 0;
+}
+
+// -------------------------------------------------------------- TempSensor
+
+typedef struct {
+  PyObject_HEAD
+  struct iotctrl_temp_sensor_handle *h;
+  PyThread_type_lock lock;
+} TempSensorObject;
+
+static int TempSensor_init(TempSensorObject *self, PyObject *args,
+                           PyObject *kwds) {
+  static char *kwlist[] = {"device_path", "debug", NULL};
+  const char *device_path;
+  int debug = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|p", kwlist, &device_path,
+                                   &debug))
+    return -1;
+  if (self->lock == NULL && (self->lock = PyThread_allocate_lock()) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  iotctrl_temp_sensor_close(self->h);
+  // Only prepares the session, the port is opened by the first read
+  self->h = iotctrl_temp_sensor_open(device_path, debug);
+  if (self->h == NULL) {
+    raise_error(-1, "iotctrl_temp_sensor_open()");
+    return -1;
+  }
+  return 0;
+}
+
+static void TempSensor_dealloc(TempSensorObject *self) {
+  iotctrl_temp_sensor_close(self->h);
+  if (self->lock != NULL)
+    PyThread_free_lock(self->lock);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *TempSensor_read(TempSensorObject *self, PyObject *args) {
+  int sensor_count;
+  if (!PyArg_ParseTuple(args, "i", &sensor_count) ||
+      check_sensor_count(sensor_count) != 0)
+    return NULL;
+  if (self->h == NULL)
+    return raise_closed();
+  ReadingsObject *r = readings_new(0, sensor_count);
+  if (r == NULL)
+    return NULL;
+  int ret;
+  WITH_LOCK_NOGIL(self->lock,
+                  ret = self->h == NULL ? INT_MIN
+                                        : iotctrl_temp_sensor_read(
+                                              self->h, sensor_count, r->data));
+  if (ret != 0) {
+    Py_DECREF(r);
+    return ret == INT_MIN ? raise_closed()
+                          : raise_error(ret, "iotctrl_temp_sensor_read()");
+  }
+  return (PyObject *)r;
+}
+
+static PyObject *TempSensor_read_slaves(TempSensorObject *self,
+                                        PyObject *args) {
+  PyObject *addrs_obj;
+  int sensor_count;
+  if (!PyArg_ParseTuple(args, "Oi", &addrs_obj, &sensor_count) ||
+      check_sensor_count(sensor_count) != 0)
+    return NULL;
+  if (self->h == NULL)
+    return raise_closed();
+  PyObject *addrs_seq =
+      PySequence_Fast(addrs_obj, "slave_addrs must be a sequence");
+  if (addrs_seq == NULL)
+    return NULL;
+  const Py_ssize_t slave_count = PySequence_Fast_GET_SIZE(addrs_seq);
+  if (slave_count == 0) {
+    Py_DECREF(addrs_seq);
+    PyErr_SetString(PyExc_ValueError, "slave_addrs must not be empty");
+    return NULL;
+  }
+  uint8_t *addrs = PyMem_Malloc(slave_count);
+  int *results = PyMem_Malloc(slave_count * sizeof(int));
+  ReadingsObject *r = NULL;
+  PyObject *ret_obj = NULL;
+  if (addrs == NULL || results == NULL) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
+  for (Py_ssize_t i = 0; i < slave_count; ++i) {
+    const long addr = PyLong_AsLong(PySequence_Fast_GET_ITEM(addrs_seq, i));
+    if (addr < 1 || addr > 247) {
+      if (!PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError,
+                        "Modbus slave addresses must be in [1, 247]");
+      goto cleanup;
+    }
+    addrs[i] = addr;
+  }
+  r = readings_new(slave_count, sensor_count);
+  if (r == NULL)
+    goto cleanup;
+  bool closed = false;
+  WITH_LOCK_NOGIL(self->lock,
+                  closed = self->h == NULL;
+                  if (!closed) iotctrl_temp_sensor_read_slaves(
+                      self->h, addrs, slave_count, sensor_count, r->data,
+                      results));
+  if (closed) {
+    raise_closed();
+    goto cleanup;
+  }
+  PyObject *results_obj = PyTuple_New(slave_count);
+  if (results_obj == NULL)
+    goto cleanup;
+  for (Py_ssize_t i = 0; i < slave_count; ++i) {
+    // Rows of failed slaves are in an unspecified state otherwise
+    if (results[i] != 0)
+      for (int j = 0; j < sensor_count; ++j)
+        r->data[i * sensor_count + j] = IOTCTRL_INVALID_TEMP;
+    PyTuple_SET_ITEM(results_obj, i, PyLong_FromLong(results[i]));
+  }
+  ret_obj = Py_BuildValue("(ON)", r, results_obj);
+
+cleanup:
+  Py_XDECREF(r);
+  PyMem_Free(results);
+  PyMem_Free(addrs);
+  Py_DECREF(addrs_seq);
+  return ret_obj;
+}
+
+static PyObject *TempSensor_close(TempSensorObject *self,
+                                  PyObject *Py_UNUSED(ignored)) {
+  if (self->lock != NULL)
+    WITH_LOCK_NOGIL(self->lock, iotctrl_temp_sensor_close(self->h);
+                    self->h = NULL);
+  Py_RETURN_NONE;
+}
+
+static PyObject *enter(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+  Py_INCREF(self);
+  return self;
+}
+
+static PyObject *TempSensor_exit(TempSensorObject *self, PyObject *args) {
+  (void)args;
+  return TempSensor_close(self, NULL);
+}
+
+static PyMethodDef TempSensor_methods[] = {
+    {"read", (PyCFunction)TempSensor_read, METH_VARARGS,
+     "read(sensor_count) -> Readings\n\nQuery the sensors of the device at "
+     "the default Modbus address"},
+    {"read_slaves", (PyCFunction)TempSensor_read_slaves, METH_VARARGS,
+     "read_slaves(slave_addrs, sensor_count) -> (Readings, results)\n\nQuery "
+     "several devices on one RS-485 bus. Readings has shape (len(slave_addrs),"
+     " sensor_count), results[i] is 0 or the error code of slave i whose row "
+     "is then filled with INVALID_TEMP."},
+    {"close", (PyCFunction)TempSensor_close, METH_NOARGS, "Close the port"},
+    {"__enter__", (PyCFunction)enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)TempSensor_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyTypeObject TempSensor_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_iotctrl.TempSensor",
+    .tp_doc = "TempSensor(device_path, debug=False)\n\nA persistent Modbus "
+              "RTU session to DL11-MC temperature sensors",
+    .tp_basicsize = sizeof(TempSensorObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)TempSensor_init,
+    .tp_dealloc = (destructor)TempSensor_dealloc,
+    .tp_methods = TempSensor_methods,
+};
+
+// ------------------------------------------------------------------- DHT31
+
+typedef struct {
+  PyObject_HEAD
+  struct iotctrl_dht31_handle *h;
+  PyThread_type_lock lock;
+} DHT31Object;
+
+static int DHT31_init(DHT31Object *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"device_path", "addr", NULL};
+  const char *device_path;
+  unsigned char addr = 0x44;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|b", kwlist, &device_path,
+                                   &addr))
+    return -1;
+  if (self->lock == NULL && (self->lock = PyThread_allocate_lock()) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  struct iotctrl_dht31_handle *h;
+  Py_BEGIN_ALLOW_THREADS
+  h = iotctrl_dht31_open(device_path, addr);
+  Py_END_ALLOW_THREADS
+  if (h == NULL) {
+    raise_error(-1, "iotctrl_dht31_open()");
+    return -1;
+  }
+  iotctrl_dht31_close(self->h);
+  self->h = h;
+  return 0;
+}
+
+static void DHT31_dealloc(DHT31Object *self) {
+  if (self->h != NULL) {
+    // Sends a break command if the sensor measures periodically
+    Py_BEGIN_ALLOW_THREADS
+    iotctrl_dht31_close(self->h);
+    Py_END_ALLOW_THREADS
+  }
+  if (self->lock != NULL)
+    PyThread_free_lock(self->lock);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *DHT31_configure(DHT31Object *self, PyObject *args,
+                                 PyObject *kwds) {
+  static char *kwlist[] = {"acquisition", "repeatability", "clock_stretching",
+                           NULL};
+  struct iotctrl_dht31_config config = {IOTCTRL_DHT31_SINGLE_SHOT,
+                                        IOTCTRL_DHT31_REPEATABILITY_HIGH, true};
+  int acquisition = config.acquisition, repeatability = config.repeatability;
+  int clock_stretching = config.clock_stretching;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iip", kwlist, &acquisition,
+                                   &repeatability, &clock_stretching))
+    return NULL;
+  if (acquisition < IOTCTRL_DHT31_SINGLE_SHOT ||
+      acquisition > IOTCTRL_DHT31_PERIODIC_10_MPS ||
+      repeatability < IOTCTRL_DHT31_REPEATABILITY_HIGH ||
+      repeatability > IOTCTRL_DHT31_REPEATABILITY_LOW) {
+    PyErr_SetString(PyExc_ValueError, "Invalid acquisition or repeatability");
+    return NULL;
+  }
+  config.acquisition = acquisition;
+  config.repeatability = repeatability;
+  config.clock_stretching = clock_stretching;
+  if (self->h == NULL)
+    return raise_closed();
+  int ret = INT_MIN;
+  WITH_LOCK_NOGIL(self->lock,
+                  if (self->h != NULL)
+                      ret = iotctrl_dht31_configure(self->h, &config));
+  if (ret == INT_MIN)
+    return raise_closed();
+  if (ret != 0)
+    return raise_error(ret, "iotctrl_dht31_configure()");
+  Py_RETURN_NONE;
+}
+
+static PyObject *DHT31_measure(DHT31Object *self,
+                               PyObject *Py_UNUSED(ignored)) {
+  if (self->h == NULL)
+    return raise_closed();
+  float temp_celsius, relative_humidity;
+  int ret = INT_MIN;
+  WITH_LOCK_NOGIL(self->lock, if (self->h != NULL) ret = iotctrl_dht31_measure(
+                                  self->h, &temp_celsius, &relative_humidity));
+  if (ret == INT_MIN)
+    return raise_closed();
+  // No new measurement yet in periodic mode
+  if (ret == -2)
+    Py_RETURN_NONE;
+  if (ret != 0)
+    return raise_error(ret, "iotctrl_dht31_measure()");
+  return Py_BuildValue("(dd)", temp_celsius, relative_humidity);
+}
+
+static PyObject *DHT31_close(DHT31Object *self, PyObject *Py_UNUSED(ignored)) {
+  if (self->lock != NULL)
+    WITH_LOCK_NOGIL(self->lock, iotctrl_dht31_close(self->h); self->h = NULL);
+  Py_RETURN_NONE;
+}
+
+static PyObject *DHT31_exit(DHT31Object *self, PyObject *args) {
+  (void)args;
+  return DHT31_close(self, NULL);
+}
+
+static PyMethodDef DHT31_methods[] = {
+    {"configure", (PyCFunction)(void (*)(void))DHT31_configure,
+     METH_VARARGS | METH_KEYWORDS,
+     "configure(acquisition=SINGLE_SHOT, repeatability=REPEATABILITY_HIGH, "
+     "clock_stretching=True)"},
+    {"measure", (PyCFunction)DHT31_measure, METH_NOARGS,
+     "measure() -> (temp_celsius, relative_humidity)\n\nOr None if no new "
+     "measurement is available yet in periodic mode"},
+    {"close", (PyCFunction)DHT31_close, METH_NOARGS, "Close the bus"},
+    {"__enter__", (PyCFunction)enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)DHT31_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyTypeObject DHT31_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_iotctrl.DHT31",
+    .tp_doc = "DHT31(device_path, addr=0x44)\n\nAn SHT31 sensor on an I2C "
+              "bus, device_path may start with \"sim:\"",
+    .tp_basicsize = sizeof(DHT31Object),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)DHT31_init,
+    .tp_dealloc = (destructor)DHT31_dealloc,
+    .tp_methods = DHT31_methods,
+};
+
+// ------------------------------------------------------------------- Relay
+
+typedef struct {
+  PyObject_HEAD
+  struct iotctrl_relay_handle *h;
+  PyThread_type_lock lock;
+} RelayObject;
+
+static int Relay_init(RelayObject *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"relay_path", NULL};
+  const char *relay_path;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &relay_path))
+    return -1;
+  if (self->lock == NULL && (self->lock = PyThread_allocate_lock()) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  struct iotctrl_relay_handle *h;
+  Py_BEGIN_ALLOW_THREADS
+  h = iotctrl_relay_open(relay_path);
+  Py_END_ALLOW_THREADS
+  if (h == NULL) {
+    raise_error(1, "iotctrl_relay_open()");
+    return -1;
+  }
+  iotctrl_relay_close(self->h);
+  self->h = h;
+  return 0;
+}
+
+static void Relay_dealloc(RelayObject *self) {
+  iotctrl_relay_close(self->h);
+  if (self->lock != NULL)
+    PyThread_free_lock(self->lock);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *relay_result(int ret, const char *func) {
+  if (ret == INT_MIN)
+    return raise_closed();
+  if (ret != 0)
+    return raise_error(ret, func);
+  Py_RETURN_NONE;
+}
+
+static PyObject *Relay_set(RelayObject *self, PyObject *args) {
+  int turn_on;
+  if (!PyArg_ParseTuple(args, "p", &turn_on))
+    return NULL;
+  if (self->h == NULL)
+    return raise_closed();
+  int ret = INT_MIN;
+  WITH_LOCK_NOGIL(self->lock, if (self->h != NULL) ret =
+                                  iotctrl_relay_set(self->h, turn_on));
+  return relay_result(ret, "iotctrl_relay_set()");
+}
+
+static PyObject *Relay_set_channel(RelayObject *self, PyObject *args) {
+  unsigned char channel;
+  int turn_on;
+  if (!PyArg_ParseTuple(args, "bp", &channel, &turn_on))
+    return NULL;
+  if (self->h == NULL)
+    return raise_closed();
+  int ret = INT_MIN;
+  WITH_LOCK_NOGIL(self->lock,
+                  if (self->h != NULL) ret = iotctrl_relay_set_channel(
+                                           self->h, channel, turn_on));
+  return relay_result(ret, "iotctrl_relay_set_channel()");
+}
+
+static PyObject *Relay_set_mask(RelayObject *self, PyObject *args) {
+  unsigned char channel_count, mask;
+  if (!PyArg_ParseTuple(args, "bb", &channel_count, &mask))
+    return NULL;
+  if (self->h == NULL)
+    return raise_closed();
+  int ret = INT_MIN;
+  WITH_LOCK_NOGIL(self->lock,
+                  if (self->h != NULL) ret = iotctrl_relay_set_mask(
+                                           self->h, channel_count, mask));
+  return relay_result(ret, "iotctrl_relay_set_mask()");
+}
+
+static PyObject *Relay_close(RelayObject *self, PyObject *Py_UNUSED(ignored)) {
+  if (self->lock != NULL)
+    WITH_LOCK_NOGIL(self->lock, iotctrl_relay_close(self->h); self->h = NULL);
+  Py_RETURN_NONE;
+}
+
+static PyObject *Relay_exit(RelayObject *self, PyObject *args) {
+  (void)args;
+  return Relay_close(self, NULL);
+}
+
+static PyMethodDef Relay_methods[] = {
+    {"set", (PyCFunction)Relay_set, METH_VARARGS,
+     "set(turn_on)\n\nSwitch channel 1 on or off"},
+    {"set_channel", (PyCFunction)Relay_set_channel, METH_VARARGS,
+     "set_channel(channel, turn_on)\n\nSwitch one channel (from 1) on or off"},
+    {"set_mask", (PyCFunction)Relay_set_mask, METH_VARARGS,
+     "set_mask(channel_count, mask)\n\nSet channels 1 to channel_count at "
+     "once, bit n turns channel n + 1 on"},
+    {"close", (PyCFunction)Relay_close, METH_NOARGS, "Close the tty"},
+    {"__enter__", (PyCFunction)enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)Relay_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyTypeObject Relay_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_iotctrl.Relay",
+    .tp_doc = "Relay(relay_path)\n\nAn LCUS-1 style USB relay board",
+    .tp_basicsize = sizeof(RelayObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Relay_init,
+    .tp_dealloc = (destructor)Relay_dealloc,
+    .tp_methods = Relay_methods,
+};
+
+// ----------------------------------------------------- SevenSegmentDisplay
+
+// The handle serializes writers itself, but its frame mutex is held between
+// begin_frame() and commit_frame(), so every call releases the GIL in case it
+// has to wait for another thread's frame. For the same reason no lock is held
+// during calls, a writer waiting for the frame would keep the thread owning
+// the frame from committing it. Calls and open frames pin the handle instead
+// and close() waits for them to finish before destroying it.
+typedef struct {
+  PyObject_HEAD
+  struct iotctrl_7seg_disp_handle *h;
+  // Whether mutex and idle are initialized
+  bool sync_ready;
+  // Only held briefly and never while waiting for the GIL, so it may be
+  // taken with the GIL held
+  pthread_mutex_t mutex;
+  // Signalled when users drops to 0
+  pthread_cond_t idle;
+  // Calls using the handle with the GIL released plus open frames, protected
+  // by mutex
+  int users;
+  // The thread inside begin_frame()/commit_frame(), how deeply nested and
+  // the handle it pinned, protected by the GIL
+  unsigned long frame_owner;
+  int frame_depth;
+  struct iotctrl_7seg_disp_handle *frame_h;
+} SevenSegmentDisplayObject;
+
+static bool in_own_frame(const SevenSegmentDisplayObject *self) {
+  return self->frame_depth > 0 &&
+         self->frame_owner == PyThread_get_thread_ident();
+}
+
+// Returns the handle, which stays valid until unpin_display(), or NULL if the
+// display is closed. The thread owning the frame keeps the handle it pinned
+// even if close() is waiting for that frame to be committed.
+static struct iotctrl_7seg_disp_handle *
+pin_display(SevenSegmentDisplayObject *self) {
+  pthread_mutex_lock(&self->mutex);
+  struct iotctrl_7seg_disp_handle *h =
+      in_own_frame(self) ? self->frame_h : self->h;
+  if (h != NULL)
+    ++self->users;
+  pthread_mutex_unlock(&self->mutex);
+  return h;
+}
+
+static void unpin_display(SevenSegmentDisplayObject *self) {
+  pthread_mutex_lock(&self->mutex);
+  if (--self->users == 0)
+    pthread_cond_broadcast(&self->idle);
+  pthread_mutex_unlock(&self->mutex);
+}
+
+// Detach the handle and destroy it once no call or frame is using it any
+// more. The GIL must be released.
+static void close_display(SevenSegmentDisplayObject *self) {
+  pthread_mutex_lock(&self->mutex);
+  struct iotctrl_7seg_disp_handle *h = self->h;
+  self->h = NULL;
+  while (self->users > 0)
+    pthread_cond_wait(&self->idle, &self->mutex);
+  pthread_mutex_unlock(&self->mutex);
+  // Joins the refresh thread
+  if (h != NULL)
+    iotctrl_7seg_disp_destroy(h);
+}
+
+// close_display() would wait for the caller's own frame forever
+static int check_not_in_own_frame(const SevenSegmentDisplayObject *self) {
+  if (!in_own_frame(self))
+    return 0;
+  PyErr_SetString(PyExc_RuntimeError,
+                  "The display cannot be closed between begin_frame() and "
+                  "commit_frame()");
+  return -1;
+}
+
+static int SevenSegmentDisplay_init(SevenSegmentDisplayObject *self,
+                                    PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"gpiochip_path",   "data_pin",     "clock_pin",
+                           "latch_pin",       "chain_num",    "refresh_rate_hz",
+                           "transport",       "spidev_path",  "spi_speed_hz",
+                           NULL};
+  struct iotctrl_7seg_disp_connection conn = {0};
+  const char *gpiochip_path, *spidev_path = "";
+  unsigned char chain_num = 1;
+  unsigned short refresh_rate_hz = 1000;
+  int transport = IOTCTRL_7SEG_DISP_TRANSPORT_GPIO;
+  unsigned int spi_speed_hz = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+          args, kwds, "sbbb|bHisI", kwlist, &gpiochip_path,
+          &conn.data_pin_num, &conn.clock_pin_num, &conn.latch_pin_num,
+          &chain_num, &refresh_rate_hz, &transport, &spidev_path,
+          &spi_speed_hz))
+    return -1;
+  if (strlen(gpiochip_path) > PATH_MAX || strlen(spidev_path) > PATH_MAX) {
+    PyErr_SetString(PyExc_ValueError, "Path is too long");
+    return -1;
+  }
+  if (transport < IOTCTRL_7SEG_DISP_TRANSPORT_GPIO ||
+      transport > IOTCTRL_7SEG_DISP_TRANSPORT_MOCK) {
+    PyErr_SetString(PyExc_ValueError, "Invalid transport");
+    return -1;
+  }
+  if (check_not_in_own_frame(self) != 0)
+    return -1;
+  if (!self->sync_ready) {
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->idle, NULL);
+    self->sync_ready = true;
+  }
+  strcpy(conn.gpiochip_path, gpiochip_path);
+  strcpy(conn.spidev_path, spidev_path);
+  conn.chain_num = chain_num;
+  conn.refresh_rate_hz = refresh_rate_hz;
+  conn.transport = transport;
+  conn.spi_speed_hz = spi_speed_hz;
+  struct iotctrl_7seg_disp_handle *h;
+  Py_BEGIN_ALLOW_THREADS
+  h = iotctrl_7seg_disp_init(conn);
+  Py_END_ALLOW_THREADS
+  if (h == NULL) {
+    raise_error(-1, "iotctrl_7seg_disp_init()");
+    return -1;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  close_display(self);
+  Py_END_ALLOW_THREADS
+  self->h = h;
+  return 0;
+}
+
+static void SevenSegmentDisplay_dealloc(SevenSegmentDisplayObject *self) {
+  if (self->sync_ready) {
+    // The last reference may go away in the middle of a frame. Its owner
+    // can still end it, the frame mutex of another thread's frame cannot be
+    // unlocked, so the handle is leaked rather than destroyed while locked.
+    bool leak = false;
+    if (in_own_frame(self)) {
+      for (; self->frame_depth > 0; --self->frame_depth) {
+        iotctrl_7seg_disp_commit_frame(self->frame_h);
+        unpin_display(self);
+      }
+    } else if (self->frame_depth > 0) {
+      fprintf(stderr, "SevenSegmentDisplay freed during another thread's "
+                      "frame, leaking the display\n");
+      leak = true;
+    }
+    if (!leak) {
+      Py_BEGIN_ALLOW_THREADS
+      close_display(self);
+      Py_END_ALLOW_THREADS
+      pthread_cond_destroy(&self->idle);
+      pthread_mutex_destroy(&self->mutex);
+    }
+  }
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *SevenSegmentDisplay_update_digit(SevenSegmentDisplayObject *self,
+                                                  PyObject *args) {
+  int idx;
+  unsigned char val;
+  if (!PyArg_ParseTuple(args, "ib", &idx, &val))
+    return NULL;
+  if (!self->sync_ready)
+    return raise_closed();
+  struct iotctrl_7seg_disp_handle *h = pin_display(self);
+  if (h == NULL)
+    return raise_closed();
+  Py_BEGIN_ALLOW_THREADS
+  iotctrl_7seg_disp_update_digit(h, idx, val);
+  unpin_display(self);
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
+
+static PyObject *SevenSegmentDisplay_update_float(SevenSegmentDisplayObject *self,
+                                                  PyObject *args) {
+  float val;
+  int float_idx;
+  if (!PyArg_ParseTuple(args, "fi", &val, &float_idx))
+    return NULL;
+  if (!self->sync_ready)
+    return raise_closed();
+  struct iotctrl_7seg_disp_handle *h = pin_display(self);
+  if (h == NULL)
+    return raise_closed();
+  Py_BEGIN_ALLOW_THREADS
+  iotctrl_7seg_disp_update_as_four_digit_float(h, val, float_idx);
+  unpin_display(self);
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
+
+static PyObject *SevenSegmentDisplay_begin_frame(SevenSegmentDisplayObject *self,
+                                                 PyObject *Py_UNUSED(ignored)) {
+  if (!self->sync_ready)
+    return raise_closed();
+  // The pin is kept until the matching commit_frame()
+  struct iotctrl_7seg_disp_handle *h = pin_display(self);
+  if (h == NULL)
+    return raise_closed();
+  Py_BEGIN_ALLOW_THREADS
+  iotctrl_7seg_disp_begin_frame(h);
+  Py_END_ALLOW_THREADS
+  if (self->frame_depth++ == 0) {
+    self->frame_owner = PyThread_get_thread_ident();
+    self->frame_h = h;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+SevenSegmentDisplay_commit_frame(SevenSegmentDisplayObject *self,
+                                 PyObject *Py_UNUSED(ignored)) {
+  // Unlocking the frame mutex of another thread's frame is undefined
+  if (!in_own_frame(self)) {
+    PyErr_SetString(PyExc_RuntimeError, "commit_frame() without begin_frame()");
+    return NULL;
+  }
+  // Updated before the frame mutex is released, the next owner sets them
+  // once it has the mutex
+  struct iotctrl_7seg_disp_handle *h = self->frame_h;
+  if (--self->frame_depth == 0) {
+    self->frame_owner = 0;
+    self->frame_h = NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  iotctrl_7seg_disp_commit_frame(h);
+  unpin_display(self);
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
+
+static PyObject *SevenSegmentDisplay_close(SevenSegmentDisplayObject *self,
+                                           PyObject *Py_UNUSED(ignored)) {
+  if (check_not_in_own_frame(self) != 0)
+    return NULL;
+  if (self->sync_ready) {
+    Py_BEGIN_ALLOW_THREADS
+    close_display(self);
+    Py_END_ALLOW_THREADS
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *SevenSegmentDisplay_exit(SevenSegmentDisplayObject *self,
+                                          PyObject *args) {
+  (void)args;
+  return SevenSegmentDisplay_close(self, NULL);
+}
+
+static PyMethodDef SevenSegmentDisplay_methods[] = {
+    {"update_digit", (PyCFunction)SevenSegmentDisplay_update_digit,
+     METH_VARARGS,
+     "update_digit(idx, val)\n\nSet the segments of one digit, see "
+     "iotctrl_7seg_disp_chars_table"},
+    {"update_float", (PyCFunction)SevenSegmentDisplay_update_float,
+     METH_VARARGS,
+     "update_float(val, float_idx)\n\nShow val in (-100, 1000) on the "
+     "float_idx-th group of four digits"},
+    {"begin_frame", (PyCFunction)SevenSegmentDisplay_begin_frame, METH_NOARGS,
+     "Start composing a frame, updates until commit_frame() show up together"},
+    {"commit_frame", (PyCFunction)SevenSegmentDisplay_commit_frame,
+     METH_NOARGS,
+     "Publish the frame composed since begin_frame(), which must have been "
+     "called by the same thread"},
+    {"close", (PyCFunction)SevenSegmentDisplay_close, METH_NOARGS,
+     "Stop refreshing and release the GPIO lines, waits for other threads' "
+     "frames to be committed"},
+    {"__enter__", (PyCFunction)enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)SevenSegmentDisplay_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyTypeObject SevenSegmentDisplay_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_iotctrl.SevenSegmentDisplay",
+    .tp_doc = "SevenSegmentDisplay(gpiochip_path, data_pin, clock_pin, "
+              "latch_pin, chain_num=1, refresh_rate_hz=1000, "
+              "transport=TRANSPORT_GPIO, spidev_path='', spi_speed_hz=0)",
+    .tp_basicsize = sizeof(SevenSegmentDisplayObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)SevenSegmentDisplay_init,
+    .tp_dealloc = (destructor)SevenSegmentDisplay_dealloc,
+    .tp_methods = SevenSegmentDisplay_methods,
+};
+
+// ------------------------------------------------------------------ module
+
+static PyObject *iotctrl_read_temperature(PyObject *module, PyObject *args,
+                                          PyObject *kwds) {
+  (void)module;
+  static char *kwlist[] = {"device_path", "sensor_count", "debug", NULL};
+  const char *device_path;
+  int sensor_count = 1, debug = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|ip", kwlist, &device_path,
+                                   &sensor_count, &debug) ||
+      check_sensor_count(sensor_count) != 0)
+    return NULL;
+  ReadingsObject *r = readings_new(0, sensor_count);
+  if (r == NULL)
+    return NULL;
+  int ret;
+  Py_BEGIN_ALLOW_THREADS
+  ret =
+      iotctrl_get_temperature(device_path, sensor_count, r->data, debug);
+  Py_END_ALLOW_THREADS
+  if (ret != 0) {
+    Py_DECREF(r);
+    return raise_error(ret, "iotctrl_get_temperature()");
+  }
+  return (PyObject *)r;
+}
+
+static PyMethodDef iotctrl_methods[] = {
+    {"read_temperature", (PyCFunction)(void (*)(void))iotctrl_read_temperature,
+     METH_VARARGS | METH_KEYWORDS,
+     "read_temperature(device_path, sensor_count=1, debug=False) -> "
+     "Readings\n\nA one-off iotctrl_get_temperature()"},
+    {NULL},
+};
+
+static struct PyModuleDef iotctrl_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_iotctrl",
+    .m_doc = "Native binding of libiotctrl",
+    .m_size = -1,
+    .m_methods = iotctrl_methods,
+};
+
+static int add_type(PyObject *m, PyTypeObject *type, const char *name) {
+  if (PyType_Ready(type) != 0)
+    return -1;
+  Py_INCREF(type);
+  if (PyModule_AddObject(m, name, (PyObject *)type) != 0) {
+    Py_DECREF(type);
+    return -1;
+  }
+  return 0;
+}
+
+// PyModule_AddObject() steals the reference on success only, the module
+// keeps iotctrl_error alive while the global holds another reference
+static int add_error(PyObject *m) {
+  Py_INCREF(iotctrl_error);
+  if (PyModule_AddObject(m, "IotctrlError", iotctrl_error) != 0) {
+    Py_DECREF(iotctrl_error);
+    return -1;
+  }
+  return 0;
+}
+
+PyMODINIT_FUNC PyInit__iotctrl(void) {
+  PyObject *m = PyModule_Create(&iotctrl_module);
+  if (m == NULL)
+    return NULL;
+  iotctrl_error = PyErr_NewExceptionWithDoc(
+      "_iotctrl.IotctrlError",
+      "Raised with (code, function) when a libiotctrl call fails, code is "
+      "also available as .code",
+      PyExc_RuntimeError, NULL);
+  if (iotctrl_error == NULL || add_error(m) != 0 ||
+      add_type(m, &Readings_Type, "Readings") != 0 ||
+      add_type(m, &TempSensor_Type, "TempSensor") != 0 ||
+      add_type(m, &DHT31_Type, "DHT31") != 0 ||
+      add_type(m, &Relay_Type, "Relay") != 0 ||
+      add_type(m, &SevenSegmentDisplay_Type, "SevenSegmentDisplay") != 0 ||
+      PyModule_AddIntConstant(m, "INVALID_TEMP", IOTCTRL_INVALID_TEMP) != 0 ||
+      PyModule_AddIntConstant(m, "DEFAULT_SLAVE",
+                              IOTCTRL_TEMP_SENSOR_DEFAULT_SLAVE) != 0 ||
+      PyModule_AddIntConstant(m, "SINGLE_SHOT", IOTCTRL_DHT31_SINGLE_SHOT) ||
+      PyModule_AddIntConstant(m, "PERIODIC_0_5_MPS",
+                              IOTCTRL_DHT31_PERIODIC_0_5_MPS) ||
+      PyModule_AddIntConstant(m, "PERIODIC_1_MPS",
+                              IOTCTRL_DHT31_PERIODIC_1_MPS) ||
+      PyModule_AddIntConstant(m, "PERIODIC_2_MPS",
+                              IOTCTRL_DHT31_PERIODIC_2_MPS) ||
+      PyModule_AddIntConstant(m, "PERIODIC_4_MPS",
+                              IOTCTRL_DHT31_PERIODIC_4_MPS) ||
+      PyModule_AddIntConstant(m, "PERIODIC_10_MPS",
+                              IOTCTRL_DHT31_PERIODIC_10_MPS) ||
+      PyModule_AddIntConstant(m, "REPEATABILITY_HIGH",
+                              IOTCTRL_DHT31_REPEATABILITY_HIGH) ||
+      PyModule_AddIntConstant(m, "REPEATABILITY_MEDIUM",
+                              IOTCTRL_DHT31_REPEATABILITY_MEDIUM) ||
+      PyModule_AddIntConstant(m, "REPEATABILITY_LOW",
+                              IOTCTRL_DHT31_REPEATABILITY_LOW) ||
+      PyModule_AddIntConstant(m, "TRANSPORT_GPIO",
+                              IOTCTRL_7SEG_DISP_TRANSPORT_GPIO) ||
+      PyModule_AddIntConstant(m, "TRANSPORT_SPI",
+                              IOTCTRL_7SEG_DISP_TRANSPORT_SPI) ||
+      PyModule_AddIntConstant(m, "TRANSPORT_MOCK",
+                              IOTCTRL_7SEG_DISP_TRANSPORT_MOCK)) {
+    Py_XDECREF(iotctrl_error);
+    Py_DECREF(m);
+    return NULL;
+  }
+  return m;
+}
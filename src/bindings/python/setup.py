@@ -0,0 +1,16 @@
+from setuptools import Extension, setup
+
+# Links the static libiotctrl.a that the CMake build copies next to this file,
+# or the installed one from /usr/local/lib
+setup(
+    name='iotctrl',
+    py_modules=['iotctrl'],
+    ext_modules=[
+        Extension('_iotctrl',
+                  sources=['iotctrlmodule.c'],
+                  include_dirs=['/usr/local/include'],
+                  library_dirs=['.', '/usr/local/lib'],
+                  libraries=['iotctrl', 'modbus', 'gpiod', 'pthread', 'rt'],
+                  extra_compile_args=['-std=gnu11']),
+    ],
+)
@@ -1,12 +1,15 @@
-from iotctrl import get_temperature, INVALID_TEMP
+from iotctrl import TempSensor
 
 import argparse
 
 parser = argparse.ArgumentParser(description='Temp Sensor Tool')
 parser.add_argument('-d', '--device-path', required=True,
                     help='path of the device, e.g. /dev/ttyUSB0')
+parser.add_argument('-c', '--sensor-count', type=int, default=1,
+                    help='number of sensors, typically 1 or 2')
 parser.add_argument('-v', '--verbose', action='store_true',
                     help='enable verbose mode')
 
 args = parser.parse_args()
-print(get_temperature(args.device_path, args.verbose))
+with TempSensor(args.device_path, args.verbose) as sensor:
+    print([r / 10.0 for r in sensor.read(args.sensor_count)])
@@ -1,8 +1,12 @@
+#define _GNU_SOURCE // pthread_setaffinity_np()
 #include "7segment-display.h"
+#include "transport.h"
 
-#include <gpiod.h>
+#include <linux/spi/spidev.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
 #include <pthread.h>
@@ -10,24 +14,254 @@
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BIT_PER_DIGIT 8
 #define DIGIT_PER_MODULE 4
 
-void push_bit(struct iotctrl_7seg_disp_handle handle, bool bit) {
-  gpiod_line_set_value(handle.line_clk, 0);
-  gpiod_line_set_value(handle.line_data, bit);
-  gpiod_line_set_value(handle.line_clk, 1);
+// Bit masks of an edge, i.e., the values of the three lines after a
+// iotctrl_gpio_output_set() call
+#define EDGE_DATA 0x1
+#define EDGE_CLK 0x2
+#define EDGE_LATCH 0x4
+
+// Line values for each edge mask, in the order the lines are added to the bulk
+static const int edge_values[8][3] = {
+    {0, 0, 0}, {1, 0, 0}, {0, 1, 0}, {1, 1, 0},
+    {0, 0, 1}, {1, 0, 1}, {0, 1, 1}, {1, 1, 1},
+};
+
+// Segments off, no digit selected
+#define BLANK_WORD 0xFF00
+
+struct iotctrl_7seg_disp_transport_ops {
+  size_t bytes_per_word;
+  size_t bytes_per_latch;
+  // Append the compiled form of a word/latch to out and return the new end
+  uint8_t *(*compile_word)(uint16_t val_and_pos, uint8_t *out);
+  uint8_t *(*compile_latch)(uint8_t *out);
+  int (*open)(struct iotctrl_7seg_disp_handle *h,
+              const struct iotctrl_7seg_disp_connection *conn);
+  void (*close)(struct iotctrl_7seg_disp_handle *h);
+  // Replay one compiled step, called by the refresh thread only. Returns 0
+  // on success or -1 if the transport failed.
+  int (*shift_out_step)(struct iotctrl_7seg_disp_handle *h,
+                        const uint8_t *step);
+};
+
+// Bit-banging one bit used to take three ioctl()s (clock low, set data, clock
+// high). The 74HC595 only samples data on the rising clock edge, so dropping
+// the clock and setting data can happen at once, leaving two bulk writes per
+// bit. The latch is raised after the last word and lowered together with the
+// first edge of the next step, i.e., 33 instead of 50 ioctl()s per digit.
+static uint8_t *compile_word_edges(uint16_t val_and_pos, uint8_t *edges) {
+  for (int i = sizeof(uint16_t) * CHAR_BIT - 1; i >= 0; --i) {
+    const uint8_t data = (val_and_pos >> i) & 1 ? EDGE_DATA : 0;
+    *edges++ = data;
+    *edges++ = data | EDGE_CLK;
+  }
+  return edges;
+}
+
+static uint8_t *compile_latch_edge(uint8_t *edges) {
+  *edges = (edges[-1] & EDGE_DATA) | EDGE_LATCH;
+  return edges + 1;
 }
 
-bool extract_bit(uint16_t value, int pos) { return (value & (1 << pos)); }
+// SPI shifts out the most significant bit first, i.e., high byte first
+static uint8_t *compile_word_bytes(uint16_t val_and_pos, uint8_t *bytes) {
+  *bytes++ = val_and_pos >> 8;
+  *bytes++ = val_and_pos & 0xFF;
+  return bytes;
+}
 
-void write_single_digit_data_to_register(struct iotctrl_7seg_disp_handle handle,
-                                         uint16_t value) {
-  for (int i = sizeof(uint16_t) * CHAR_BIT - 1; i >= 0; --i) {
-    push_bit(handle, extract_bit(value, i));
+static int alloc_gpio(struct iotctrl_7seg_disp_handle *h) {
+  h->gpio = calloc(1, sizeof(struct iotctrl_gpio_output));
+  if (h->gpio == NULL) {
+    perror("calloc()");
+    return -1;
+  }
+  return 0;
+}
+
+static int gpio_open(struct iotctrl_7seg_disp_handle *h,
+                     const struct iotctrl_7seg_disp_connection *conn) {
+  if (alloc_gpio(h) != 0)
+    return -1;
+  // The order must match edge_values. Clock and latch start low.
+  const unsigned int offsets[] = {h->data, h->clk, h->latch};
+  return iotctrl_gpio_output_request(h->gpio, conn->gpiochip_path, offsets,
+                                     sizeof(offsets) / sizeof(offsets[0]),
+                                     "7-segment-display", edge_values[0]);
+}
+
+static void gpio_close(struct iotctrl_7seg_disp_handle *h) {
+  if (h->gpio != NULL)
+    iotctrl_gpio_output_release(h->gpio);
+  free(h->gpio);
+}
+
+static int gpio_shift_out_step(struct iotctrl_7seg_disp_handle *h,
+                               const uint8_t *edges) {
+  int ret = 0;
+  // The remaining edges are still replayed, the next latch then shows a
+  // proper digit again
+  for (size_t e = 0; e < h->bytes_per_step; ++e)
+    if (iotctrl_gpio_output_set(h->gpio, edge_values[edges[e]]) != 0)
+      ret = -1;
+  return ret;
+}
+
+static int spi_open(struct iotctrl_7seg_disp_handle *h,
+                    const struct iotctrl_7seg_disp_connection *conn) {
+  const unsigned int latch_offset = h->latch;
+  const int latch_default = 0;
+  if (alloc_gpio(h) != 0)
+    return -1;
+  if (iotctrl_gpio_output_request(h->gpio, conn->gpiochip_path,
+                                  &latch_offset, 1, "7-segment-display",
+                                  &latch_default) != 0)
+    return -1;
+
+  h->spi_fd = open(conn->spidev_path, O_RDWR | O_CLOEXEC);
+  if (h->spi_fd < 0) {
+    fprintf(stderr, "open(%s) failed: %d(%s)\n", conn->spidev_path, errno,
+            strerror(errno));
+    return -1;
+  }
+  // 74HC595 shifts on the rising edge of an idle-low clock, i.e., mode 0
+  const uint8_t mode = SPI_MODE_0;
+  const uint8_t bits_per_word = 8;
+  h->spi_speed_hz = conn->spi_speed_hz > 0 ? conn->spi_speed_hz : 1000000;
+  if (ioctl(h->spi_fd, SPI_IOC_WR_MODE, &mode) != 0 ||
+      ioctl(h->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word) != 0 ||
+      ioctl(h->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &h->spi_speed_hz) != 0) {
+    fprintf(stderr, "ioctl(%s) failed to configure SPI: %d(%s)\n",
+            conn->spidev_path, errno, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void spi_close(struct iotctrl_7seg_disp_handle *h) {
+  if (h->spi_fd >= 0)
+    close(h->spi_fd);
+  gpio_close(h);
+}
+
+// One SPI_IOC_MESSAGE for all words of a step plus two ioctl()s pulsing the
+// latch, no matter how long the chain is
+static int spi_shift_out_step(struct iotctrl_7seg_disp_handle *h,
+                              const uint8_t *bytes) {
+  struct spi_ioc_transfer xfer = {
+      .tx_buf = (uintptr_t)bytes,
+      .len = h->bytes_per_step,
+      .speed_hz = h->spi_speed_hz,
+      .bits_per_word = 8,
+  };
+  if (ioctl(h->spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
+    return -1;
+  static const int high = 1, low = 0;
+  const int raised = iotctrl_gpio_output_set(h->gpio, &high);
+  const int lowered = iotctrl_gpio_output_set(h->gpio, &low);
+  return raised == 0 && lowered == 0 ? 0 : -1;
+}
+
+static int mock_open(struct iotctrl_7seg_disp_handle *h,
+                     const struct iotctrl_7seg_disp_connection *conn) {
+  (void)conn;
+  h->mock_latched = calloc(h->step_count, h->bytes_per_step);
+  if (h->mock_latched == NULL) {
+    perror("calloc()");
+    return -1;
+  }
+  return 0;
+}
+
+static void mock_close(struct iotctrl_7seg_disp_handle *h) {
+  free(h->mock_latched);
+}
+
+static int mock_shift_out_step(struct iotctrl_7seg_disp_handle *h,
+                               const uint8_t *bytes) {
+  const size_t step = (bytes - h->frames[h->front_idx]) / h->bytes_per_step;
+  pthread_mutex_lock(&h->mock_mutex);
+  memcpy(h->mock_latched + step * h->bytes_per_step, bytes, h->bytes_per_step);
+  pthread_mutex_unlock(&h->mock_mutex);
+  return 0;
+}
+
+static const struct iotctrl_7seg_disp_transport_ops transports[] = {
+    [IOTCTRL_7SEG_DISP_TRANSPORT_GPIO] = {IOTCTRL_7SEG_DISP_EDGES_PER_WORD, 1,
+                                          compile_word_edges,
+                                          compile_latch_edge, gpio_open,
+                                          gpio_close, gpio_shift_out_step},
+    [IOTCTRL_7SEG_DISP_TRANSPORT_SPI] = {2, 0, compile_word_bytes, NULL,
+                                         spi_open, spi_close,
+                                         spi_shift_out_step},
+    [IOTCTRL_7SEG_DISP_TRANSPORT_MOCK] = {2, 0, compile_word_bytes, NULL,
+                                          mock_open, mock_close,
+                                          mock_shift_out_step},
+};
+
+// Compile the composed digits into one flat sequence, so that refreshing is a
+// linear replay without any bit extraction
+static void compile_frame(const struct iotctrl_7seg_disp_handle *h,
+                          uint8_t *frame) {
+  uint8_t *e = frame;
+  for (int step = 0; step < h->step_count; ++step) {
+    // Words shifted out first end up farthest down the chain
+    for (int w = h->word_count - 1; w >= 0; --w) {
+      const int first_digit = w * IOTCTRL_7SEG_DISP_DIGITS_PER_WORD;
+      int digits = h->digit_count - first_digit;
+      if (digits > IOTCTRL_7SEG_DISP_DIGITS_PER_WORD)
+        digits = IOTCTRL_7SEG_DISP_DIGITS_PER_WORD;
+      uint16_t val_and_pos = BLANK_WORD;
+      if (step < digits) {
+        // Position of a digit. E.g., 0b0000010 means the tens place of the
+        // 4/8-digit number
+        const uint16_t position = 1 << (digits - 1 - step);
+        // High 8 bits represent the number; low 8 bits represent the position
+        // of the number
+        val_and_pos = h->digit_values[first_digit + step] << 8 | position;
+      }
+      e = h->transport->compile_word(val_and_pos, e);
+    }
+    if (h->transport->compile_latch != NULL)
+      e = h->transport->compile_latch(e);
+  }
+}
+
+#define FRAME_IDX_MASK 0x3
+#define FRAME_FRESH 0x4
+
+void iotctrl_7seg_disp_begin_frame(struct iotctrl_7seg_disp_handle *h) {
+  pthread_mutex_lock(&h->writer_mutex);
+  ++h->batch_depth;
+}
+
+void iotctrl_7seg_disp_commit_frame(struct iotctrl_7seg_disp_handle *h) {
+  if (--h->batch_depth == 0 && h->frame_dirty) {
+    compile_frame(h, h->frames[h->back_idx]);
+    const unsigned int prev = __atomic_exchange_n(
+        &h->pending_idx, h->back_idx | FRAME_FRESH, __ATOMIC_ACQ_REL);
+    h->back_idx = prev & FRAME_IDX_MASK;
+    h->frame_dirty = false;
+  }
+  pthread_mutex_unlock(&h->writer_mutex);
+}
+
+// Must be called between iotctrl_7seg_disp_begin_frame() and
+// iotctrl_7seg_disp_commit_frame()
+static void set_digit(struct iotctrl_7seg_disp_handle *h, int idx,
+                      uint8_t val) {
+  if (h->digit_values[idx] != val) {
+    h->digit_values[idx] = val;
+    h->frame_dirty = true;
   }
 }
 
@@ -40,32 +274,35 @@ uint8_t handle_dot(uint8_t value, bool turn_it_on) {
 
 void iotctrl_7seg_disp_destroy(struct iotctrl_7seg_disp_handle *handle) {
   if (handle == NULL) return;
-  // TODO: There is still a rare race condition, we probably need a mutex to
-  // handle it correctly.
+  // ev_flag is cleared by iotctrl_7seg_disp_init() right before the thread is
+  // created, so a zero value always means there is a thread to join
   if (handle->ev_flag == 0) {
-    handle->ev_flag = 1;
+    __atomic_store_n(&handle->ev_flag, 1, __ATOMIC_RELAXED);
     if (handle->th_display_refresh != 0)
       (void)pthread_join(handle->th_display_refresh, NULL);
   }
 
-  if (handle->line_data != NULL)
-    gpiod_line_release(handle->line_data);
-  if (handle->line_clk != NULL)
-    gpiod_line_release(handle->line_clk);
-  if (handle->line_latch != NULL)
-    gpiod_line_release(handle->line_latch);
-  if (handle->chip != NULL)
-    gpiod_chip_close(handle->chip);
+  if (handle->transport != NULL)
+    handle->transport->close(handle);
 
   free(handle->digit_values);
   free(handle->per_digit_dots);
+  free(handle->frames[0]);
+  pthread_mutex_destroy(&handle->writer_mutex);
+  pthread_mutex_destroy(&handle->mock_mutex);
 
   free(handle);
 }
 
 void iotctrl_7seg_disp_update_digit(struct iotctrl_7seg_disp_handle *h, int idx,
                                     uint8_t val) {
-  h->digit_values[idx] = val;
+  if (idx < 0 || idx >= h->digit_count) {
+    fprintf(stderr, "Invalid digit index (%d)\n", idx);
+    return;
+  }
+  iotctrl_7seg_disp_begin_frame(h);
+  set_digit(h, idx, val);
+  iotctrl_7seg_disp_commit_frame(h);
 }
 
 void iotctrl_7seg_disp_update_as_four_digit_float(
@@ -76,79 +313,206 @@ void iotctrl_7seg_disp_update_as_four_digit_float(
     val = 0;
   }
   int idx = float_idx * DIGIT_PER_MODULE;
+  if (idx < 0 || idx + DIGIT_PER_MODULE > h->digit_count) {
+    fprintf(stderr, "Invalid float index (%d)\n", float_idx);
+    return;
+  }
+  iotctrl_7seg_disp_begin_frame(h);
   h->per_digit_dots[idx + 2] = 1;
 
   if (val >= 0) {
-
-    h->digit_values[idx + 0] = table[(int)fabs(val) % 1000 / 100];
     if (val < 100.00)
-      h->digit_values[idx + 0] = table[IOTCTRL_7SEG_DISP_CHARS_EMPTY];
+      set_digit(h, idx + 0, table[IOTCTRL_7SEG_DISP_CHARS_EMPTY]);
+    else
+      set_digit(h, idx + 0, table[(int)fabs(val) % 1000 / 100]);
   } else {
-    h->digit_values[idx + 0] = table[IOTCTRL_7SEG_DISP_CHARS_MINUS];
+    set_digit(h, idx + 0, table[IOTCTRL_7SEG_DISP_CHARS_MINUS]);
   }
 
-  h->digit_values[idx + 1] = table[(int)fabs(val) % 100 / 10];
-
   if (val < 10 && val > -10)
-    h->digit_values[idx + 1] = table[IOTCTRL_7SEG_DISP_CHARS_EMPTY];
+    set_digit(h, idx + 1, table[IOTCTRL_7SEG_DISP_CHARS_EMPTY]);
+  else
+    set_digit(h, idx + 1, table[(int)fabs(val) % 100 / 10]);
 
   // "& table[IOTCTRL_7SEG_DISP_CHARS_DOT]" means append a dot to the digit
-  h->digit_values[idx + 2] =
-      table[(int)fabs(val) % 10] & table[IOTCTRL_7SEG_DISP_CHARS_DOT];
+  set_digit(h, idx + 2,
+            table[(int)fabs(val) % 10] & table[IOTCTRL_7SEG_DISP_CHARS_DOT]);
 
-  h->digit_values[idx + 3] = table[(int)fabs(val * 10) % 10];
+  set_digit(h, idx + 3, table[(int)fabs(val * 10) % 10]);
+  iotctrl_7seg_disp_commit_frame(h);
 }
 
-int update_display(struct iotctrl_7seg_disp_handle *h) {
-  for (int i = 0; i < h->digit_count; ++i) {
-    // Position of a digit. E.g., 0b0000010 means the tens place of the
-    // 4/8-digit number
-    uint16_t position = 1 << (h->digit_count - 1 - i);
+static inline uint64_t timespec_to_ns(const struct timespec *ts) {
+  return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
 
-    // High 8 bits represent the number; low 8 bits represent the position of
-    // the number
-    uint16_t val_and_pos = h->digit_values[i] << 8 | position;
-    write_single_digit_data_to_register(*h, val_and_pos);
-    gpiod_line_set_value(h->line_latch, 1);
-    gpiod_line_set_value(h->line_latch, 0);
-    usleep(h->refresh_delay_us);
-  }
+static inline void ns_to_timespec(uint64_t ns, struct timespec *ts) {
+  ts->tv_sec = ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+}
 
-  return 0;
+static void record_wakeup(struct iotctrl_7seg_disp_handle *h,
+                          uint64_t lateness_ns) {
+  // The refresh thread is the only writer, the atomics only make sure that
+  // readers never see torn values
+  __atomic_fetch_add(&h->stat_refresh_count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->stat_jitter_sum_ns, lateness_ns, __ATOMIC_RELAXED);
+  if (lateness_ns >
+      __atomic_load_n(&h->stat_jitter_max_ns, __ATOMIC_RELAXED))
+    __atomic_store_n(&h->stat_jitter_max_ns, lateness_ns, __ATOMIC_RELAXED);
+  if (lateness_ns >= h->refresh_period_ns)
+    __atomic_fetch_add(&h->stat_miss_count, 1, __ATOMIC_RELAXED);
 }
 
-void *ev_display_refresh_thread(void *ctx) {
+static void *ev_display_refresh_thread(void *ctx) {
   struct iotctrl_7seg_disp_handle *h = (struct iotctrl_7seg_disp_handle *)ctx;
-  // TODO: There is still a rare race condition, we probably need a mutex to
-  // handle it correctly.
-  h->ev_flag = 0;
-  while (!h->ev_flag) {
-    update_display(h);
+  struct timespec ts;
+  // Each digit is given a fixed slot on an absolute timeline, so the time
+  // spent on shifting out is part of the slot instead of being added on top
+  // of a relative sleep.
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t deadline_ns = timespec_to_ns(&ts);
+  while (!__atomic_load_n(&h->ev_flag, __ATOMIC_RELAXED)) {
+    // Only switch frames between passes so that every pass renders one
+    // consistent frame
+    if (__atomic_load_n(&h->pending_idx, __ATOMIC_RELAXED) & FRAME_FRESH) {
+      const unsigned int prev = __atomic_exchange_n(
+          &h->pending_idx, (unsigned int)h->front_idx, __ATOMIC_ACQ_REL);
+      h->front_idx = prev & FRAME_IDX_MASK;
+    }
+    // A pass is accounted as one operation, timed by the steps' transport
+    // time only, so that a slowing bus shows up apart from wake-up jitter
+    uint64_t pass_ns = 0;
+    int pass_result = 0;
+    for (int i = 0; i < h->step_count; ++i) {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      const uint64_t step_start_ns = timespec_to_ns(&ts);
+      if (h->transport->shift_out_step(
+              h, h->frames[h->front_idx] + i * h->bytes_per_step) != 0)
+        pass_result = -1;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      pass_ns += timespec_to_ns(&ts) - step_start_ns;
+      deadline_ns += h->refresh_period_ns;
+      ns_to_timespec(deadline_ns, &ts);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+             EINTR)
+        ;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      const uint64_t now_ns = timespec_to_ns(&ts);
+      const uint64_t lateness_ns =
+          now_ns > deadline_ns ? now_ns - deadline_ns : 0;
+      record_wakeup(h, lateness_ns);
+      if (lateness_ns >= h->refresh_period_ns)
+        deadline_ns = now_ns;
+    }
+    iotctrl_metrics_record(&h->metrics, IOTCTRL_METRICS_7SEG_REFRESH,
+                           pass_result, pass_ns);
   }
   return NULL;
 }
 
+void iotctrl_7seg_disp_get_stats(const struct iotctrl_7seg_disp_handle *h,
+                                 struct iotctrl_7seg_disp_stats *stats) {
+  stats->digit_refresh_count =
+      __atomic_load_n(&h->stat_refresh_count, __ATOMIC_RELAXED);
+  stats->deadline_miss_count =
+      __atomic_load_n(&h->stat_miss_count, __ATOMIC_RELAXED);
+  stats->max_jitter_ns =
+      __atomic_load_n(&h->stat_jitter_max_ns, __ATOMIC_RELAXED);
+  const uint64_t jitter_sum_ns =
+      __atomic_load_n(&h->stat_jitter_sum_ns, __ATOMIC_RELAXED);
+  stats->mean_jitter_ns = stats->digit_refresh_count > 0
+                              ? jitter_sum_ns / stats->digit_refresh_count
+                              : 0;
+}
+
+const struct iotctrl_metrics *
+iotctrl_7seg_disp_get_metrics(const struct iotctrl_7seg_disp_handle *h) {
+  return &h->metrics;
+}
+
+static int
+apply_thread_scheduling(struct iotctrl_7seg_disp_handle *h,
+                        const struct iotctrl_7seg_disp_connection *conn) {
+  int rc;
+  if (conn->rt_priority > 0) {
+    struct sched_param param = {.sched_priority = conn->rt_priority};
+    rc = pthread_setschedparam(h->th_display_refresh, SCHED_FIFO, &param);
+    if (rc == EPERM) {
+      // E.g., no CAP_SYS_NICE. The display still works, just with more
+      // jitter.
+      fprintf(stderr,
+              "pthread_setschedparam(SCHED_FIFO, %u) not permitted, keeping "
+              "the default scheduling policy\n",
+              conn->rt_priority);
+    } else if (rc != 0) {
+      fprintf(stderr, "pthread_setschedparam(SCHED_FIFO, %u) failed: %d(%s)\n",
+              conn->rt_priority, rc, strerror(rc));
+      return -1;
+    }
+  }
+  if (conn->cpu_affinity_mask != 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (size_t i = 0; i < sizeof(conn->cpu_affinity_mask) * CHAR_BIT; ++i) {
+      if (conn->cpu_affinity_mask >> i & 1)
+        CPU_SET(i, &cpuset);
+    }
+    if ((rc = pthread_setaffinity_np(h->th_display_refresh, sizeof(cpuset),
+                                     &cpuset)) != 0) {
+      fprintf(stderr, "pthread_setaffinity_np(%#" PRIx64 ") failed: %d(%s)\n",
+              conn->cpu_affinity_mask, rc, strerror(rc));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+ssize_t iotctrl_7seg_disp_mock_read(struct iotctrl_7seg_disp_handle *h,
+                                    uint8_t *buf, size_t buf_len) {
+  const size_t len = h->step_count * h->bytes_per_step;
+  if (h->transport != &transports[IOTCTRL_7SEG_DISP_TRANSPORT_MOCK] ||
+      buf_len < len)
+    return -1;
+  pthread_mutex_lock(&h->mock_mutex);
+  memcpy(buf, h->mock_latched, len);
+  pthread_mutex_unlock(&h->mock_mutex);
+  return len;
+}
+
 void iotctrl_7seg_disp_turn_on_all_segments(
     struct iotctrl_7seg_disp_handle *handle, int duration_sec) {
+  iotctrl_7seg_disp_begin_frame(handle);
   for (uint8_t i = 0; i < handle->digit_count; ++i) {
     iotctrl_7seg_disp_update_digit(
         handle, i, iotctrl_7seg_disp_chars_table[IOTCTRL_7SEG_DISP_CHARS_ALL]);
   }
+  iotctrl_7seg_disp_commit_frame(handle);
   sleep(duration_sec);
 }
 
 struct iotctrl_7seg_disp_handle *
 iotctrl_7seg_disp_init(const struct iotctrl_7seg_disp_connection conn) {
 
+  // calloc() so that iotctrl_7seg_disp_destroy() can tell which resources
+  // have been acquired if we fail halfway
   struct iotctrl_7seg_disp_handle *h =
-      malloc(sizeof(struct iotctrl_7seg_disp_handle));
+      calloc(1, sizeof(struct iotctrl_7seg_disp_handle));
   if (h == NULL) {
-    perror("malloc()");
+    perror("calloc()");
     return NULL;
   }
-  if (conn.chain_num != 1 && conn.chain_num != 2) {
-    fprintf(stderr, "Invalid chain_num (%d), must be 1 or 2\n", conn.chain_num);
-    free(h);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&h->writer_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_mutex_init(&h->mock_mutex, NULL);
+  h->spi_fd = -1;
+  if (conn.chain_num == 0) {
+    fprintf(stderr, "Invalid chain_num (%d), must be at least 1\n",
+            conn.chain_num);
+    iotctrl_7seg_disp_destroy(h);
     return NULL;
   }
 
@@ -158,10 +522,30 @@ iotctrl_7seg_disp_init(const struct iotctrl_7seg_disp_connection conn) {
   h->latch = conn.latch_pin_num;
   h->chain = conn.chain_num;
   h->digit_count = h->chain * DIGIT_PER_MODULE;
+  h->word_count = (h->digit_count + IOTCTRL_7SEG_DISP_DIGITS_PER_WORD - 1) /
+                  IOTCTRL_7SEG_DISP_DIGITS_PER_WORD;
+  h->step_count = h->digit_count < IOTCTRL_7SEG_DISP_DIGITS_PER_WORD
+                      ? h->digit_count
+                      : IOTCTRL_7SEG_DISP_DIGITS_PER_WORD;
+  if ((unsigned int)conn.transport >=
+      sizeof(transports) / sizeof(transports[0])) {
+    fprintf(stderr, "Invalid transport (%d)\n", conn.transport);
+    iotctrl_7seg_disp_destroy(h);
+    return NULL;
+  }
+  const struct iotctrl_7seg_disp_transport_ops *transport =
+      &transports[conn.transport];
+  h->bytes_per_step =
+      h->word_count * transport->bytes_per_word + transport->bytes_per_latch;
 
   h->digit_values = calloc(sizeof(uint8_t), h->digit_count);
 
-  h->refresh_delay_us = 1000 * 1000 / conn.refresh_rate_hz;
+  if (conn.refresh_rate_hz == 0) {
+    fprintf(stderr, "Invalid refresh_rate_hz (0)\n");
+    iotctrl_7seg_disp_destroy(h);
+    return NULL;
+  }
+  h->refresh_period_ns = 1000 * 1000 * 1000 / conn.refresh_rate_hz;
 
   if (h->digit_values == NULL) {
     perror("calloc()");
@@ -174,74 +558,45 @@ iotctrl_7seg_disp_init(const struct iotctrl_7seg_disp_connection conn) {
     iotctrl_7seg_disp_destroy(h);
     return NULL;
   }
-  // Per
-  // https://git.kernel.org/pub/scm/libs/libgpiod/libgpiod.git/tree/lib/chip.c
-  // Internally it uses fopen()/malloc()/ioctl() and all of them set errno on
-  // error
-  h->chip = gpiod_chip_open(conn.gpiochip_path);
-
-  if (!h->chip) {
-    fprintf(stderr, "gpiod_chip_open(%s) failed: %d(%s)\n", conn.gpiochip_path,
-            errno, strerror(errno));
-    return NULL;
-  }
-
-  // We'd better separate these three gpiod_chip_get_line() calls so that in
-  // case of incorrect wiring, we will know which wire is incorrectly connected.
-
-  // See if we can refactor this snippet
-  h->line_data = NULL;
-  h->line_clk = NULL;
-  h->line_latch = NULL;
-  h->line_data = gpiod_chip_get_line(h->chip, h->data);
-  if (h->line_data == NULL) {
-    fprintf(stderr, "gpiod_chip_get_line(h->chip, h->data) failed: %d(%s)\n",
-            errno, strerror(errno));
-    iotctrl_7seg_disp_destroy(h);
-    return NULL;
-  }
-  if (gpiod_line_request_output(h->line_data, "7-segment-display", 0) != 0) {
-    fprintf(stderr, "gpiod_line_request_output(h->line_data) failed\n");
+  // Frames are placed back to back on cache line boundaries, so that the
+  // refresh thread streams through one of them without sharing a line with
+  // the frame being compiled by writers
+  const size_t cache_line = 64;
+  const size_t frame_size =
+      (h->step_count * h->bytes_per_step + cache_line - 1) / cache_line *
+      cache_line;
+  if (posix_memalign((void **)&h->frames[0], cache_line,
+                     3 * frame_size) != 0) {
+    perror("posix_memalign()");
     iotctrl_7seg_disp_destroy(h);
     return NULL;
   }
-
-  h->line_clk = gpiod_chip_get_line(h->chip, h->clk);
-  if (h->line_clk == NULL) {
-    fprintf(stderr, "gpiod_chip_get_line(h->chip, h->clk) failed: %d(%s)\n",
-            errno, strerror(errno));
-    iotctrl_7seg_disp_destroy(h);
-    return NULL;
-  }
-  if (gpiod_line_request_output(h->line_clk, "7-segment-display", 0) != 0) {
-    fprintf(stderr, "gpiod_line_request_output(h->line_clk) failed\n");
-    iotctrl_7seg_disp_destroy(h);
-    return NULL;
+  // From here on iotctrl_7seg_disp_destroy() calls transport->close(), which
+  // copes with a partially opened transport
+  h->transport = transport;
+  for (int i = 0; i < 3; ++i) {
+    h->frames[i] = h->frames[0] + i * frame_size;
+    compile_frame(h, h->frames[i]);
   }
+  h->front_idx = 0;
+  h->back_idx = 1;
+  h->pending_idx = 2;
 
-  h->line_latch = gpiod_chip_get_line(h->chip, h->latch);
-  if (h->line_latch == NULL) {
-    fprintf(stderr, "gpiod_chip_get_line(h->chip, h->latch) failed: %d(%s)\n",
-            errno, strerror(errno));
+  if (transport->open(h, &conn) != 0) {
     iotctrl_7seg_disp_destroy(h);
     return NULL;
   }
-  if (gpiod_line_request_output(h->line_latch, "7-segment-display", 0) != 0) {
-    fprintf(stderr, "gpiod_line_request_output(h->line_latch) failed\n");
-    iotctrl_7seg_disp_destroy(h);
-    return NULL;
-  }
-  // See if we can refactor this snippet
 
-  if (gpiod_line_set_value(h->line_clk, 0) != 0 ||
-      gpiod_line_set_value(h->line_latch, 0) != 0) {
-    fprintf(stderr, "gpiod_line_set_value() failed\n");
+  h->ev_flag = 0;
+  int rc;
+  if ((rc = pthread_create(&h->th_display_refresh, NULL,
+                           ev_display_refresh_thread, h)) != 0) {
+    fprintf(stderr, "pthread_create() failed: %d(%s)\n", rc, strerror(rc));
+    h->ev_flag = 1;
     iotctrl_7seg_disp_destroy(h);
     return NULL;
   }
-  if (pthread_create(&h->th_display_refresh, NULL, ev_display_refresh_thread,
-                     h) != 0) {
-    fprintf(stderr, "pthread_create() failed: %d(%s)", errno, strerror(errno));
+  if (apply_thread_scheduling(h, &conn) != 0) {
     iotctrl_7seg_disp_destroy(h);
     return NULL;
   }
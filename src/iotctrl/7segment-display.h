@@ -6,10 +6,14 @@ extern "C" {
 #endif
 
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+#include "metrics.h"
 
 // Counter-intuitive definition:
 // 0 turns a segment ON, 1 turns a segment OFF
@@ -36,6 +40,24 @@ static const uint8_t iotctrl_7seg_disp_chars_table[] = {
 #define IOTCTRL_7SEG_DISP_CHARS_DOT 12
 #define IOTCTRL_7SEG_DISP_CHARS_ALL 13
 
+// A pair of 74HC595s takes a 16-bit word: the high byte selects segments and
+// the low byte selects up to 8 digits. Each bit takes two edges (clock low
+// with data set, then clock high).
+#define IOTCTRL_7SEG_DISP_DIGITS_PER_WORD 8
+#define IOTCTRL_7SEG_DISP_EDGES_PER_WORD 32
+
+// How words are clocked into the 74HC595s
+enum iotctrl_7seg_disp_transport {
+  // Bit-bang DIO/SCLK/RCLK with libgpiod
+  IOTCTRL_7SEG_DISP_TRANSPORT_GPIO = 0,
+  // Clock DIO/SCLK out of a spidev device (i.e., wire DIO to MOSI and SCLK to
+  // SCLK), RCLK is still driven by latch_pin_num with libgpiod
+  IOTCTRL_7SEG_DISP_TRANSPORT_SPI,
+  // No hardware at all, latched words are recorded in memory and can be read
+  // back with iotctrl_7seg_disp_mock_read()
+  IOTCTRL_7SEG_DISP_TRANSPORT_MOCK,
+};
+
 // Connection details needed to control a 7-segent display device
 struct iotctrl_7seg_disp_connection {
   // a.k.a. DIO (data input/output)
@@ -44,40 +66,111 @@ struct iotctrl_7seg_disp_connection {
   uint8_t clock_pin_num;
   // a.k.a. RCLK (register clock)
   uint8_t latch_pin_num;
-  // represents the number of display modules connected in a daisy-chain
-  // configuration. Currently we use 2 4-digit displays, so this value can only
-  // be 2
+  // represents the number of 4-digit display modules connected in a
+  // daisy-chain configuration. Every two modules share a pair of 74HC595s
+  // (e.g., a common 8-digit board), so a chain of N modules is driven with
+  // ceil(N / 2) 16-bit words per latch. Digits 0-7 sit on the pair wired
+  // to the GPIO pins, digits 8-15 on the next pair, etc.
   uint8_t chain_num;
   char gpiochip_path[PATH_MAX + 1];
   // How frequent are single digits being refreshed. If the display has eight
   // digits, and the refresh rate is 800Hz, each digit is refreshed 100 times a
-  // second.
+  // second. Longer chains light one digit per 8-digit board at a time, so a
+  // 32-digit chain at 800Hz also refreshes each digit 100 times a second.
   //
   // This parameter is highly hardware-dependent and one may need to
   // take a trial-and-error approach to ascertain the balance between minimal
   // flashing display and CPU use. A good starting point is 1KHz then plus/minus
   // by a factor of 2
   uint16_t refresh_rate_hz;
+  // Optional SCHED_FIFO priority (1-99) of the refresh thread. 0 keeps the
+  // default scheduling policy. Raising it typically requires CAP_SYS_NICE,
+  // without it a warning is printed and the default policy is kept.
+  uint8_t rt_priority;
+  // Optional CPU affinity of the refresh thread, bit n stands for CPU n. 0
+  // keeps the default affinity.
+  uint64_t cpu_affinity_mask;
+  enum iotctrl_7seg_disp_transport transport;
+  // IOTCTRL_7SEG_DISP_TRANSPORT_SPI only, typically /dev/spidev0.0
+  char spidev_path[PATH_MAX + 1];
+  // IOTCTRL_7SEG_DISP_TRANSPORT_SPI only, 0 means 1MHz
+  uint32_t spi_speed_hz;
+};
+
+// Timing statistics of the refresh thread since iotctrl_7seg_disp_init()
+struct iotctrl_7seg_disp_stats {
+  // Number of latches, each refreshes one digit per 8-digit board
+  uint64_t digit_refresh_count;
+  // Number of times the thread woke up a whole refresh period or more after
+  // its deadline. The schedule is then re-anchored to the current time
+  // instead of trying to catch up with a burst of refreshes.
+  uint64_t deadline_miss_count;
+  // How late the thread woke up relative to its deadlines
+  uint64_t max_jitter_ns;
+  uint64_t mean_jitter_ns;
 };
 
 struct iotctrl_7seg_disp_handle {
   sig_atomic_t volatile ev_flag;
   pthread_t th_display_refresh;
+  // The frame being composed by writers, protected by writer_mutex
   uint8_t *digit_values;
   uint8_t *per_digit_dots;
+  bool frame_dirty;
+  // Recursive so that iotctrl_7seg_disp_update_*() can be called between
+  // iotctrl_7seg_disp_begin_frame() and iotctrl_7seg_disp_commit_frame()
+  pthread_mutex_t writer_mutex;
+  int batch_depth;
 
   int data;
   int clk;
   int latch;
   int chain;
   int digit_count;
+  // Words shifted out per latch and latches per frame, see chain_num
+  int word_count;
+  int step_count;
+  // Size of a compiled step, it depends on the transport. E.g., GPIO needs
+  // word_count * IOTCTRL_7SEG_DISP_EDGES_PER_WORD edges plus one edge raising
+  // the latch while SPI needs word_count * 2 bytes.
+  size_t bytes_per_step;
 
-  struct gpiod_chip *chip;
-  struct gpiod_line *line_data;
-  struct gpiod_line *line_clk;
-  struct gpiod_line *line_latch;
+  const struct iotctrl_7seg_disp_transport_ops *transport;
+  // GPIO transport: data, clock and latch lines, requested together so that
+  // one write (i.e., one ioctl()) updates all of them. SPI transport: the
+  // latch line only.
+  struct iotctrl_gpio_output *gpio;
+  int spi_fd;
+  uint32_t spi_speed_hz;
+  // MOCK transport: the last step_count latched steps, protected by
+  // mock_mutex
+  uint8_t *mock_latched;
+  pthread_mutex_t mock_mutex;
+  // Triple-buffered, precompiled frames. Each is the flat byte sequence the
+  // transport replays to shift out and latch every step of a frame, i.e.,
+  // step_count * bytes_per_step elements, carved out of one allocation.
+  // Writers own frames[back_idx] and the refresh thread owns
+  // frames[front_idx].
+  // A committed frame is published by atomically exchanging back_idx with
+  // pending_idx, and picked up by the refresh thread exchanging front_idx with
+  // pending_idx. Neither side ever waits for the other.
+  uint8_t *frames[3];
+  int back_idx;
+  int front_idx;
+  // The index of the third buffer, ORed with a flag that is set if it holds a
+  // frame the refresh thread has not seen yet
+  unsigned int pending_idx;
 
-  uint32_t refresh_delay_us;
+  // Time budget of a single latch, i.e., 1 / refresh_rate_hz
+  uint32_t refresh_period_ns;
+  // Written by the refresh thread with relaxed atomics, see
+  // iotctrl_7seg_disp_get_stats()
+  uint64_t stat_refresh_count;
+  uint64_t stat_miss_count;
+  uint64_t stat_jitter_sum_ns;
+  uint64_t stat_jitter_max_ns;
+  // Refresh passes, see iotctrl_7seg_disp_get_metrics()
+  struct iotctrl_metrics metrics;
 };
 
 /**
@@ -92,6 +185,19 @@ struct iotctrl_7seg_disp_handle {
 struct iotctrl_7seg_disp_handle *
 iotctrl_7seg_disp_init(const struct iotctrl_7seg_disp_connection conn);
 
+/**
+ * @brief Start composing a frame. Digits updated until the matching
+ * iotctrl_7seg_disp_commit_frame() become visible on the display together.
+ * Calls can be nested and other writers are blocked until the outermost
+ * commit.
+ * */
+void iotctrl_7seg_disp_begin_frame(struct iotctrl_7seg_disp_handle *h);
+
+/**
+ * @brief Publish the frame composed since iotctrl_7seg_disp_begin_frame()
+ * */
+void iotctrl_7seg_disp_commit_frame(struct iotctrl_7seg_disp_handle *h);
+
 /**
  * @brief Update the zero-based `idx` digit of the 7-segment digital tube
  * @param h Handle
@@ -114,6 +220,32 @@ void iotctrl_7seg_disp_update_digit(struct iotctrl_7seg_disp_handle *h, int idx,
 void iotctrl_7seg_disp_update_as_four_digit_float(
     struct iotctrl_7seg_disp_handle *h, float val, int float_idx);
 
+/**
+ * @brief Get the timing statistics of the refresh thread. It is safe to call
+ * this function while the display is being refreshed.
+ * */
+void iotctrl_7seg_disp_get_stats(const struct iotctrl_7seg_disp_handle *h,
+                                 struct iotctrl_7seg_disp_stats *stats);
+
+/**
+ * @brief Metrics of the refresh passes, one operation per pass over all
+ * digits, valid until iotctrl_7seg_disp_destroy(). The latency excludes the
+ * sleeps between digits.
+ * */
+const struct iotctrl_metrics *
+iotctrl_7seg_disp_get_metrics(const struct iotctrl_7seg_disp_handle *h);
+
+/**
+ * @brief Read back what an IOTCTRL_7SEG_DISP_TRANSPORT_MOCK display latched
+ * most recently, step by step, in the order bytes are shifted out. I.e., for
+ * each of the min(digit_count, 8) steps, ceil(digit_count / 8) big-endian
+ * 16-bit words, starting with the word for the board farthest down the chain.
+ * @returns Number of bytes copied to buf or -1 if the handle does not use the
+ * mock transport or buf is too small
+ * */
+ssize_t iotctrl_7seg_disp_mock_read(struct iotctrl_7seg_disp_handle *h,
+                                    uint8_t *buf, size_t buf_len);
+
 /**
  * @brief Release GPIO resources and internal thread after the 7seg display is
  * not needed
@@ -1,54 +1,262 @@
 #include "buzzer.h"
-
-#include <gpiod.h>
+#include "transport.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 
-int iotctrl_make_a_buzz(const char *gpiochip_path, const size_t signal_pin,
-                        const struct iotctrl_buzz_unit sequence[],
-                        const size_t sequence_len) {
+struct pattern {
+  struct iotctrl_buzz_unit *units;
+  size_t len;
+  uint64_t id;
+};
+
+struct iotctrl_buzzer_handle {
+  struct iotctrl_gpio_output line;
+  pthread_t th_player;
+  // Protects everything below. The player thread also holds it while
+  // setting the line, so that iotctrl_buzzer_cancel() has the final say.
+  pthread_mutex_t mutex;
+  // Wakes the player up, uses CLOCK_MONOTONIC so that it can double as the
+  // player's absolute-deadline timer
+  pthread_cond_t player_cond;
+  // Wakes up iotctrl_buzzer_play() callers waiting for their pattern
+  pthread_cond_t done_cond;
+  // Ring buffer of patterns waiting behind the one being played
+  struct pattern queue[IOTCTRL_BUZZER_QUEUE_CAPACITY];
+  size_t queue_head;
+  size_t queue_len;
+  // Bumped to make the player drop the pattern being played
+  uint64_t generation;
+  // Patterns are numbered in submission order, a pattern is finished once it
+  // is played, preempted or cancelled
+  uint64_t next_id;
+  uint64_t finished_id;
+  uint64_t failed_id;
+  bool stop;
+  struct iotctrl_metrics metrics;
+};
+
+static inline uint64_t timespec_to_ns(const struct timespec *ts) {
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline void ns_to_timespec(uint64_t ns, struct timespec *ts) {
+  ts->tv_sec = ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return timespec_to_ns(&ts);
+}
 
-  struct gpiod_chip *chip;
-  struct gpiod_line *line;
-  int retval = 0;
+// A failure is accounted as -2, same as iotctrl_buzzer_play() returns
+static int set_line(struct iotctrl_buzzer_handle *h, const int value) {
+  const uint64_t start_ns = monotonic_ns();
+  const int ret = iotctrl_gpio_output_set(&h->line, &value);
+  iotctrl_metrics_record(&h->metrics, IOTCTRL_METRICS_BUZZER_SET,
+                         ret == 0 ? 0 : -2, monotonic_ns() - start_ns);
+  return ret;
+}
 
-  chip = gpiod_chip_open(gpiochip_path);
-  if (!chip) {
-    fprintf(stderr, "gpiod_chip_open(%s) failed\n", gpiochip_path);
-    retval = -1;
-    goto err_gpiod_chip_open_by_number;
+static void drop_queue(struct iotctrl_buzzer_handle *h) {
+  for (; h->queue_len > 0; --h->queue_len) {
+    free(h->queue[h->queue_head].units);
+    h->queue_head = (h->queue_head + 1) % IOTCTRL_BUZZER_QUEUE_CAPACITY;
   }
+  h->finished_id = h->next_id - 1;
+  pthread_cond_broadcast(&h->done_cond);
+}
+
+static void *player_thread(void *arg) {
+  struct iotctrl_buzzer_handle *h = arg;
+  pthread_mutex_lock(&h->mutex);
+  while (!h->stop) {
+    if (h->queue_len == 0) {
+      pthread_cond_wait(&h->player_cond, &h->mutex);
+      continue;
+    }
+    const struct pattern p = h->queue[h->queue_head];
+    h->queue_head = (h->queue_head + 1) % IOTCTRL_BUZZER_QUEUE_CAPACITY;
+    --h->queue_len;
+    const uint64_t generation = h->generation;
 
-  line = gpiod_chip_get_line(chip, signal_pin);
-  if (!line) {
-    fprintf(stderr, "gpiod_chip_get_line(%lu) failed\n", signal_pin);
-    goto err_gpiod_chip_get_line;
-    retval = -2;
+    // Every unit ends at an absolute time counted from the start of the
+    // pattern, so wake-up latency never accumulates over a long pattern
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t deadline_ns = timespec_to_ns(&ts);
+    for (size_t i = 0; i < p.len; ++i) {
+      if (set_line(h, p.units[i].on_off != 0) != 0) {
+        fprintf(stderr, "iotctrl_gpio_output_set() error: %d\n", errno);
+        h->failed_id = p.id;
+        break;
+      }
+      deadline_ns += p.units[i].duration_ms * 1000000ULL;
+      ns_to_timespec(deadline_ns, &ts);
+      while (h->generation == generation && !h->stop &&
+             pthread_cond_timedwait(&h->player_cond, &h->mutex, &ts) !=
+                 ETIMEDOUT)
+        ;
+      if (h->generation != generation || h->stop)
+        break;
+    }
+    free(p.units);
+    if (h->finished_id < p.id)
+      h->finished_id = p.id;
+    pthread_cond_broadcast(&h->done_cond);
   }
+  pthread_mutex_unlock(&h->mutex);
+  return NULL;
+}
 
-  if (gpiod_line_request_output(line, "beep", 0) != 0) {
-    fprintf(stderr, "gpiod_line_request_output() failed\n");
-    goto err_gpiod_line_request_output;
-    retval = -3;
+struct iotctrl_buzzer_handle *iotctrl_buzzer_open(const char *gpiochip_path,
+                                                  const size_t signal_pin) {
+  struct iotctrl_buzzer_handle *h =
+      calloc(1, sizeof(struct iotctrl_buzzer_handle));
+  if (h == NULL) {
+    perror("calloc()");
+    return NULL;
+  }
+  const unsigned int offset = signal_pin;
+  const int off = 0;
+  if (iotctrl_gpio_output_request(&h->line, gpiochip_path, &offset, 1, "beep",
+                                  &off) != 0) {
+    fprintf(stderr, "iotctrl_gpio_output_request(%s, %zu) failed\n",
+            gpiochip_path, signal_pin);
+    goto err_gpio_output_request;
   }
+  h->next_id = 1;
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&h->player_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&h->done_cond, NULL);
+  pthread_mutex_init(&h->mutex, NULL);
+  if (pthread_create(&h->th_player, NULL, player_thread, h) != 0) {
+    fprintf(stderr, "pthread_create() failed\n");
+    goto err_pthread_create;
+  }
+  return h;
+
+err_pthread_create:
+  pthread_mutex_destroy(&h->mutex);
+  pthread_cond_destroy(&h->done_cond);
+  pthread_cond_destroy(&h->player_cond);
+  iotctrl_gpio_output_release(&h->line);
+err_gpio_output_request:
+  free(h);
+  return NULL;
+}
 
-  for (size_t i = 0; i < sequence_len; ++i) {
-    if (gpiod_line_set_value(line, sequence[i].on_off) != 0) {
-      fprintf(stderr, "gpiod_line_set_value() error: %d\n", errno);
-      break;
+static int submit(struct iotctrl_buzzer_handle *h,
+                  const struct iotctrl_buzz_unit sequence[],
+                  const size_t sequence_len,
+                  const enum iotctrl_buzzer_play_mode mode, uint64_t *id) {
+  struct iotctrl_buzz_unit *units = NULL;
+  if (sequence_len > 0) {
+    units = malloc(sequence_len * sizeof(struct iotctrl_buzz_unit));
+    if (units == NULL) {
+      perror("malloc()");
+      return -1;
     }
-    usleep(sequence[i].duration_ms * 1000);
+    memcpy(units, sequence, sequence_len * sizeof(struct iotctrl_buzz_unit));
+  }
+  pthread_mutex_lock(&h->mutex);
+  if (mode == IOTCTRL_BUZZER_PREEMPT) {
+    drop_queue(h);
+    ++h->generation;
+  }
+  if (h->queue_len == IOTCTRL_BUZZER_QUEUE_CAPACITY) {
+    pthread_mutex_unlock(&h->mutex);
+    free(units);
+    return -3;
   }
+  struct pattern *p =
+      &h->queue[(h->queue_head + h->queue_len) % IOTCTRL_BUZZER_QUEUE_CAPACITY];
+  p->units = units;
+  p->len = sequence_len;
+  p->id = h->next_id++;
+  ++h->queue_len;
+  *id = p->id;
+  pthread_cond_signal(&h->player_cond);
+  pthread_mutex_unlock(&h->mutex);
+  return 0;
+}
+
+int iotctrl_buzzer_play_async(struct iotctrl_buzzer_handle *h,
+                              const struct iotctrl_buzz_unit sequence[],
+                              const size_t sequence_len,
+                              const enum iotctrl_buzzer_play_mode mode) {
+  uint64_t id;
+  return submit(h, sequence, sequence_len, mode, &id);
+}
+
+int iotctrl_buzzer_play(struct iotctrl_buzzer_handle *h,
+                        const struct iotctrl_buzz_unit sequence[],
+                        const size_t sequence_len) {
+  uint64_t id;
+  int retval = submit(h, sequence, sequence_len, IOTCTRL_BUZZER_ENQUEUE, &id);
+  if (retval != 0)
+    return retval;
+  pthread_mutex_lock(&h->mutex);
+  while (h->finished_id < id)
+    pthread_cond_wait(&h->done_cond, &h->mutex);
+  retval = h->failed_id == id ? -2 : 0;
+  pthread_mutex_unlock(&h->mutex);
+  return retval;
+}
+
+void iotctrl_buzzer_cancel(struct iotctrl_buzzer_handle *h) {
+  pthread_mutex_lock(&h->mutex);
+  drop_queue(h);
+  ++h->generation;
+  (void)set_line(h, 0);
+  pthread_cond_signal(&h->player_cond);
+  pthread_mutex_unlock(&h->mutex);
+}
+
+const struct iotctrl_metrics *
+iotctrl_buzzer_get_metrics(const struct iotctrl_buzzer_handle *h) {
+  return &h->metrics;
+}
 
-err_gpiod_line_request_output:
-  gpiod_line_release(line);
-err_gpiod_chip_get_line:
-  gpiod_chip_close(chip);
-err_gpiod_chip_open_by_number:
+void iotctrl_buzzer_close(struct iotctrl_buzzer_handle *h) {
+  if (h == NULL)
+    return;
+  pthread_mutex_lock(&h->mutex);
+  h->stop = true;
+  drop_queue(h);
+  pthread_cond_signal(&h->player_cond);
+  pthread_mutex_unlock(&h->mutex);
+  pthread_join(h->th_player, NULL);
+  // Never leave the buzzer buzzing, even if the sequence was not terminated
+  // with an off section
+  (void)set_line(h, 0);
+  iotctrl_gpio_output_release(&h->line);
+  pthread_mutex_destroy(&h->mutex);
+  pthread_cond_destroy(&h->done_cond);
+  pthread_cond_destroy(&h->player_cond);
+  free(h);
+}
+
+int iotctrl_make_a_buzz(const char *gpiochip_path, const size_t signal_pin,
+                        const struct iotctrl_buzz_unit sequence[],
+                        const size_t sequence_len) {
+  struct iotctrl_buzzer_handle *h =
+      iotctrl_buzzer_open(gpiochip_path, signal_pin);
+  if (h == NULL)
+    return -1;
+  const int retval = iotctrl_buzzer_play(h, sequence, sequence_len);
+  iotctrl_buzzer_close(h);
   return retval;
 }
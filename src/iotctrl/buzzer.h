@@ -3,21 +3,93 @@
 
 #include <stdlib.h>
 
+#include "metrics.h"
+
 struct iotctrl_buzz_unit {
   int on_off;
   size_t duration_ms;
 };
 
+// Opaque handle that keeps the buzzer's GPIO line requested between
+// sequences. Sequences are played by a background thread, see
+// iotctrl_buzzer_play_async().
+struct iotctrl_buzzer_handle;
+
+// Number of sequences that can wait behind the one being played
+#define IOTCTRL_BUZZER_QUEUE_CAPACITY 16
+
+enum iotctrl_buzzer_play_mode {
+  // Play after the sequences already submitted
+  IOTCTRL_BUZZER_ENQUEUE = 0,
+  // Stop the sequence being played, drop the queued ones and play this one
+  // right away
+  IOTCTRL_BUZZER_PREEMPT,
+};
+
+/**
+ * @brief Request the signal pin of a buzzer as an output, driven low
+ * @param gpiochip_path GPIO device path, typically /dev/gpiochip0
+ * @param signal_pin Signal pin (a.k.a., I/O), following the numbering of
+ * GPIO/BCM schema
+ * @returns a handle on success or NULL on error
+ * */
+struct iotctrl_buzzer_handle *iotctrl_buzzer_open(const char *gpiochip_path,
+                                                  const size_t signal_pin);
+
+/**
+ * @brief Play a sequence of beeps, blocking until it finishes, i.e., after
+ * the sequences queued before it. It returns early if the sequence is
+ * preempted or cancelled.
+ * @param sequence Same as iotctrl_make_a_buzz()
+ * @returns 0 on success, -1 on memory allocation failure, -2 if the line
+ * cannot be set or -3 if the queue is full
+ * */
+int iotctrl_buzzer_play(struct iotctrl_buzzer_handle *h,
+                        const struct iotctrl_buzz_unit sequence[],
+                        const size_t sequence_len);
+
+/**
+ * @brief Submit a sequence of beeps and return immediately. The sequence is
+ * copied. Each section ends at an absolute CLOCK_MONOTONIC deadline counted
+ * from the start of the sequence, so late wake-ups do not add up.
+ * @returns 0 on success, -1 on memory allocation failure or -3 if the queue
+ * is full
+ * */
+int iotctrl_buzzer_play_async(struct iotctrl_buzzer_handle *h,
+                              const struct iotctrl_buzz_unit sequence[],
+                              const size_t sequence_len,
+                              const enum iotctrl_buzzer_play_mode mode);
+
+/**
+ * @brief Stop the sequence being played, drop the queued ones and drive the
+ * line low before returning
+ * */
+void iotctrl_buzzer_cancel(struct iotctrl_buzzer_handle *h);
+
+/**
+ * @brief Metrics of setting the line, one operation per section played,
+ * valid until iotctrl_buzzer_close()
+ * */
+const struct iotctrl_metrics *
+iotctrl_buzzer_get_metrics(const struct iotctrl_buzzer_handle *h);
+
+/**
+ * @brief Drop queued sequences, drive the line low and release it
+ * */
+void iotctrl_buzzer_close(struct iotctrl_buzzer_handle *h);
+
 /**
- * @brief Make a buzzer buzz!
+ * @brief Make a buzzer buzz! It is a one-off iotctrl_buzzer_open(),
+ * iotctrl_buzzer_play() and iotctrl_buzzer_close(), prefer the handle if
+ * sequences are played repeatedly.
  * @param gpiochip_path GPIO device path, typically /dev/gpiochip0
  * @param signal_pin Signal pin (a.k.a., I/O), following the numbering of
  * GPIO/BCM schema
- * @param sequence Sequence of beeps. Users should always terminate the sequence
- * with an off section (i.e., setting on_off to 0); otherwise the buzzer will
- * keep buzzing
+ * @param sequence Sequence of beeps. The line is driven low once it ends,
+ * even if its last section is an on section
  * @param sequence_len Length of the Sequence array
- * @returns 0 means success or an error code will be returned.
+ * @returns 0 means success, -1 if the line cannot be requested or memory
+ * cannot be allocated, or -2 if the line cannot be set
  * */
 int iotctrl_make_a_buzz(const char *gpiochip_path, const size_t signal_pin,
                         const struct iotctrl_buzz_unit sequence[],
@@ -0,0 +1,31 @@
+#ifndef LIBIOTCTRL_CRC_H
+#define LIBIOTCTRL_CRC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief CRC-16/MODBUS (reflected polynomial 0xA001, initial value 0xFFFF) as
+ * used by the DL11-MC series temperature sensors. The bitwise version of it
+ * can be found at page 21 of
+ * https://github.com/alex-lt-kong/libiotctrl/blob/main/assets/dl11-mc_manual.pdf
+ * @returns The CRC. Note that on the wire the low byte is sent first.
+ */
+uint16_t iotctrl_crc16_modbus(const uint8_t *buf, size_t len);
+
+/**
+ * @brief CRC-8 (polynomial 0x31, initial value 0xFF) as used by SHT3x sensors.
+ * Ref:
+ * https://github.com/adafruit/Adafruit_SHT31/blob/bd465b980b838892964d2744d06ffc7e47b6fbef/Adafruit_SHT31.cpp#L163C4-L194
+ */
+uint8_t iotctrl_crc8_sht31(const uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBIOTCTRL_CRC_H
@@ -1,84 +1,87 @@
+#include "dht31.h"
+#include "crc.h"
+#include "transport.h"
+
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <linux/i2c-dev.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
-int iotctrl_dht31_init(const char *device_path) {
-  int fd;
-  if ((fd = open(device_path, O_RDWR)) < 0) {
-    fprintf(stderr, "Failed to open(%s): %d(%s)\n", device_path, errno,
-            strerror(errno));
-  }
-
-  // Get I2C device, SHT31 I2C address is 0x44(68)
-  if (ioctl(fd, I2C_SLAVE, 0x44) != 0) {
-    fprintf(stderr, "Failed to ioctl(%s): %d(%s)\n", device_path, errno,
-            strerror(errno));
-  }
-  return fd;
-}
+#define SHT31_DEFAULT_ADDR 0x44
 
-/**
- * Performs a CRC8 calculation on the supplied values.
- *
- * @param data  Pointer to the data to use when calculating the CRC8.
- * @param len   The number of bytes in 'data'.
- *
- * @return The computed CRC8 value.
- */
-uint8_t crc8(const uint8_t *data, int len) {
-  // Ref:
-  // https://github.com/adafruit/Adafruit_SHT31/blob/bd465b980b838892964d2744d06ffc7e47b6fbef/Adafruit_SHT31.cpp#L163C4-L194
+struct iotctrl_dht31_handle {
+  struct iotctrl_i2c_bus bus;
+  uint8_t addr;
+  struct iotctrl_dht31_config config;
+  struct iotctrl_metrics metrics;
+};
 
-  const uint8_t POLYNOMIAL = 0x31;
-  uint8_t crc = 0xFF;
+// clang-format off
+// Command codes, per section 4 of the SHT3x-DIS datasheet, indexed by
+// repeatability (high, medium, low)
+static const uint16_t single_shot_cmds[2][3] = {
+  {0x2400, 0x240B, 0x2416}, // clock stretching disabled
+  {0x2C06, 0x2C0D, 0x2C10}, // clock stretching enabled
+};
+// Indexed by acquisition - IOTCTRL_DHT31_PERIODIC_0_5_MPS
+static const uint16_t periodic_cmds[5][3] = {
+  {0x2032, 0x2024, 0x202F}, // 0.5 mps
+  {0x2130, 0x2126, 0x212D}, // 1 mps
+  {0x2236, 0x2220, 0x222B}, // 2 mps
+  {0x2334, 0x2322, 0x2329}, // 4 mps
+  {0x2737, 0x2721, 0x272A}, // 10 mps
+};
+// clang-format on
+#define CMD_FETCH_DATA 0xE000
+#define CMD_BREAK 0x3093
+// Max. measurement duration in microseconds, indexed by repeatability
+static const unsigned int measurement_duration_us[3] = {15500, 6500, 4500};
 
-  for (int j = len; j; --j) {
-    crc ^= *data++;
+// How i2c-dev reports a NACK, depending on the bus driver
+static bool is_nack(int err) { return err == ENXIO || err == EREMOTEIO; }
 
-    for (int i = 8; i; --i) {
-      crc = (crc & 0x80) ? (crc << 1) ^ POLYNOMIAL : (crc << 1);
-    }
-  }
-  return crc;
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-int iotctrl_dht31_read(const int fd, float *temp_celsius,
-                       float *relative_humidity) {
-
-  // Send high repeatability measurement command
-  // Command msb, command lsb(0x2C, 0x06)
-  uint8_t config[2] = {0x2C, 0x06};
-  if (write(fd, config, 2) != 2) {
-    fprintf(stderr, "Failed to write() command to fd %d: %d(%s)\n", fd, errno,
-            strerror(errno));
+static int send_command(struct iotctrl_i2c_bus *bus, const uint8_t addr,
+                        const uint16_t command) {
+  uint8_t config[2] = {command >> 8, command & 0xFF};
+  struct iotctrl_i2c_msg cmd = {addr, 0, 2, config};
+  if (iotctrl_i2c_transfer(bus, &cmd, 1) != 0) {
+    fprintf(stderr, "Failed to write() command %#06x to %#04x: %d(%s)\n",
+            command, addr, errno, strerror(errno));
     return -1;
   }
+  return 0;
+}
 
-  // Read 6 bytes of data
-  // temp msb, temp lsb, temp CRC, humidity msb, humidity lsb,
-  // humidity CRC
-  uint8_t buf[6] = {0};
-  if (read(fd, buf, 6) != 6) {
-    fprintf(stderr, "Failed to read() values from fd %d: %d(%s)\n", fd, errno,
-            strerror(errno));
-    return -1;
-  }
+// temp msb, temp lsb, temp CRC, humidity msb, humidity lsb, humidity CRC.
+// CRC mismatches are accounted to m, which may be NULL.
+static int parse_result(struct iotctrl_metrics *m, const uint8_t addr,
+                        const uint8_t *buf, float *temp_celsius,
+                        float *relative_humidity) {
   // Reference:
   // https://github.com/adafruit/Adafruit_SHT31/blob/bd465b980b838892964d2744d06ffc7e47b6fbef/Adafruit_SHT31.cpp#L197C8-L227
   float temp_celsius_t = (((buf[0] << 8) | buf[1]) * 175.0) / 65535.0 - 45.0;
   float relative_humidity_t = ((625 * ((buf[3] << 8) | buf[4])) >> 12) / 100.0;
-  if (buf[2] != crc8(buf, 2) || buf[5] != crc8(buf + 3, 2)) {
+  if (buf[2] != iotctrl_crc8_sht31(buf, 2) ||
+      buf[5] != iotctrl_crc8_sht31(buf + 3, 2)) {
     fprintf(stderr,
-            "Data read from fd %d but CRC8 failed. Retrieved (erroneous) "
+            "Data read from %#04x but CRC8 failed. Retrieved (erroneous) "
             "readings are %f (temperature, °C), %f (relative humidity, %%)\n",
-            fd, temp_celsius_t, relative_humidity_t);
+            addr, temp_celsius_t, relative_humidity_t);
+    iotctrl_metrics_add_crc_error(m, IOTCTRL_METRICS_SHT31_MEASURE);
     return -1;
   }
 
@@ -88,6 +91,317 @@ int iotctrl_dht31_read(const int fd, float *temp_celsius,
   return 0;
 }
 
+static int read_result(struct iotctrl_metrics *m, struct iotctrl_i2c_bus *bus,
+                       const uint8_t addr, float *temp_celsius,
+                       float *relative_humidity) {
+  uint8_t buf[6] = {0};
+  struct iotctrl_i2c_msg rsp = {addr, IOTCTRL_I2C_M_RD, 6, buf};
+  if (iotctrl_i2c_transfer(bus, &rsp, 1) != 0) {
+    fprintf(stderr, "Failed to read() values from %#04x: %d(%s)\n", addr,
+            errno, strerror(errno));
+    return -1;
+  }
+  return parse_result(m, addr, buf, temp_celsius, relative_humidity);
+}
+
+static int measure_single_shot(struct iotctrl_metrics *m,
+                               struct iotctrl_i2c_bus *bus, const uint8_t addr,
+                               const struct iotctrl_dht31_config *config,
+                               float *temp_celsius, float *relative_humidity) {
+  const uint16_t command =
+      single_shot_cmds[config->clock_stretching][config->repeatability];
+  if (send_command(bus, addr, command) != 0)
+    return -1;
+  // With clock stretching the sensor holds SCL low until the result is ready,
+  // without it the sensor NACKs reads until then
+  if (!config->clock_stretching)
+    usleep(measurement_duration_us[config->repeatability]);
+  return read_result(m, bus, addr, temp_celsius, relative_humidity);
+}
+
+static int fetch_periodic(struct iotctrl_dht31_handle *h, float *temp_celsius,
+                          float *relative_humidity) {
+  // The fetch command and the read go out as one combined transaction
+  uint8_t cmd[2] = {CMD_FETCH_DATA >> 8, CMD_FETCH_DATA & 0xFF};
+  uint8_t buf[6] = {0};
+  struct iotctrl_i2c_msg msgs[2] = {{h->addr, 0, 2, cmd},
+                                    {h->addr, IOTCTRL_I2C_M_RD, 6, buf}};
+  if (iotctrl_i2c_transfer(&h->bus, msgs, 2) != 0) {
+    // The read header is NACKed if no measurement has completed since the
+    // last fetch
+    if (is_nack(errno))
+      return -2;
+    fprintf(stderr, "Failed to fetch values from %#04x: %d(%s)\n", h->addr,
+            errno, strerror(errno));
+    return -1;
+  }
+  return parse_result(&h->metrics, h->addr, buf, temp_celsius,
+                      relative_humidity);
+}
+
+static bool is_periodic(const struct iotctrl_dht31_config *config) {
+  return config->acquisition != IOTCTRL_DHT31_SINGLE_SHOT;
+}
+
+struct iotctrl_dht31_handle *iotctrl_dht31_open(const char *device_path,
+                                                const uint8_t addr) {
+  struct iotctrl_dht31_handle *h =
+      calloc(1, sizeof(struct iotctrl_dht31_handle));
+  if (h == NULL) {
+    perror("calloc()");
+    return NULL;
+  }
+  if (iotctrl_i2c_open(&h->bus, device_path) != 0) {
+    free(h);
+    return NULL;
+  }
+  h->addr = addr;
+  h->config.acquisition = IOTCTRL_DHT31_SINGLE_SHOT;
+  h->config.repeatability = IOTCTRL_DHT31_REPEATABILITY_HIGH;
+  h->config.clock_stretching = true;
+  return h;
+}
+
+int iotctrl_dht31_configure(struct iotctrl_dht31_handle *h,
+                            const struct iotctrl_dht31_config *config) {
+  if (config->repeatability > IOTCTRL_DHT31_REPEATABILITY_LOW ||
+      config->acquisition > IOTCTRL_DHT31_PERIODIC_10_MPS) {
+    fprintf(stderr, "Invalid SHT31 configuration\n");
+    return -1;
+  }
+  // The sensor only accepts a new periodic command, or single-shot ones,
+  // after the periodic acquisition is stopped
+  if (is_periodic(&h->config)) {
+    if (send_command(&h->bus, h->addr, CMD_BREAK) != 0)
+      return -1;
+    h->config.acquisition = IOTCTRL_DHT31_SINGLE_SHOT;
+    // The sensor needs 1ms to abort the measurement before it accepts the
+    // next command
+    usleep(1000);
+  }
+  if (is_periodic(config)) {
+    const uint16_t command =
+        periodic_cmds[config->acquisition - IOTCTRL_DHT31_PERIODIC_0_5_MPS]
+                     [config->repeatability];
+    if (send_command(&h->bus, h->addr, command) != 0)
+      return -1;
+  }
+  h->config = *config;
+  return 0;
+}
+
+int iotctrl_dht31_measure(struct iotctrl_dht31_handle *h, float *temp_celsius,
+                          float *relative_humidity) {
+  const uint64_t start_ns = monotonic_ns();
+  const int ret =
+      is_periodic(&h->config)
+          ? fetch_periodic(h, temp_celsius, relative_humidity)
+          : measure_single_shot(&h->metrics, &h->bus, h->addr, &h->config,
+                                temp_celsius, relative_humidity);
+  iotctrl_metrics_record(&h->metrics, IOTCTRL_METRICS_SHT31_MEASURE, ret,
+                         monotonic_ns() - start_ns);
+  return ret;
+}
+
+int iotctrl_dht31_trigger(struct iotctrl_dht31_handle *h,
+                          unsigned int *wait_us) {
+  if (is_periodic(&h->config)) {
+    *wait_us = 0;
+    return 0;
+  }
+  if (send_command(&h->bus, h->addr,
+                   single_shot_cmds[0][h->config.repeatability]) != 0)
+    return -1;
+  *wait_us = measurement_duration_us[h->config.repeatability];
+  return 0;
+}
+
+int iotctrl_dht31_fetch(struct iotctrl_dht31_handle *h, float *temp_celsius,
+                        float *relative_humidity) {
+  if (is_periodic(&h->config))
+    return fetch_periodic(h, temp_celsius, relative_humidity);
+  uint8_t buf[6] = {0};
+  struct iotctrl_i2c_msg rsp = {h->addr, IOTCTRL_I2C_M_RD, 6, buf};
+  if (iotctrl_i2c_transfer(&h->bus, &rsp, 1) != 0) {
+    if (is_nack(errno))
+      return -2;
+    fprintf(stderr, "Failed to read() values from %#04x: %d(%s)\n", h->addr,
+            errno, strerror(errno));
+    return -1;
+  }
+  return parse_result(&h->metrics, h->addr, buf, temp_celsius,
+                      relative_humidity);
+}
+
+const struct iotctrl_metrics *
+iotctrl_dht31_get_metrics(const struct iotctrl_dht31_handle *h) {
+  return &h->metrics;
+}
+
+void iotctrl_dht31_close(struct iotctrl_dht31_handle *h) {
+  if (h == NULL)
+    return;
+  // Leave the sensor idle instead of measuring forever
+  if (is_periodic(&h->config))
+    (void)send_command(&h->bus, h->addr, CMD_BREAK);
+  iotctrl_i2c_close(&h->bus);
+  free(h);
+}
+
+struct iotctrl_dht31_bus {
+  struct iotctrl_i2c_bus bus;
+  enum iotctrl_dht31_repeatability repeatability;
+  size_t sensor_count;
+  uint8_t addrs[IOTCTRL_DHT31_BUS_MAX_SENSORS];
+  // Command and result buffers of all sensors, laid out for the combined
+  // transfers
+  uint8_t cmds[IOTCTRL_DHT31_BUS_MAX_SENSORS][2];
+  uint8_t results[IOTCTRL_DHT31_BUS_MAX_SENSORS][6];
+  struct iotctrl_i2c_msg cmd_msgs[IOTCTRL_DHT31_BUS_MAX_SENSORS];
+  struct iotctrl_i2c_msg result_msgs[IOTCTRL_DHT31_BUS_MAX_SENSORS];
+  struct iotctrl_metrics metrics;
+};
+
+struct iotctrl_dht31_bus *
+iotctrl_dht31_bus_open(const char *device_path, const uint8_t *addrs,
+                       const size_t sensor_count,
+                       const enum iotctrl_dht31_repeatability repeatability) {
+  if (sensor_count < 1 || sensor_count > IOTCTRL_DHT31_BUS_MAX_SENSORS ||
+      repeatability > IOTCTRL_DHT31_REPEATABILITY_LOW) {
+    fprintf(stderr, "Invalid number of sensors (%zu) or repeatability\n",
+            sensor_count);
+    return NULL;
+  }
+  struct iotctrl_dht31_bus *b = calloc(1, sizeof(struct iotctrl_dht31_bus));
+  if (b == NULL) {
+    perror("calloc()");
+    return NULL;
+  }
+  if (iotctrl_i2c_open(&b->bus, device_path) != 0) {
+    free(b);
+    return NULL;
+  }
+  b->repeatability = repeatability;
+  b->sensor_count = sensor_count;
+  // Clock stretching would hold the bus during the first sensor's
+  // measurement, so every sensor is triggered without it and they all
+  // measure at the same time
+  const uint16_t command = single_shot_cmds[0][repeatability];
+  for (size_t i = 0; i < sensor_count; ++i) {
+    b->addrs[i] = addrs[i];
+    b->cmds[i][0] = command >> 8;
+    b->cmds[i][1] = command & 0xFF;
+    b->cmd_msgs[i] = (struct iotctrl_i2c_msg){addrs[i], 0, 2, b->cmds[i]};
+    b->result_msgs[i] =
+        (struct iotctrl_i2c_msg){addrs[i], IOTCTRL_I2C_M_RD, 6, b->results[i]};
+  }
+  return b;
+}
+
+int iotctrl_dht31_bus_measure(struct iotctrl_dht31_bus *b, float *temps_celsius,
+                              float *relative_humidities, int *results) {
+  const uint64_t start_ns = monotonic_ns();
+  const size_t n = b->sensor_count;
+  for (size_t i = 0; i < n; ++i)
+    results[i] = 0;
+  bool batch_ok = true;
+  // A NACK aborts the rest of a combined transfer, in which case sensors are
+  // retried one by one to find out which of them failed
+  if (iotctrl_i2c_transfer(&b->bus, b->cmd_msgs, n) != 0) {
+    batch_ok = false;
+    for (size_t i = 0; i < n; ++i) {
+      iotctrl_metrics_add_retry(&b->metrics, IOTCTRL_METRICS_SHT31_MEASURE);
+      if (iotctrl_i2c_transfer(&b->bus, &b->cmd_msgs[i], 1) == 0)
+        continue;
+      // Sensors before the one that NACKed were triggered by the combined
+      // transfer and NACK commands while converting, only reading the
+      // result tells them apart from a sensor that is missing
+      if (is_nack(errno))
+        continue;
+      fprintf(stderr, "Failed to write() command to %#04x: %d(%s)\n",
+              b->addrs[i], errno, strerror(errno));
+      results[i] = -1;
+    }
+  }
+  // One conversion wait for all sensors
+  usleep(measurement_duration_us[b->repeatability]);
+
+  int failed_count = 0;
+  for (size_t i = 0; i < n && batch_ok; ++i)
+    batch_ok = results[i] == 0;
+  if (!batch_ok || iotctrl_i2c_transfer(&b->bus, b->result_msgs, n) != 0) {
+    for (size_t i = 0; i < n; ++i) {
+      if (results[i] != 0)
+        continue;
+      // Unless triggering fell back to single sensors, the combined read was
+      // tried
+      if (batch_ok)
+        iotctrl_metrics_add_retry(&b->metrics, IOTCTRL_METRICS_SHT31_MEASURE);
+      if (iotctrl_i2c_transfer(&b->bus, &b->result_msgs[i], 1) != 0) {
+        fprintf(stderr, "Failed to read() values from %#04x: %d(%s)\n",
+                b->addrs[i], errno, strerror(errno));
+        results[i] = -1;
+      }
+    }
+  }
+  // Every sensor took part in the whole transaction
+  const uint64_t latency_ns = monotonic_ns() - start_ns;
+  for (size_t i = 0; i < n; ++i) {
+    if (results[i] == 0)
+      results[i] =
+          parse_result(&b->metrics, b->addrs[i], b->results[i],
+                       &temps_celsius[i], &relative_humidities[i]);
+    if (results[i] != 0)
+      ++failed_count;
+    iotctrl_metrics_record(&b->metrics, IOTCTRL_METRICS_SHT31_MEASURE,
+                           results[i], latency_ns);
+  }
+  return failed_count;
+}
+
+const struct iotctrl_metrics *
+iotctrl_dht31_bus_get_metrics(const struct iotctrl_dht31_bus *b) {
+  return &b->metrics;
+}
+
+void iotctrl_dht31_bus_close(struct iotctrl_dht31_bus *b) {
+  if (b == NULL)
+    return;
+  iotctrl_i2c_close(&b->bus);
+  free(b);
+}
+
+int iotctrl_dht31_init(const char *device_path) {
+  int fd;
+  if ((fd = open(device_path, O_RDWR)) < 0) {
+    fprintf(stderr, "Failed to open(%s): %d(%s)\n", device_path, errno,
+            strerror(errno));
+  }
+
+  // Get I2C device, SHT31 I2C address is 0x44(68)
+  if (ioctl(fd, I2C_SLAVE, SHT31_DEFAULT_ADDR) != 0) {
+    fprintf(stderr, "Failed to ioctl(%s): %d(%s)\n", device_path, errno,
+            strerror(errno));
+  }
+  return fd;
+}
+
+int iotctrl_dht31_read(const int fd, float *temp_celsius,
+                       float *relative_humidity) {
+  struct iotctrl_i2c_bus bus;
+  if (iotctrl_i2c_from_fd(&bus, fd) != 0)
+    return -1;
+  const struct iotctrl_dht31_config config = {
+      IOTCTRL_DHT31_SINGLE_SHOT, IOTCTRL_DHT31_REPEATABILITY_HIGH, true};
+  const uint64_t start_ns = monotonic_ns();
+  const int ret = measure_single_shot(NULL, &bus, SHT31_DEFAULT_ADDR, &config,
+                                      temp_celsius, relative_humidity);
+  iotctrl_metrics_record(NULL, IOTCTRL_METRICS_SHT31_MEASURE, ret,
+                         monotonic_ns() - start_ns);
+  iotctrl_i2c_close(&bus);
+  return ret;
+}
+
 void iotctrl_dht31_destroy(const int fd) {
   if (fd >= 0)
     close(fd);
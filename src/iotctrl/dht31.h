@@ -8,12 +8,147 @@ extern "C" {
 #include <fcntl.h>
 #include <limits.h>
 #include <linux/i2c-dev.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include <stdbool.h>
+
+#include "metrics.h"
+
+// Opaque handle bound to one sensor on an I2C bus
+struct iotctrl_dht31_handle;
+
+enum iotctrl_dht31_acquisition {
+  // A measurement is triggered by every iotctrl_dht31_measure() call, which
+  // then waits for it (up to 15ms with high repeatability)
+  IOTCTRL_DHT31_SINGLE_SHOT = 0,
+  // The sensor measures on its own at the given rate (measurements per
+  // second) and iotctrl_dht31_measure() only fetches the latest result
+  IOTCTRL_DHT31_PERIODIC_0_5_MPS,
+  IOTCTRL_DHT31_PERIODIC_1_MPS,
+  IOTCTRL_DHT31_PERIODIC_2_MPS,
+  IOTCTRL_DHT31_PERIODIC_4_MPS,
+  IOTCTRL_DHT31_PERIODIC_10_MPS,
+};
+
+// Higher repeatability means less noise but a longer measurement, i.e. max.
+// 15ms, 6ms and 4ms respectively
+enum iotctrl_dht31_repeatability {
+  IOTCTRL_DHT31_REPEATABILITY_HIGH = 0,
+  IOTCTRL_DHT31_REPEATABILITY_MEDIUM,
+  IOTCTRL_DHT31_REPEATABILITY_LOW,
+};
+
+struct iotctrl_dht31_config {
+  enum iotctrl_dht31_acquisition acquisition;
+  enum iotctrl_dht31_repeatability repeatability;
+  // Single shot only. If enabled, the sensor holds the bus until the
+  // measurement is ready, otherwise the driver sleeps for the max.
+  // measurement duration before reading.
+  bool clock_stretching;
+};
+
+/**
+ * @brief Open the I2C bus a sensor is connected to
+ * @param device_path typically /dev/i2c-1. A path starting with "sim:" (see
+ * sim.h) talks to a simulated sensor instead.
+ * @param addr I2C address of the sensor, 0x44 or 0x45 depending on the ADDR
+ * pin
+ * @returns a handle on success or NULL on error
+ */
+struct iotctrl_dht31_handle *iotctrl_dht31_open(const char *device_path,
+                                                const uint8_t addr);
+
+/**
+ * @brief Change how the sensor measures, a newly opened handle takes single
+ * shot, high repeatability measurements with clock stretching
+ * @returns 0 on success or -1 on error
+ */
+int iotctrl_dht31_configure(struct iotctrl_dht31_handle *h,
+                            const struct iotctrl_dht31_config *config);
+
+/**
+ * @brief Take a measurement, or fetch the latest one in periodic mode
+ * @returns 0 on success, -2 if no new measurement is available since the
+ * last fetch in periodic mode, or -1 on other errors
+ */
+int iotctrl_dht31_measure(struct iotctrl_dht31_handle *h, float *temp_celsius,
+                          float *relative_humidity);
+
+/**
+ * @brief Non-blocking half of iotctrl_dht31_measure(): trigger a single shot
+ * measurement without clock stretching. It is a no-op in periodic mode.
+ * @param wait_us how long to wait before iotctrl_dht31_fetch()
+ * @returns 0 on success or -1 on error
+ */
+int iotctrl_dht31_trigger(struct iotctrl_dht31_handle *h,
+                          unsigned int *wait_us);
+
+/**
+ * @brief Read the result of iotctrl_dht31_trigger(), or the latest result in
+ * periodic mode
+ * @returns 0 on success, -2 if the sensor NACKs the read, i.e., there is no
+ * new measurement yet, or -1 on other errors
+ */
+int iotctrl_dht31_fetch(struct iotctrl_dht31_handle *h, float *temp_celsius,
+                        float *relative_humidity);
+
+/**
+ * @brief Metrics of iotctrl_dht31_measure() calls and of CRC failures of
+ * iotctrl_dht31_fetch(), valid until iotctrl_dht31_close()
+ */
+const struct iotctrl_metrics *
+iotctrl_dht31_get_metrics(const struct iotctrl_dht31_handle *h);
+
+/**
+ * @brief Stop periodic acquisition, if any, and close the bus
+ */
+void iotctrl_dht31_close(struct iotctrl_dht31_handle *h);
+
+// Up to this many sensors can be measured together on one bus. Sensors
+// behind an I2C multiplexer are on separate buses, i.e., one /dev/i2c-N per
+// mux channel.
+#define IOTCTRL_DHT31_BUS_MAX_SENSORS 8
+
+// Opaque handle of several sensors on one I2C bus, all measured at once
+struct iotctrl_dht31_bus;
+
+/**
+ * @brief Open an I2C bus with sensors at the given addresses
+ * @param addrs e.g. {0x44, 0x45}, copied into the handle
+ * @returns a handle on success or NULL on error
+ */
+struct iotctrl_dht31_bus *
+iotctrl_dht31_bus_open(const char *device_path, const uint8_t *addrs,
+                       const size_t sensor_count,
+                       const enum iotctrl_dht31_repeatability repeatability);
+
+/**
+ * @brief Measure all sensors, they are triggered with one combined I2C
+ * transfer, share one conversion wait and are read with another combined
+ * transfer
+ * @param temps_celsius, relative_humidities, results arrays with one element
+ * per sensor, in the order of addrs. results[i] is 0 on success or non-zero
+ * if sensor i failed, in which case its readings are left untouched.
+ * @returns Number of sensors that failed
+ */
+int iotctrl_dht31_bus_measure(struct iotctrl_dht31_bus *b,
+                              float *temps_celsius,
+                              float *relative_humidities, int *results);
+
+/**
+ * @brief Metrics of iotctrl_dht31_bus_measure(), one operation per sensor,
+ * valid until iotctrl_dht31_bus_close()
+ */
+const struct iotctrl_metrics *
+iotctrl_dht31_bus_get_metrics(const struct iotctrl_dht31_bus *b);
+
+void iotctrl_dht31_bus_close(struct iotctrl_dht31_bus *b);
+
 /**
  * @brief iotctrl_dht31_init() is nothing but opening a file descriptor
  * @returns Same as open(), check `man 2 open` for details
@@ -0,0 +1,249 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static struct iotctrl_metrics global_metrics[IOTCTRL_METRICS_OP_COUNT];
+
+static const char *const op_names[IOTCTRL_METRICS_OP_COUNT] = {
+    [IOTCTRL_METRICS_DL11_READ] = "dl11_read",
+    [IOTCTRL_METRICS_SHT31_MEASURE] = "sht31_measure",
+    [IOTCTRL_METRICS_RELAY_WRITE] = "relay_write",
+    [IOTCTRL_METRICS_BUZZER_SET] = "buzzer_set",
+    [IOTCTRL_METRICS_7SEG_REFRESH] = "7seg_refresh",
+};
+
+static inline void add(uint64_t *counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static size_t bucket_of(uint64_t latency_ns) {
+  // Rounded up to whole microseconds, then the smallest i with 2^i >= us
+  const uint64_t us = (latency_ns + 999) / 1000;
+  if (us <= 1)
+    return 0;
+  const size_t i = 64 - __builtin_clzll(us - 1);
+  const size_t last = IOTCTRL_METRICS_BUCKET_COUNT - 1;
+  return i < last ? i : last;
+}
+
+static void record(struct iotctrl_metrics *m, int result, size_t bucket,
+                   uint64_t latency_ns) {
+  add(&m->operation_count, 1);
+  add(&m->latency_buckets[bucket], 1);
+  add(&m->latency_sum_ns, latency_ns);
+  if (result == 0)
+    return;
+  add(&m->error_count, 1);
+  if (result >= IOTCTRL_METRICS_MIN_CODE && result <= IOTCTRL_METRICS_MAX_CODE)
+    add(&m->error_counts[result - IOTCTRL_METRICS_MIN_CODE], 1);
+}
+
+void iotctrl_metrics_record(struct iotctrl_metrics *m,
+                            enum iotctrl_metrics_op op, int result,
+                            uint64_t latency_ns) {
+  const size_t bucket = bucket_of(latency_ns);
+  record(&global_metrics[op], result, bucket, latency_ns);
+  if (m != NULL)
+    record(m, result, bucket, latency_ns);
+}
+
+void iotctrl_metrics_add_crc_error(struct iotctrl_metrics *m,
+                                   enum iotctrl_metrics_op op) {
+  add(&global_metrics[op].crc_error_count, 1);
+  if (m != NULL)
+    add(&m->crc_error_count, 1);
+}
+
+void iotctrl_metrics_add_retry(struct iotctrl_metrics *m,
+                               enum iotctrl_metrics_op op) {
+  add(&global_metrics[op].retry_count, 1);
+  if (m != NULL)
+    add(&m->retry_count, 1);
+}
+
+void iotctrl_metrics_read(const struct iotctrl_metrics *m,
+                          struct iotctrl_metrics *snapshot) {
+  // Every field is a uint64_t counter
+  const uint64_t *src = (const uint64_t *)m;
+  uint64_t *dst = (uint64_t *)snapshot;
+  for (size_t i = 0; i < sizeof(struct iotctrl_metrics) / sizeof(uint64_t);
+       ++i)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+const struct iotctrl_metrics *
+iotctrl_metrics_global(enum iotctrl_metrics_op op) {
+  return &global_metrics[op];
+}
+
+const char *iotctrl_metrics_op_name(enum iotctrl_metrics_op op) {
+  return op < IOTCTRL_METRICS_OP_COUNT ? op_names[op] : "unknown";
+}
+
+uint64_t iotctrl_metrics_bucket_bound_ns(size_t bucket) {
+  if (bucket >= IOTCTRL_METRICS_BUCKET_COUNT - 1)
+    return UINT64_MAX;
+  return (1ULL << bucket) * 1000;
+}
+
+// snprintf() into a buffer that may run out, keeps counting what the complete
+// output would take
+struct output {
+  char *buf;
+  size_t size;
+  size_t len;
+};
+
+__attribute__((format(printf, 2, 3))) static void
+append(struct output *out, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  const size_t avail = out->len < out->size ? out->size - out->len : 0;
+  const int n =
+      vsnprintf(avail > 0 ? out->buf + out->len : NULL, avail, fmt, args);
+  va_end(args);
+  if (n > 0)
+    out->len += n;
+}
+
+// Label values must escape backslashes, double quotes and line feeds
+static void append_labels(struct output *out,
+                          const struct iotctrl_metrics_source *s) {
+  append(out, "op=\"%s\"", iotctrl_metrics_op_name(s->op));
+  if (s->device == NULL)
+    return;
+  append(out, ",device=\"");
+  for (const char *c = s->device; *c != '\0'; ++c) {
+    if (*c == '\\' || *c == '"')
+      append(out, "\\%c", *c);
+    else if (*c == '\n')
+      append(out, "\\n");
+    else
+      append(out, "%c", *c);
+  }
+  append(out, "\"");
+}
+
+static void append_header(struct output *out, const char *name,
+                          const char *type, const char *help) {
+  append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Counter families that are one field of struct iotctrl_metrics
+enum { COUNTER_OPERATIONS = 0, COUNTER_CRC_ERRORS, COUNTER_RETRIES };
+static const struct {
+  const char *name;
+  const char *help;
+  size_t offset;
+} counters[] = {
+    [COUNTER_OPERATIONS] = {"iotctrl_operations_total",
+                            "Bus operations performed.",
+                            offsetof(struct iotctrl_metrics, operation_count)},
+    [COUNTER_CRC_ERRORS] = {"iotctrl_crc_errors_total",
+                            "Frames received with a CRC mismatch.",
+                            offsetof(struct iotctrl_metrics, crc_error_count)},
+    [COUNTER_RETRIES] = {"iotctrl_retries_total",
+                         "Transactions issued again after a failure.",
+                         offsetof(struct iotctrl_metrics, retry_count)},
+};
+
+static void append_counter(struct output *out, size_t counter,
+                           const struct iotctrl_metrics_source *s,
+                           size_t count) {
+  append_header(out, counters[counter].name, "counter",
+                counters[counter].help);
+  for (size_t i = 0; i < count; ++i) {
+    const uint64_t *value =
+        (const uint64_t *)((const char *)s[i].metrics +
+                           counters[counter].offset);
+    append(out, "%s{", counters[counter].name);
+    append_labels(out, &s[i]);
+    append(out, "} %llu\n",
+           (unsigned long long)__atomic_load_n(value, __ATOMIC_RELAXED));
+  }
+}
+
+static void append_errors(struct output *out,
+                          const struct iotctrl_metrics_source *s,
+                          size_t count) {
+  append_header(out, "iotctrl_errors_total", "counter",
+                "Failed operations by error code.");
+  for (size_t i = 0; i < count; ++i) {
+    struct iotctrl_metrics m;
+    iotctrl_metrics_read(s[i].metrics, &m);
+    uint64_t coded = 0;
+    for (int code = IOTCTRL_METRICS_MIN_CODE; code <= IOTCTRL_METRICS_MAX_CODE;
+         ++code) {
+      const uint64_t n = m.error_counts[code - IOTCTRL_METRICS_MIN_CODE];
+      if (n == 0)
+        continue;
+      coded += n;
+      append(out, "iotctrl_errors_total{");
+      append_labels(out, &s[i]);
+      append(out, ",code=\"%d\"} %llu\n", code, (unsigned long long)n);
+    }
+    if (m.error_count > coded) {
+      append(out, "iotctrl_errors_total{");
+      append_labels(out, &s[i]);
+      append(out, ",code=\"other\"} %llu\n",
+             (unsigned long long)(m.error_count - coded));
+    }
+  }
+}
+
+static void append_histogram(struct output *out,
+                             const struct iotctrl_metrics_source *s,
+                             size_t count) {
+  static const char name[] = "iotctrl_operation_duration_seconds";
+  append_header(out, name, "histogram", "Latency of bus operations.");
+  for (size_t i = 0; i < count; ++i) {
+    struct iotctrl_metrics m;
+    iotctrl_metrics_read(s[i].metrics, &m);
+    // Prometheus buckets are cumulative, _count is derived from them so that
+    // the +Inf bucket and _count always agree
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b < IOTCTRL_METRICS_BUCKET_COUNT; ++b) {
+      cumulative += m.latency_buckets[b];
+      append(out, "%s_bucket{", name);
+      append_labels(out, &s[i]);
+      if (b < IOTCTRL_METRICS_BUCKET_COUNT - 1)
+        append(out, ",le=\"%g\"} %llu\n",
+               iotctrl_metrics_bucket_bound_ns(b) / 1e9,
+               (unsigned long long)cumulative);
+      else
+        append(out, ",le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    }
+    append(out, "%s_sum{", name);
+    append_labels(out, &s[i]);
+    append(out, "} %.9f\n", m.latency_sum_ns / 1e9);
+    append(out, "%s_count{", name);
+    append_labels(out, &s[i]);
+    append(out, "} %llu\n", (unsigned long long)cumulative);
+  }
+}
+
+size_t iotctrl_metrics_render_prometheus(
+    const struct iotctrl_metrics_source *sources, size_t source_count,
+    char *buf, size_t size) {
+  struct iotctrl_metrics_source globals[IOTCTRL_METRICS_OP_COUNT];
+  if (sources == NULL) {
+    for (int op = 0; op < IOTCTRL_METRICS_OP_COUNT; ++op)
+      globals[op] = (struct iotctrl_metrics_source){op, NULL,
+                                                    &global_metrics[op]};
+    sources = globals;
+    source_count = IOTCTRL_METRICS_OP_COUNT;
+  }
+  struct output out = {buf, size, 0};
+  if (size > 0)
+    buf[0] = '\0';
+  // Samples of a metric family have to be grouped together, so every family
+  // takes one pass over the sources
+  append_counter(&out, COUNTER_OPERATIONS, sources, source_count);
+  append_errors(&out, sources, source_count);
+  append_counter(&out, COUNTER_CRC_ERRORS, sources, source_count);
+  append_counter(&out, COUNTER_RETRIES, sources, source_count);
+  append_histogram(&out, sources, source_count);
+  return out.len;
+}
@@ -0,0 +1,136 @@
+#ifndef LIBIOTCTRL_METRICS_H
+#define LIBIOTCTRL_METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Runtime metrics of bus transactions. Every handle keeps its own counters
+// and every record also goes to a process-wide set per operation, so that
+// one-off calls such as iotctrl_get_temperature() are accounted for, too.
+// Counters are only updated with relaxed atomic adds, recording never takes
+// a lock and readers never block the devices.
+
+enum iotctrl_metrics_op {
+  // A DL11-MC request/response, iotctrl_temp_sensor_read() and the poller
+  IOTCTRL_METRICS_DL11_READ = 0,
+  // An SHT31 measurement, iotctrl_dht31_measure()/_bus_measure() and the
+  // poller
+  IOTCTRL_METRICS_SHT31_MEASURE,
+  // A write() of relay command frames
+  IOTCTRL_METRICS_RELAY_WRITE,
+  // Setting the buzzer's GPIO line
+  IOTCTRL_METRICS_BUZZER_SET,
+  // One refresh pass of a 7-segment display, i.e., shifting out and latching
+  // every step of a frame. The latency is the time spent on the transport,
+  // sleeps between steps are not included.
+  IOTCTRL_METRICS_7SEG_REFRESH,
+  IOTCTRL_METRICS_OP_COUNT
+};
+
+// Error codes in [MIN_CODE, MAX_CODE] are counted one by one, others only
+// add to error_count
+#define IOTCTRL_METRICS_MIN_CODE -16
+#define IOTCTRL_METRICS_MAX_CODE 16
+#define IOTCTRL_METRICS_CODE_COUNT                                             \
+  (IOTCTRL_METRICS_MAX_CODE - IOTCTRL_METRICS_MIN_CODE + 1)
+// Latency bucket i counts operations that took at most 2^i microseconds and
+// longer than the bucket before it, the last bucket has no upper bound. I.e.,
+// 1us, 2us, 4us, ..., ~4.2s, +Inf.
+#define IOTCTRL_METRICS_BUCKET_COUNT 24
+
+struct iotctrl_metrics {
+  uint64_t operation_count;
+  // Operations that returned non-zero
+  uint64_t error_count;
+  // error_counts[code - IOTCTRL_METRICS_MIN_CODE]
+  uint64_t error_counts[IOTCTRL_METRICS_CODE_COUNT];
+  // Frames that arrived but failed their CRC check. Such operations are
+  // counted as errors, too.
+  uint64_t crc_error_count;
+  // Transactions issued again after a failure, e.g., reconnecting a tty or
+  // querying sensors one by one after a combined transfer was NACKed
+  uint64_t retry_count;
+  // Not cumulative, see IOTCTRL_METRICS_BUCKET_COUNT
+  uint64_t latency_buckets[IOTCTRL_METRICS_BUCKET_COUNT];
+  uint64_t latency_sum_ns;
+};
+
+/**
+ * @brief Account for one finished operation
+ * @param m per-handle metrics or NULL to only update the global ones
+ * @param result 0 on success or the error code returned to the caller
+ * @param latency_ns how long the operation took
+ */
+void iotctrl_metrics_record(struct iotctrl_metrics *m,
+                            enum iotctrl_metrics_op op, int result,
+                            uint64_t latency_ns);
+
+/**
+ * @brief Account for a CRC mismatch, see iotctrl_metrics_record() for m
+ */
+void iotctrl_metrics_add_crc_error(struct iotctrl_metrics *m,
+                                   enum iotctrl_metrics_op op);
+
+/**
+ * @brief Account for a retried transaction, see iotctrl_metrics_record() for m
+ */
+void iotctrl_metrics_add_retry(struct iotctrl_metrics *m,
+                               enum iotctrl_metrics_op op);
+
+/**
+ * @brief Copy metrics while they may be being recorded. Each counter is read
+ * atomically, but counters are not read at one instant, e.g., operation_count
+ * may be ahead of the latency buckets.
+ */
+void iotctrl_metrics_read(const struct iotctrl_metrics *m,
+                          struct iotctrl_metrics *snapshot);
+
+/**
+ * @brief The process-wide metrics of op, they live as long as the process
+ */
+const struct iotctrl_metrics *
+iotctrl_metrics_global(enum iotctrl_metrics_op op);
+
+/**
+ * @brief Name of op as used in the "op" label, e.g., "dl11_read"
+ */
+const char *iotctrl_metrics_op_name(enum iotctrl_metrics_op op);
+
+/**
+ * @brief Upper bound of a latency bucket in nanoseconds, UINT64_MAX for the
+ * last one
+ */
+uint64_t iotctrl_metrics_bucket_bound_ns(size_t bucket);
+
+// One set of metrics to be rendered
+struct iotctrl_metrics_source {
+  enum iotctrl_metrics_op op;
+  // Value of the "device" label, e.g., "/dev/ttyUSB0". NULL omits the label.
+  const char *device;
+  const struct iotctrl_metrics *metrics;
+};
+
+/**
+ * @brief Render metrics in the Prometheus text exposition format (version
+ * 0.0.4), i.e., the iotctrl_operations_total, iotctrl_errors_total,
+ * iotctrl_crc_errors_total and iotctrl_retries_total counters and the
+ * iotctrl_operation_duration_seconds histogram, labelled by op and device
+ * @param sources metrics to render, NULL renders the global metrics of every
+ * op and source_count is ignored
+ * @param buf the output, it is always NUL-terminated if size > 0
+ * @returns the length of the complete output like snprintf(), i.e., the
+ * output is truncated if the return value is size or more
+ */
+size_t iotctrl_metrics_render_prometheus(
+    const struct iotctrl_metrics_source *sources, size_t source_count,
+    char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBIOTCTRL_METRICS_H
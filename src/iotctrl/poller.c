@@ -0,0 +1,555 @@
+#include "poller.h"
+#include "crc.h"
+#include "dht31.h"
+#include "temp-sensor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+// Same as libmodbus' default response timeout
+#define DL11_RESPONSE_TIMEOUT_NS 500000000ULL
+#define DL11_SLAVE_ADDR 0x01
+
+enum device_state {
+  STATE_IDLE = 0,
+  // DL11-MC: request sent, collecting the response
+  STATE_AWAITING_RESPONSE,
+  // SHT31: measurement triggered, waiting for the conversion
+  STATE_CONVERTING,
+};
+
+enum source_kind {
+  // The device's sampling period has started
+  SOURCE_PERIOD = 0,
+  // A response timeout or conversion wait has elapsed
+  SOURCE_STEP,
+  // The device's fd is readable
+  SOURCE_IO,
+};
+
+struct device;
+
+// What epoll_event.data.ptr points to, a NULL pointer stands for the stop
+// eventfd
+struct source {
+  struct device *dev;
+  enum source_kind kind;
+};
+
+struct device {
+  int id;
+  int epoll_fd;
+  enum iotctrl_poller_device_type type;
+  iotctrl_poller_callback cb;
+  void *user_data;
+  enum device_state state;
+  // Absolute, periodic timerfd, so the schedule never drifts no matter how
+  // long a transaction takes
+  int period_fd;
+  // One-shot timerfd for timeouts and conversion waits
+  int step_fd;
+  struct source src_period;
+  struct source src_step;
+  struct source src_io;
+  uint64_t scheduled_ns;
+  // Number of periods skipped because the previous transaction was still in
+  // flight
+  uint64_t overrun_count;
+  // Completed transactions, their latency counts from the start of the
+  // period. CRC failures of SHT31 results are accounted to the dht31 handle.
+  struct iotctrl_metrics metrics;
+
+  // IOTCTRL_POLLER_DL11_MC
+  char *sensor_path;
+  // -1 after the tty failed, the next request reopens it
+  int tty_fd;
+  uint8_t sensor_count;
+  uint8_t rsp[5 + IOTCTRL_POLLER_DL11_MAX_SENSORS * 2];
+  size_t rsp_len;
+  // IOTCTRL_POLLER_SHT31
+  struct iotctrl_dht31_handle *sht31;
+};
+
+struct iotctrl_poller {
+  int epoll_fd;
+  int stop_fd;
+  pthread_t th_poller;
+  // Protects devices/device_count, which are only used to release devices.
+  // The poller thread reaches devices through epoll.
+  pthread_mutex_t mutex;
+  struct device **devices;
+  size_t device_count;
+};
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void ns_to_timespec(uint64_t ns, struct timespec *ts) {
+  ts->tv_sec = ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static int arm_step(struct device *d, uint64_t delay_ns) {
+  struct itimerspec its = {0};
+  // A zero it_value disarms the timer, so round up to 1ns
+  ns_to_timespec(delay_ns > 0 ? delay_ns : 1, &its.it_value);
+  return timerfd_settime(d->step_fd, 0, &its, NULL);
+}
+
+static void disarm_step(struct device *d) {
+  const struct itimerspec its = {0};
+  (void)timerfd_settime(d->step_fd, 0, &its, NULL);
+}
+
+static void complete(struct device *d, struct iotctrl_poller_reading *r,
+                     int result) {
+  d->state = STATE_IDLE;
+  r->device_id = d->id;
+  r->type = d->type;
+  r->result = result;
+  r->scheduled_ns = d->scheduled_ns;
+  r->completed_ns = monotonic_ns();
+  r->overrun_count = d->overrun_count;
+  iotctrl_metrics_record(&d->metrics,
+                         d->type == IOTCTRL_POLLER_DL11_MC
+                             ? IOTCTRL_METRICS_DL11_READ
+                             : IOTCTRL_METRICS_SHT31_MEASURE,
+                         result, r->completed_ns - r->scheduled_ns);
+  d->cb(r, d->user_data);
+}
+
+static int open_tty(const char *path) {
+  const int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open(%s): %d(%s)\n", path, errno,
+            strerror(errno));
+    return -1;
+  }
+  // 9600 8N1, same as iotctrl_temp_sensor_open()
+  struct termios tio;
+  if (tcgetattr(fd, &tio) != 0) {
+    fprintf(stderr, "tcgetattr(%s) failed: %d(%s)\n", path, errno,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  if (cfsetispeed(&tio, B9600) != 0 || cfsetospeed(&tio, B9600) != 0 ||
+      tcsetattr(fd, TCSANOW, &tio) != 0) {
+    fprintf(stderr, "tcsetattr(%s) failed: %d(%s)\n", path, errno,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  // The device only talks when asked to, anything already in the input
+  // queue is stale
+  (void)tcflush(fd, TCIFLUSH);
+  return fd;
+}
+
+// Like iotctrl_temp_sensor_read(), a tty that failed is reopened lazily, so
+// the device recovers once, e.g., the USB adapter is plugged in again
+static int dl11_reopen_if_needed(struct device *d) {
+  if (d->tty_fd >= 0)
+    return 0;
+  iotctrl_metrics_add_retry(&d->metrics, IOTCTRL_METRICS_DL11_READ);
+  d->tty_fd = open_tty(d->sensor_path);
+  if (d->tty_fd < 0)
+    return -1;
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &d->src_io};
+  if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, d->tty_fd, &ev) != 0) {
+    perror("epoll_ctl()");
+    close(d->tty_fd);
+    d->tty_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void dl11_start(struct device *d) {
+  struct iotctrl_poller_reading r = {0};
+  r.dl11.sensor_count = d->sensor_count;
+  if (dl11_reopen_if_needed(d) != 0) {
+    complete(d, &r, -3);
+    return;
+  }
+  // Same request as iotctrl_temp_sensor_read(), see the comments there
+  uint8_t req[8] = {DL11_SLAVE_ADDR, 0x04, 0x04, 0x00, 0x00, d->sensor_count};
+  const uint16_t crc = iotctrl_crc16_modbus(req, 6);
+  req[6] = crc & 0xFF;
+  req[7] = crc >> 8;
+  // Drop whatever a previous, timed out, response left behind
+  (void)tcflush(d->tty_fd, TCIFLUSH);
+  d->rsp_len = 0;
+  if (write(d->tty_fd, req, sizeof(req)) != sizeof(req) ||
+      arm_step(d, DL11_RESPONSE_TIMEOUT_NS) != 0) {
+    complete(d, &r, -3);
+    return;
+  }
+  d->state = STATE_AWAITING_RESPONSE;
+}
+
+static void dl11_parse(struct device *d) {
+  struct iotctrl_poller_reading r = {0};
+  const uint8_t count = d->sensor_count;
+  r.dl11.sensor_count = count;
+  if (d->rsp[0] != DL11_SLAVE_ADDR || d->rsp[1] != 0x04 ||
+      d->rsp[2] != count * 2) {
+    complete(d, &r, -7);
+    return;
+  }
+  const uint16_t calculated_crc = iotctrl_crc16_modbus(d->rsp, 3 + count * 2);
+  const uint16_t expected_crc =
+      (d->rsp[4 + count * 2] << 8) + d->rsp[3 + count * 2];
+  if (calculated_crc != expected_crc) {
+    iotctrl_metrics_add_crc_error(&d->metrics, IOTCTRL_METRICS_DL11_READ);
+    complete(d, &r, -5);
+    return;
+  }
+  int result = 0;
+  for (uint8_t i = 0; i < count; ++i) {
+    r.dl11.readings[i] = (d->rsp[3 + i * 2] << 8) + d->rsp[4 + i * 2];
+    if (r.dl11.readings[i] == IOTCTRL_INVALID_TEMP)
+      result = -6;
+  }
+  complete(d, &r, result);
+}
+
+static void dl11_on_readable(struct device *d) {
+  uint8_t buf[64];
+  ssize_t n;
+  while (true) {
+    n = read(d->tty_fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      break;
+    if (n <= 0) {
+      // E.g., the USB adapter is unplugged. The fd would be reported
+      // readable forever, so it is closed and the next request reopens it, a
+      // pending one times out.
+      if (n == 0)
+        fprintf(stderr, "DL11-MC device %d hung up\n", d->id);
+      else
+        fprintf(stderr, "read() from DL11-MC device %d failed: %d(%s)\n",
+                d->id, errno, strerror(errno));
+      (void)epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, d->tty_fd, NULL);
+      close(d->tty_fd);
+      d->tty_fd = -1;
+      break;
+    }
+    if (d->state != STATE_AWAITING_RESPONSE)
+      continue;
+    const size_t expected = 5 + d->sensor_count * 2;
+    const size_t take =
+        (size_t)n < expected - d->rsp_len ? (size_t)n : expected - d->rsp_len;
+    memcpy(d->rsp + d->rsp_len, buf, take);
+    d->rsp_len += take;
+    // A Modbus exception response is 5 bytes long and has the highest bit of
+    // the function code set
+    const bool exception = d->rsp_len >= 5 && (d->rsp[1] & 0x80);
+    if (d->rsp_len == expected || exception) {
+      disarm_step(d);
+      if (exception) {
+        struct iotctrl_poller_reading r = {0};
+        r.dl11.sensor_count = d->sensor_count;
+        complete(d, &r, -7);
+      } else {
+        dl11_parse(d);
+      }
+    }
+  }
+}
+
+static void sht31_start(struct device *d) {
+  struct iotctrl_poller_reading r = {0};
+  unsigned int wait_us;
+  if (iotctrl_dht31_trigger(d->sht31, &wait_us) != 0 ||
+      arm_step(d, wait_us * 1000ULL) != 0) {
+    complete(d, &r, -1);
+    return;
+  }
+  d->state = STATE_CONVERTING;
+}
+
+static void on_period(struct device *d) {
+  uint64_t expirations;
+  if (read(d->period_fd, &expirations, sizeof(expirations)) !=
+      sizeof(expirations))
+    return;
+  if (d->state != STATE_IDLE) {
+    d->overrun_count += expirations;
+    return;
+  }
+  // Missed periods are skipped rather than sampled in a burst
+  d->overrun_count += expirations - 1;
+  d->scheduled_ns = monotonic_ns();
+  if (d->type == IOTCTRL_POLLER_DL11_MC)
+    dl11_start(d);
+  else
+    sht31_start(d);
+}
+
+static void on_step(struct device *d) {
+  uint64_t expirations;
+  if (read(d->step_fd, &expirations, sizeof(expirations)) !=
+      sizeof(expirations))
+    return;
+  struct iotctrl_poller_reading r = {0};
+  if (d->state == STATE_AWAITING_RESPONSE) {
+    r.dl11.sensor_count = d->sensor_count;
+    complete(d, &r, -4);
+  } else if (d->state == STATE_CONVERTING) {
+    const int result = iotctrl_dht31_fetch(
+        d->sht31, &r.sht31.temp_celsius, &r.sht31.relative_humidity);
+    complete(d, &r, result);
+  }
+}
+
+static void *poller_thread(void *arg) {
+  struct iotctrl_poller *p = arg;
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    const int n = epoll_wait(p->epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "epoll_wait() failed: %d(%s)\n", errno, strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      const struct source *src = events[i].data.ptr;
+      if (src == NULL)
+        return NULL;
+      switch (src->kind) {
+      case SOURCE_PERIOD:
+        on_period(src->dev);
+        break;
+      case SOURCE_STEP:
+        on_step(src->dev);
+        break;
+      case SOURCE_IO:
+        dl11_on_readable(src->dev);
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+struct iotctrl_poller *iotctrl_poller_create(void) {
+  struct iotctrl_poller *p = calloc(1, sizeof(struct iotctrl_poller));
+  if (p == NULL) {
+    perror("calloc()");
+    return NULL;
+  }
+  p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (p->epoll_fd < 0) {
+    perror("epoll_create1()");
+    goto err_epoll_create;
+  }
+  p->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (p->stop_fd < 0) {
+    perror("eventfd()");
+    goto err_eventfd;
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, p->stop_fd, &ev) != 0) {
+    perror("epoll_ctl()");
+    goto err_epoll_ctl;
+  }
+  pthread_mutex_init(&p->mutex, NULL);
+  if (pthread_create(&p->th_poller, NULL, poller_thread, p) != 0) {
+    fprintf(stderr, "pthread_create() failed\n");
+    goto err_pthread_create;
+  }
+  return p;
+
+err_pthread_create:
+  pthread_mutex_destroy(&p->mutex);
+err_epoll_ctl:
+  close(p->stop_fd);
+err_eventfd:
+  close(p->epoll_fd);
+err_epoll_create:
+  free(p);
+  return NULL;
+}
+
+static void free_device(struct device *d) {
+  if (d->period_fd >= 0)
+    close(d->period_fd);
+  if (d->step_fd >= 0)
+    close(d->step_fd);
+  if (d->tty_fd >= 0)
+    close(d->tty_fd);
+  free(d->sensor_path);
+  iotctrl_dht31_close(d->sht31);
+  free(d);
+}
+
+static struct device *new_device(enum iotctrl_poller_device_type type,
+                                 iotctrl_poller_callback cb, void *user_data) {
+  struct device *d = calloc(1, sizeof(struct device));
+  if (d == NULL) {
+    perror("calloc()");
+    return NULL;
+  }
+  d->type = type;
+  d->cb = cb;
+  d->user_data = user_data;
+  d->tty_fd = -1;
+  d->period_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  d->step_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (d->period_fd < 0 || d->step_fd < 0) {
+    perror("timerfd_create()");
+    free_device(d);
+    return NULL;
+  }
+  d->src_period = (struct source){d, SOURCE_PERIOD};
+  d->src_step = (struct source){d, SOURCE_STEP};
+  d->src_io = (struct source){d, SOURCE_IO};
+  return d;
+}
+
+// Hand a fully initialized device over to the poller thread
+static int add_device(struct iotctrl_poller *p, struct device *d,
+                      uint32_t interval_ms) {
+  pthread_mutex_lock(&p->mutex);
+  struct device **devices =
+      realloc(p->devices, (p->device_count + 1) * sizeof(struct device *));
+  if (devices == NULL) {
+    perror("realloc()");
+    goto err_unlock;
+  }
+  p->devices = devices;
+  d->id = p->device_count;
+  d->epoll_fd = p->epoll_fd;
+
+  struct epoll_event ev = {.events = EPOLLIN};
+  ev.data.ptr = &d->src_step;
+  if (epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, d->step_fd, &ev) != 0)
+    goto err_epoll_ctl;
+  if (d->tty_fd >= 0) {
+    ev.data.ptr = &d->src_io;
+    if (epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, d->tty_fd, &ev) != 0)
+      goto err_epoll_ctl;
+  }
+  ev.data.ptr = &d->src_period;
+  if (epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, d->period_fd, &ev) != 0)
+    goto err_epoll_ctl;
+  // The first sample is taken right away, the following ones on an absolute
+  // schedule
+  struct itimerspec its;
+  ns_to_timespec(monotonic_ns(), &its.it_value);
+  ns_to_timespec(interval_ms * 1000000ULL, &its.it_interval);
+  if (timerfd_settime(d->period_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+    goto err_epoll_ctl;
+
+  p->devices[p->device_count++] = d;
+  pthread_mutex_unlock(&p->mutex);
+  return d->id;
+
+err_epoll_ctl:
+  perror("epoll_ctl()/timerfd_settime()");
+  (void)epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, d->period_fd, NULL);
+  (void)epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, d->step_fd, NULL);
+  if (d->tty_fd >= 0)
+    (void)epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, d->tty_fd, NULL);
+err_unlock:
+  pthread_mutex_unlock(&p->mutex);
+  free_device(d);
+  return -1;
+}
+
+int iotctrl_poller_add_dl11(struct iotctrl_poller *p, const char *sensor_path,
+                            uint8_t sensor_count, uint32_t interval_ms,
+                            iotctrl_poller_callback cb, void *user_data) {
+  if (sensor_count < 1 || sensor_count > IOTCTRL_POLLER_DL11_MAX_SENSORS ||
+      interval_ms == 0) {
+    fprintf(stderr, "Invalid sensor_count (%u) or interval_ms (%u)\n",
+            sensor_count, interval_ms);
+    return -1;
+  }
+  struct device *d = new_device(IOTCTRL_POLLER_DL11_MC, cb, user_data);
+  if (d == NULL)
+    return -1;
+  d->sensor_count = sensor_count;
+  d->sensor_path = strdup(sensor_path);
+  if (d->sensor_path == NULL) {
+    perror("strdup()");
+    free_device(d);
+    return -1;
+  }
+  d->tty_fd = open_tty(sensor_path);
+  if (d->tty_fd < 0) {
+    free_device(d);
+    return -1;
+  }
+  return add_device(p, d, interval_ms);
+}
+
+int iotctrl_poller_add_sht31(struct iotctrl_poller *p, const char *device_path,
+                             uint8_t addr, uint32_t interval_ms,
+                             iotctrl_poller_callback cb, void *user_data) {
+  if (interval_ms == 0) {
+    fprintf(stderr, "Invalid interval_ms (%u)\n", interval_ms);
+    return -1;
+  }
+  struct device *d = new_device(IOTCTRL_POLLER_SHT31, cb, user_data);
+  if (d == NULL)
+    return -1;
+  d->sht31 = iotctrl_dht31_open(device_path, addr);
+  if (d->sht31 == NULL) {
+    free_device(d);
+    return -1;
+  }
+  return add_device(p, d, interval_ms);
+}
+
+int iotctrl_poller_read_metrics(struct iotctrl_poller *p, int device_id,
+                                struct iotctrl_metrics *snapshot) {
+  pthread_mutex_lock(&p->mutex);
+  if (device_id < 0 || (size_t)device_id >= p->device_count) {
+    pthread_mutex_unlock(&p->mutex);
+    return -1;
+  }
+  const struct device *d = p->devices[device_id];
+  iotctrl_metrics_read(&d->metrics, snapshot);
+  if (d->sht31 != NULL)
+    snapshot->crc_error_count += __atomic_load_n(
+        &iotctrl_dht31_get_metrics(d->sht31)->crc_error_count,
+        __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+void iotctrl_poller_destroy(struct iotctrl_poller *p) {
+  if (p == NULL)
+    return;
+  const uint64_t one = 1;
+  if (write(p->stop_fd, &one, sizeof(one)) != sizeof(one))
+    perror("write()");
+  pthread_join(p->th_poller, NULL);
+  for (size_t i = 0; i < p->device_count; ++i)
+    free_device(p->devices[i]);
+  free(p->devices);
+  pthread_mutex_destroy(&p->mutex);
+  close(p->stop_fd);
+  close(p->epoll_fd);
+  free(p);
+}
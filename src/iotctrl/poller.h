@@ -0,0 +1,106 @@
+#ifndef LIBIOTCTRL_POLLER_H
+#define LIBIOTCTRL_POLLER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+// A poller samples many devices from a single library-owned thread. Every
+// device has its own sampling interval and runs a non-blocking
+// request/response state machine driven by one epoll loop, so waiting for a
+// slow device (e.g., a DL11-MC answering at 9600 baud or an SHT31
+// converting) never delays another one.
+struct iotctrl_poller;
+
+#define IOTCTRL_POLLER_DL11_MAX_SENSORS 8
+
+enum iotctrl_poller_device_type {
+  IOTCTRL_POLLER_DL11_MC = 0,
+  IOTCTRL_POLLER_SHT31,
+};
+
+struct iotctrl_poller_reading {
+  // As returned by iotctrl_poller_add_*()
+  int device_id;
+  enum iotctrl_poller_device_type type;
+  // 0 on success or the error code the blocking API would have returned,
+  // i.e., same as iotctrl_get_temperature() or iotctrl_dht31_measure()
+  int result;
+  // CLOCK_MONOTONIC time at which the sampling period started
+  uint64_t scheduled_ns;
+  // CLOCK_MONOTONIC time at which the response was complete
+  uint64_t completed_ns;
+  // Number of sampling periods skipped so far because the device was still
+  // busy with the previous one
+  uint64_t overrun_count;
+  union {
+    struct {
+      uint8_t sensor_count;
+      // Same as the readings of iotctrl_get_temperature()
+      int16_t readings[IOTCTRL_POLLER_DL11_MAX_SENSORS];
+    } dl11;
+    struct {
+      float temp_celsius;
+      float relative_humidity;
+    } sht31;
+  };
+};
+
+// Called on the poller's thread after every sampling attempt. It should
+// return quickly as it delays all devices of the poller.
+typedef void (*iotctrl_poller_callback)(
+    const struct iotctrl_poller_reading *reading, void *user_data);
+
+/**
+ * @brief Create a poller and start its thread
+ * @returns a poller on success or NULL on error
+ */
+struct iotctrl_poller *iotctrl_poller_create(void);
+
+/**
+ * @brief Sample a DL11-MC device every interval_ms. It can be called while
+ * the poller is running.
+ * @param sensor_path tty of the device, typically "/dev/ttyUSB0"
+ * @param sensor_count number of sensors, typically 1 or 2
+ * @returns a non-negative device id on success or -1 on error
+ */
+int iotctrl_poller_add_dl11(struct iotctrl_poller *p, const char *sensor_path,
+                            uint8_t sensor_count, uint32_t interval_ms,
+                            iotctrl_poller_callback cb, void *user_data);
+
+/**
+ * @brief Sample an SHT31 sensor every interval_ms with single shot, high
+ * repeatability measurements. It can be called while the poller is running.
+ * @param device_path I2C bus of the sensor, typically "/dev/i2c-1"
+ * @param addr I2C address of the sensor, 0x44 or 0x45
+ * @returns a non-negative device id on success or -1 on error
+ */
+int iotctrl_poller_add_sht31(struct iotctrl_poller *p, const char *device_path,
+                             uint8_t addr, uint32_t interval_ms,
+                             iotctrl_poller_callback cb, void *user_data);
+
+/**
+ * @brief Copy the metrics of a device, one operation per reading delivered to
+ * the callback, timed from the start of its period
+ * @param device_id as returned by iotctrl_poller_add_*()
+ * @returns 0 on success or -1 if there is no such device
+ */
+int iotctrl_poller_read_metrics(struct iotctrl_poller *p, int device_id,
+                                struct iotctrl_metrics *snapshot);
+
+/**
+ * @brief Stop the thread and release all devices. No callback is invoked
+ * after it returns.
+ */
+void iotctrl_poller_destroy(struct iotctrl_poller *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBIOTCTRL_POLLER_H
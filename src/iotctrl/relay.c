@@ -1,35 +1,285 @@
 #include "relay.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
 
-int iotctrl_control_relay(const char *relay_path, bool turn_on) {
-  FILE *fptr;
+struct iotctrl_relay_handle {
+  int fd;
+  struct iotctrl_metrics metrics;
+};
 
-  if ((fptr = fopen(relay_path, "r"))) {
-    fclose(fptr);
-  } else {
-    fprintf(stderr, "Failed to open the relay device at %s\n.", relay_path);
-    return 1;
-  }
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-  fptr = fopen(relay_path, "wb");
-  if (fptr == NULL) {
-    fprintf(stderr, "Failed to open the relay device at %s\n.", relay_path);
-    return 2;
+struct iotctrl_relay_handle *iotctrl_relay_open(const char *relay_path) {
+  struct iotctrl_relay_handle *h =
+      calloc(1, sizeof(struct iotctrl_relay_handle));
+  if (h == NULL) {
+    perror("calloc()");
+    return NULL;
   }
-  uint8_t off_command[] = {0xA0, 0x01, 0x00, 0xA1};
-  uint8_t on_command[] = {0xA0, 0x01, 0x01, 0xA2};
-  size_t result =
-      fwrite(turn_on ? on_command : off_command, sizeof(uint8_t), 4, fptr);
-  if (result != 4) {
+  // O_NOCTTY: the relay must never become our controlling terminal
+  h->fd = open(relay_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (h->fd < 0) {
+    fprintf(stderr, "Failed to open the relay device at %s: %d(%s)\n",
+            relay_path, errno, strerror(errno));
+    free(h);
+    return NULL;
+  }
+  // LCUS-1 boards talk 9600 8N1. Raw mode stops the line discipline from
+  // translating bytes of the command frames, e.g., 0x0A to 0x0D 0x0A. Plain
+  // files and pipes are accepted as is, which is handy for testing.
+  if (isatty(h->fd)) {
+    struct termios tio;
+    if (tcgetattr(h->fd, &tio) != 0) {
+      fprintf(stderr, "tcgetattr(%s) failed: %d(%s)\n", relay_path, errno,
+              strerror(errno));
+      goto err_termios;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    if (cfsetispeed(&tio, B9600) != 0 || cfsetospeed(&tio, B9600) != 0 ||
+        tcsetattr(h->fd, TCSANOW, &tio) != 0) {
+      fprintf(stderr, "tcsetattr(%s) failed: %d(%s)\n", relay_path, errno,
+              strerror(errno));
+      goto err_termios;
+    }
+  }
+  return h;
+
+err_termios:
+  close(h->fd);
+  free(h);
+  return NULL;
+}
+
+// clang-format off
+// An LCUS command frame:
+// 1 byte: start of frame, always 0xA0
+// 1 byte: channel, starting from 1
+// 1 byte: state, 0x00 is off and 0x01 is on
+// 1 byte: checksum, the sum of the first 3 bytes modulo 256
+// clang-format on
+static void compile_frame(uint8_t *frame, const uint8_t channel,
+                          const bool turn_on) {
+  frame[0] = 0xA0;
+  frame[1] = channel;
+  frame[2] = turn_on ? 0x01 : 0x00;
+  frame[3] = frame[0] + frame[1] + frame[2];
+}
+
+static int write_frames(struct iotctrl_relay_handle *h, const uint8_t *frames,
+                        const size_t len) {
+  const uint64_t start_ns = monotonic_ns();
+  ssize_t result;
+  do {
+    result = write(h->fd, frames, len);
+  } while (result < 0 && errno == EINTR);
+  const int ret = result == (ssize_t)len ? 0 : 3;
+  iotctrl_metrics_record(&h->metrics, IOTCTRL_METRICS_RELAY_WRITE, ret,
+                         monotonic_ns() - start_ns);
+  if (ret != 0)
     fprintf(stderr,
-            "Failed to send command to relay, %lu bytes, instead of 4 bytes, "
+            "Failed to send command to relay, %zd bytes, instead of %zu bytes, "
             "are written.\n",
-            result);
-    return 3;
+            result, len);
+  return ret;
+}
+
+int iotctrl_relay_set_channel(struct iotctrl_relay_handle *h,
+                              const uint8_t channel, const bool turn_on) {
+  if (channel < 1 || channel > IOTCTRL_RELAY_MAX_CHANNELS) {
+    fprintf(stderr, "Invalid relay channel %u\n", channel);
+    return 4;
+  }
+  uint8_t frame[IOTCTRL_RELAY_FRAME_LEN];
+  compile_frame(frame, channel, turn_on);
+  return write_frames(h, frame, sizeof(frame));
+}
+
+int iotctrl_relay_set_mask(struct iotctrl_relay_handle *h,
+                           const uint8_t channel_count, const uint8_t mask) {
+  if (channel_count < 1 || channel_count > IOTCTRL_RELAY_MAX_CHANNELS) {
+    fprintf(stderr, "Invalid relay channel count %u\n", channel_count);
+    return 4;
+  }
+  // All frames are sent back to back in one write() so that the channels
+  // switch together and it costs one syscall no matter how many there are
+  uint8_t frames[IOTCTRL_RELAY_MAX_CHANNELS * IOTCTRL_RELAY_FRAME_LEN];
+  for (uint8_t i = 0; i < channel_count; ++i)
+    compile_frame(frames + i * IOTCTRL_RELAY_FRAME_LEN, i + 1,
+                  (mask >> i) & 1);
+  return write_frames(h, frames, channel_count * IOTCTRL_RELAY_FRAME_LEN);
+}
+
+int iotctrl_relay_set(struct iotctrl_relay_handle *h, bool turn_on) {
+  return iotctrl_relay_set_channel(h, 1, turn_on);
+}
+
+const struct iotctrl_metrics *
+iotctrl_relay_get_metrics(const struct iotctrl_relay_handle *h) {
+  return &h->metrics;
+}
+
+void iotctrl_relay_close(struct iotctrl_relay_handle *h) {
+  if (h == NULL)
+    return;
+  close(h->fd);
+  free(h);
+}
+
+int iotctrl_control_relay(const char *relay_path, bool turn_on) {
+  struct iotctrl_relay_handle *h = iotctrl_relay_open(relay_path);
+  if (h == NULL)
+    return 1;
+  const int ret = iotctrl_relay_set(h, turn_on);
+  iotctrl_relay_close(h);
+  return ret;
+}
+
+struct cached_channel {
+  // Whether the relay is known to be in `commanded` state, it is not until the
+  // first successful command
+  bool known;
+  bool commanded;
+  // A state requested within the coalescing window, to be sent when it ends
+  bool pending;
+  bool pending_state;
+  uint64_t window_end_ns;
+};
+
+struct iotctrl_relay_cache {
+  struct iotctrl_relay_handle *relay;
+  uint8_t channel_count;
+  uint64_t window_ns;
+  struct cached_channel channels[IOTCTRL_RELAY_MAX_CHANNELS];
+  struct iotctrl_relay_cache_stats stats;
+};
+
+struct iotctrl_relay_cache *
+iotctrl_relay_cache_create(struct iotctrl_relay_handle *relay,
+                           const uint8_t channel_count,
+                           const uint32_t coalesce_window_ms) {
+  if (channel_count < 1 || channel_count > IOTCTRL_RELAY_MAX_CHANNELS) {
+    fprintf(stderr, "Invalid relay channel count %u\n", channel_count);
+    return NULL;
+  }
+  struct iotctrl_relay_cache *c = calloc(1, sizeof(struct iotctrl_relay_cache));
+  if (c == NULL) {
+    perror("calloc()");
+    return NULL;
   }
+  c->relay = relay;
+  c->channel_count = channel_count;
+  c->window_ns = coalesce_window_ms * 1000000ULL;
+  return c;
+}
 
-  fclose(fptr);
+static int send_state(struct iotctrl_relay_cache *c, const uint8_t channel,
+                      const bool turn_on, const uint64_t now_ns) {
+  struct cached_channel *ch = &c->channels[channel - 1];
+  const int ret = iotctrl_relay_set_channel(c->relay, channel, turn_on);
+  if (ret != 0) {
+    // The relay may or may not have switched, so the next command must go
+    // out no matter what
+    ch->known = false;
+    ch->pending = false;
+    ch->window_end_ns = 0;
+    return ret;
+  }
+  ++c->stats.sent;
+  ch->known = true;
+  ch->commanded = turn_on;
+  ch->pending = false;
+  ch->window_end_ns = now_ns + c->window_ns;
   return 0;
 }
+
+static int poll_channel(struct iotctrl_relay_cache *c, const uint8_t channel,
+                        const uint64_t now_ns) {
+  struct cached_channel *ch = &c->channels[channel - 1];
+  if (!ch->pending || now_ns < ch->window_end_ns)
+    return 0;
+  return send_state(c, channel, ch->pending_state, now_ns);
+}
+
+int iotctrl_relay_cache_set(struct iotctrl_relay_cache *c,
+                            const uint8_t channel, const bool turn_on) {
+  if (channel < 1 || channel > c->channel_count) {
+    fprintf(stderr, "Invalid relay channel %u\n", channel);
+    return 4;
+  }
+  ++c->stats.requested;
+  const uint64_t now_ns = monotonic_ns();
+  // If the expired pending state fails to go out, the channel is left in an
+  // unknown state without a window and the new request is sent below. It
+  // supersedes the pending state anyway.
+  (void)poll_channel(c, channel, now_ns);
+  struct cached_channel *ch = &c->channels[channel - 1];
+
+  if (now_ns < ch->window_end_ns) {
+    // Leading-edge coalescing: the first change of a burst went out right
+    // away, later ones are folded into one command at the end of the window
+    const bool latest = ch->pending ? ch->pending_state : ch->commanded;
+    if (turn_on == latest) {
+      ++c->stats.suppressed;
+      return 0;
+    }
+    ++c->stats.coalesced;
+    ch->pending = turn_on != ch->commanded;
+    ch->pending_state = turn_on;
+    return 0;
+  }
+  if (ch->known && turn_on == ch->commanded) {
+    ++c->stats.suppressed;
+    return 0;
+  }
+  return send_state(c, channel, turn_on, now_ns);
+}
+
+int iotctrl_relay_cache_poll(struct iotctrl_relay_cache *c) {
+  const uint64_t now_ns = monotonic_ns();
+  int ret = 0;
+  for (uint8_t i = 1; i <= c->channel_count; ++i) {
+    const int r = poll_channel(c, i, now_ns);
+    if (r != 0)
+      ret = r;
+  }
+  return ret;
+}
+
+int iotctrl_relay_cache_flush(struct iotctrl_relay_cache *c) {
+  const uint64_t now_ns = monotonic_ns();
+  int ret = 0;
+  for (uint8_t i = 1; i <= c->channel_count; ++i) {
+    struct cached_channel *ch = &c->channels[i - 1];
+    if (!ch->pending)
+      continue;
+    const int r = send_state(c, i, ch->pending_state, now_ns);
+    if (r != 0)
+      ret = r;
+  }
+  return ret;
+}
+
+void iotctrl_relay_cache_get_stats(const struct iotctrl_relay_cache *c,
+                                   struct iotctrl_relay_cache_stats *stats) {
+  *stats = c->stats;
+}
+
+void iotctrl_relay_cache_destroy(struct iotctrl_relay_cache *c) {
+  if (c == NULL)
+    return;
+  (void)iotctrl_relay_cache_flush(c);
+  free(c);
+}
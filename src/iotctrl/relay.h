@@ -2,13 +2,126 @@
 #define LIBIOTCTRL_RELAY_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+// LCUS boards come with 1, 2, 4 or 8 channels
+#define IOTCTRL_RELAY_MAX_CHANNELS 8
+#define IOTCTRL_RELAY_FRAME_LEN 4
+
+// Opaque handle that keeps the tty of an LCUS-1 relay open and configured
+struct iotctrl_relay_handle;
+
+/**
+ * @brief Open the relay's tty once, typically /dev/ttyUSB0, and configure it
+ * as a raw 9600 baud port
+ * @returns a handle on success or NULL on error
+ * */
+struct iotctrl_relay_handle *iotctrl_relay_open(const char *relay_path);
+
+/**
+ * @brief switch on/off channel 1 of the relay with a single write()
+ * @returns 0 on success or 3 if the command is not written in full
+ * */
+int iotctrl_relay_set(struct iotctrl_relay_handle *h, bool turn_on);
+
+/**
+ * @brief switch on/off one channel of a multi-channel relay board
+ * @param channel starting from 1
+ * @returns 0 on success, 3 if the command is not written in full or 4 if the
+ * channel is out of range
+ * */
+int iotctrl_relay_set_channel(struct iotctrl_relay_handle *h,
+                              const uint8_t channel, const bool turn_on);
+
+/**
+ * @brief Set channels 1 to channel_count at once, the commands of all
+ * channels are sent with a single write()
+ * @param mask bit n turns channel n + 1 on
+ * @returns same as iotctrl_relay_set_channel()
+ * */
+int iotctrl_relay_set_mask(struct iotctrl_relay_handle *h,
+                           const uint8_t channel_count, const uint8_t mask);
+
+/**
+ * @brief Metrics of the command writes, one operation per write(), valid
+ * until iotctrl_relay_close()
+ * */
+const struct iotctrl_metrics *
+iotctrl_relay_get_metrics(const struct iotctrl_relay_handle *h);
+
+void iotctrl_relay_close(struct iotctrl_relay_handle *h);
 
 /**
- * @brief switch on/off a relay by path
+ * @brief switch on/off a relay by path. It is a one-off iotctrl_relay_open(),
+ * iotctrl_relay_set() and iotctrl_relay_close().
  * @param relay_path the path of the relay
  * @param turn_on turn the relay on or off
- * @returns 0 means success or an error code will be returned.
+ * @returns 0 means success, 1 if the device cannot be opened or 3 if the
+ * command is not written in full.
  * */
 int iotctrl_control_relay(const char *relay_path, bool turn_on);
 
+// A relay handle wrapped with the last commanded state of each channel.
+// Commands that would not change a channel are dropped, and bursts of
+// toggles are coalesced: the first change after a quiet period is sent at
+// once and opens a window, changes within the window only update the
+// channel's pending state, which is sent when the window ends (if it differs
+// from what was last sent). A cache is not thread-safe.
+struct iotctrl_relay_cache;
+
+struct iotctrl_relay_cache_stats {
+  // Calls to iotctrl_relay_cache_set()
+  uint64_t requested;
+  // Commands actually written to the relay
+  uint64_t sent;
+  // Requests dropped because the channel is already in that state
+  uint64_t suppressed;
+  // Requests folded into the pending state of a coalescing window
+  uint64_t coalesced;
+};
+
+/**
+ * @brief Create a cache in front of an opened relay. The relay handle is not
+ * owned by the cache and must outlive it.
+ * @param coalesce_window_ms length of the coalescing window, 0 disables
+ * coalescing and only no-op commands are dropped
+ * @returns a cache on success or NULL on error
+ * */
+struct iotctrl_relay_cache *
+iotctrl_relay_cache_create(struct iotctrl_relay_handle *relay,
+                           const uint8_t channel_count,
+                           const uint32_t coalesce_window_ms);
+
+/**
+ * @brief Request a channel state, see struct iotctrl_relay_cache for when it
+ * is actually sent
+ * @returns same as iotctrl_relay_set_channel()
+ * */
+int iotctrl_relay_cache_set(struct iotctrl_relay_cache *c,
+                            const uint8_t channel, const bool turn_on);
+
+/**
+ * @brief Send pending states of channels whose window has ended. Call it
+ * periodically if iotctrl_relay_cache_set() may not be called again soon
+ * after a burst.
+ * @returns 0 on success or the error of the last failed command
+ * */
+int iotctrl_relay_cache_poll(struct iotctrl_relay_cache *c);
+
+/**
+ * @brief Send all pending states now, regardless of their windows
+ * @returns same as iotctrl_relay_cache_poll()
+ * */
+int iotctrl_relay_cache_flush(struct iotctrl_relay_cache *c);
+
+void iotctrl_relay_cache_get_stats(const struct iotctrl_relay_cache *c,
+                                   struct iotctrl_relay_cache_stats *stats);
+
+/**
+ * @brief Flush pending states and free the cache, the relay stays open
+ * */
+void iotctrl_relay_cache_destroy(struct iotctrl_relay_cache *c);
+
 #endif // LIBIOTCTRL_RELAY_H
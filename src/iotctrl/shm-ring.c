@@ -0,0 +1,227 @@
+#include "shm-ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEADER_SIZE 64
+#define SLOT_SIZE 64
+#define SAMPLE_WORDS (sizeof(struct iotctrl_shm_sample) / sizeof(uint64_t))
+
+struct slot {
+  uint64_t seq;
+  struct iotctrl_shm_sample sample;
+};
+
+_Static_assert(sizeof(struct iotctrl_shm_ring_header) <= HEADER_SIZE,
+               "header does not fit");
+_Static_assert(sizeof(struct slot) == SLOT_SIZE, "slot must be 64 bytes");
+
+struct iotctrl_shm_ring {
+  char name[NAME_MAX + 1];
+  void *base;
+  size_t size;
+  struct iotctrl_shm_ring_header *header;
+  struct slot *slots;
+  uint64_t mask;
+  // Serializes publishers of this process, readers never take it
+  pthread_mutex_t writer_mutex;
+};
+
+static struct iotctrl_shm_ring *map_ring(const char *name, int fd, size_t size,
+                                         int prot) {
+  struct iotctrl_shm_ring *r = calloc(1, sizeof(struct iotctrl_shm_ring));
+  if (r == NULL) {
+    perror("calloc()");
+    return NULL;
+  }
+  r->base = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (r->base == MAP_FAILED) {
+    fprintf(stderr, "mmap(%s) failed: %d(%s)\n", name, errno,
+            strerror(errno));
+    free(r);
+    return NULL;
+  }
+  strncpy(r->name, name, NAME_MAX);
+  r->size = size;
+  r->header = r->base;
+  r->slots = (struct slot *)((uint8_t *)r->base + HEADER_SIZE);
+  pthread_mutex_init(&r->writer_mutex, NULL);
+  return r;
+}
+
+struct iotctrl_shm_ring *iotctrl_shm_ring_create(const char *name,
+                                                 uint32_t slot_count) {
+  if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0) {
+    fprintf(stderr, "slot_count (%u) must be a power of 2\n", slot_count);
+    return NULL;
+  }
+  // A fresh object, readers still mapping a previous one keep their copy
+  (void)shm_unlink(name);
+  const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "shm_open(%s) failed: %d(%s)\n", name, errno,
+            strerror(errno));
+    return NULL;
+  }
+  const size_t size = HEADER_SIZE + (size_t)slot_count * SLOT_SIZE;
+  if (ftruncate(fd, size) != 0) {
+    fprintf(stderr, "ftruncate(%s) failed: %d(%s)\n", name, errno,
+            strerror(errno));
+    close(fd);
+    (void)shm_unlink(name);
+    return NULL;
+  }
+  struct iotctrl_shm_ring *r = map_ring(name, fd, size, PROT_READ | PROT_WRITE);
+  close(fd);
+  if (r == NULL) {
+    (void)shm_unlink(name);
+    return NULL;
+  }
+  r->mask = slot_count - 1;
+  // ftruncate() zero-fills, i.e., head and every sequence start at 0. The
+  // magic goes last so that readers never see a half-initialized header.
+  r->header->slot_count = slot_count;
+  __atomic_store_n(&r->header->magic, IOTCTRL_SHM_RING_MAGIC,
+                   __ATOMIC_RELEASE);
+  return r;
+}
+
+static void publish(struct iotctrl_shm_ring *r,
+                    const struct iotctrl_shm_sample *sample) {
+  pthread_mutex_lock(&r->writer_mutex);
+  const uint64_t index = r->header->head;
+  struct slot *s = &r->slots[index & r->mask];
+  // Per-slot seqlock: odd while the sample is being written
+  __atomic_store_n(&s->seq, index * 2 + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  // Copied word by word with atomic stores so that concurrent readers never
+  // race with plain stores, a torn copy is caught by the sequence check
+  const uint64_t *src = (const uint64_t *)sample;
+  uint64_t *dst = (uint64_t *)&s->sample;
+  for (size_t i = 0; i < SAMPLE_WORDS; ++i)
+    __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&s->seq, index * 2 + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->header->head, index + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&r->writer_mutex);
+}
+
+static uint64_t realtime_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int iotctrl_shm_ring_publish_temps(struct iotctrl_shm_ring *r,
+                                   int32_t source_id, const int16_t *readings,
+                                   uint8_t count) {
+  if (count > IOTCTRL_SHM_RING_MAX_READINGS) {
+    fprintf(stderr, "Too many readings (%u)\n", count);
+    return -1;
+  }
+  struct iotctrl_shm_sample sample = {0};
+  sample.timestamp_ns = realtime_ns();
+  sample.source_id = source_id;
+  sample.type = IOTCTRL_SHM_SAMPLE_TEMPS;
+  sample.count = count;
+  memcpy(sample.readings, readings, count * sizeof(int16_t));
+  publish(r, &sample);
+  return 0;
+}
+
+int iotctrl_shm_ring_publish_sht31(struct iotctrl_shm_ring *r,
+                                   int32_t source_id, float temp_celsius,
+                                   float relative_humidity) {
+  struct iotctrl_shm_sample sample = {0};
+  sample.timestamp_ns = realtime_ns();
+  sample.source_id = source_id;
+  sample.type = IOTCTRL_SHM_SAMPLE_SHT31;
+  sample.sht31.temp_celsius = temp_celsius;
+  sample.sht31.relative_humidity = relative_humidity;
+  publish(r, &sample);
+  return 0;
+}
+
+struct iotctrl_shm_ring *iotctrl_shm_ring_open(const char *name) {
+  const int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "shm_open(%s) failed: %d(%s)\n", name, errno,
+            strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+    fprintf(stderr, "%s is not an iotctrl ring\n", name);
+    close(fd);
+    return NULL;
+  }
+  struct iotctrl_shm_ring *r = map_ring(name, fd, st.st_size, PROT_READ);
+  close(fd);
+  if (r == NULL)
+    return NULL;
+  const uint32_t slot_count = r->header->slot_count;
+  if (__atomic_load_n(&r->header->magic, __ATOMIC_ACQUIRE) !=
+          IOTCTRL_SHM_RING_MAGIC ||
+      slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+      r->size < HEADER_SIZE + (size_t)slot_count * SLOT_SIZE) {
+    fprintf(stderr, "%s is not an iotctrl ring\n", name);
+    iotctrl_shm_ring_close(r, false);
+    return NULL;
+  }
+  r->mask = slot_count - 1;
+  return r;
+}
+
+uint64_t iotctrl_shm_ring_head(const struct iotctrl_shm_ring *r) {
+  return __atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE);
+}
+
+int iotctrl_shm_ring_read(const struct iotctrl_shm_ring *r, uint64_t index,
+                          struct iotctrl_shm_sample *sample) {
+  const struct slot *s = &r->slots[index & r->mask];
+  const uint64_t expected = index * 2 + 2;
+  const uint64_t seq_before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+  if (seq_before != expected)
+    return seq_before < expected ? -1 : -2;
+  const uint64_t *src = (const uint64_t *)&s->sample;
+  uint64_t *dst = (uint64_t *)sample;
+  for (size_t i = 0; i < SAMPLE_WORDS; ++i)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  // The publisher lapped us during the copy
+  if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != expected)
+    return -2;
+  return 0;
+}
+
+int iotctrl_shm_ring_read_latest(const struct iotctrl_shm_ring *r,
+                                 struct iotctrl_shm_sample *sample) {
+  int ret;
+  // Only fails if the publisher wraps around the whole ring while we copy
+  // one sample, in which case there is a newer one to try
+  do {
+    const uint64_t head = iotctrl_shm_ring_head(r);
+    if (head == 0)
+      return -1;
+    ret = iotctrl_shm_ring_read(r, head - 1, sample);
+  } while (ret != 0);
+  return 0;
+}
+
+void iotctrl_shm_ring_close(struct iotctrl_shm_ring *r, bool unlink) {
+  if (r == NULL)
+    return;
+  munmap(r->base, r->size);
+  if (unlink)
+    (void)shm_unlink(r->name);
+  pthread_mutex_destroy(&r->writer_mutex);
+  free(r);
+}
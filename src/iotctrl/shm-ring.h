@@ -0,0 +1,125 @@
+#ifndef LIBIOTCTRL_SHM_RING_H
+#define LIBIOTCTRL_SHM_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A POSIX shared-memory ring of timestamped readings. One process owns the
+// hardware and publishes readings, any number of processes map the ring
+// read-only and read the latest or historical samples without syscalls or
+// locks.
+//
+// Layout of the shared memory object, all fields are native-endian:
+// - struct iotctrl_shm_ring_header, padded to 64 bytes
+// - slot_count slots of 64 bytes each. A slot is a uint64_t sequence
+//   followed by a struct iotctrl_shm_sample. Sample n (counting from 0) lives
+//   in slot n % slot_count, its sequence is 2n + 1 while it is being written
+//   and 2n + 2 once it is complete. A reader copies the sample and checks the
+//   sequence before and after the copy, if either differs from 2n + 2 the
+//   sample is not published yet or has been overwritten.
+struct iotctrl_shm_ring;
+
+#define IOTCTRL_SHM_RING_MAGIC 0x49525231 // "IRR1"
+#define IOTCTRL_SHM_RING_MAX_READINGS 16
+
+enum iotctrl_shm_sample_type {
+  // int16_t temperature readings, e.g., from iotctrl_get_temperature()
+  IOTCTRL_SHM_SAMPLE_TEMPS = 1,
+  // A temperature/relative humidity pair from an SHT31
+  IOTCTRL_SHM_SAMPLE_SHT31 = 2,
+};
+
+struct iotctrl_shm_ring_header {
+  uint32_t magic;
+  uint32_t slot_count;
+  // Number of samples published so far, i.e., the index of the next sample
+  uint64_t head;
+};
+
+struct iotctrl_shm_sample {
+  // CLOCK_REALTIME, so that it is meaningful to other processes
+  uint64_t timestamp_ns;
+  // Chosen by the publisher, e.g., to tell devices apart
+  int32_t source_id;
+  uint16_t type;
+  // Number of valid elements of readings, IOTCTRL_SHM_SAMPLE_TEMPS only
+  uint16_t count;
+  union {
+    int16_t readings[IOTCTRL_SHM_RING_MAX_READINGS];
+    struct {
+      float temp_celsius;
+      float relative_humidity;
+    } sht31;
+  };
+  uint64_t reserved;
+};
+
+/**
+ * @brief Create (or re-create) a ring and map it read-write. Only one
+ * publisher may use a ring at a time, but it can be shared by the threads of
+ * that process.
+ * @param name shared memory object name as in shm_open(), e.g. "/iotctrl"
+ * @param slot_count capacity of the ring, a power of 2
+ * @returns a handle on success or NULL on error
+ */
+struct iotctrl_shm_ring *iotctrl_shm_ring_create(const char *name,
+                                                 uint32_t slot_count);
+
+/**
+ * @brief Publish up to IOTCTRL_SHM_RING_MAX_READINGS temperature readings
+ * @returns 0 on success or -1 on error
+ */
+int iotctrl_shm_ring_publish_temps(struct iotctrl_shm_ring *r,
+                                   int32_t source_id, const int16_t *readings,
+                                   uint8_t count);
+
+/**
+ * @brief Publish an SHT31 reading
+ * @returns 0 on success or -1 on error
+ */
+int iotctrl_shm_ring_publish_sht31(struct iotctrl_shm_ring *r,
+                                   int32_t source_id, float temp_celsius,
+                                   float relative_humidity);
+
+/**
+ * @brief Map an existing ring read-only
+ * @returns a handle on success or NULL on error
+ */
+struct iotctrl_shm_ring *iotctrl_shm_ring_open(const char *name);
+
+/**
+ * @brief Number of samples published so far
+ */
+uint64_t iotctrl_shm_ring_head(const struct iotctrl_shm_ring *r);
+
+/**
+ * @brief Copy sample `index` (counting from 0)
+ * @returns 0 on success, -1 if it is not published yet or -2 if it has been
+ * overwritten
+ */
+int iotctrl_shm_ring_read(const struct iotctrl_shm_ring *r, uint64_t index,
+                          struct iotctrl_shm_sample *sample);
+
+/**
+ * @brief Copy the most recent sample
+ * @returns 0 on success or -1 if nothing has been published yet
+ */
+int iotctrl_shm_ring_read_latest(const struct iotctrl_shm_ring *r,
+                                 struct iotctrl_shm_sample *sample);
+
+/**
+ * @brief Unmap the ring. The publisher may also remove the shared memory
+ * object, readers that have it mapped keep working.
+ */
+void iotctrl_shm_ring_close(struct iotctrl_shm_ring *r, bool unlink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBIOTCTRL_SHM_RING_H
@@ -0,0 +1,393 @@
+#include "sim.h"
+#include "crc.h"
+#include "transport.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SIM_GPIO_EVENT_CAPACITY 4096
+#define SIM_NAME_MAX 64
+
+#define SHT31_ADDR_A 0x44
+#define SHT31_ADDR_B 0x45
+
+struct sim_gpio_chip {
+  struct sim_gpio_chip *next;
+  char name[SIM_NAME_MAX];
+  // Protects everything below
+  pthread_mutex_t mutex;
+  struct iotctrl_sim_gpio_stats stats;
+  struct iotctrl_sim_gpio_event events[SIM_GPIO_EVENT_CAPACITY];
+  // Total number of events ever recorded, the ring holds the last
+  // SIM_GPIO_EVENT_CAPACITY of them
+  uint64_t event_count;
+};
+
+struct sim_sht31 {
+  uint8_t addr;
+  uint16_t raw_temp;
+  uint16_t raw_rh;
+  unsigned int crc_errors_to_inject;
+  // Whether a measurement result is waiting to be read
+  bool result_ready;
+  // A single shot measurement is converting until then and commands are
+  // NACKed. Reading the result ends it early, as if the read had stretched
+  // the clock.
+  uint64_t converting_until_ns;
+  bool periodic;
+  // Periodic mode: when it started, the interval between measurements and
+  // how many of them have been fetched
+  uint64_t periodic_start_ns;
+  uint64_t period_ns;
+  uint64_t fetched_count;
+  // The next read returns the status register instead of a measurement
+  bool status_requested;
+};
+
+struct sim_i2c_bus {
+  struct sim_i2c_bus *next;
+  char name[SIM_NAME_MAX];
+  pthread_mutex_t mutex;
+  struct sim_sht31 sht31[2];
+};
+
+// Simulated devices are created on first use and live until the process
+// exits, so that their state can be inspected after a driver is closed.
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_gpio_chip *gpio_chips = NULL;
+static struct sim_i2c_bus *i2c_buses = NULL;
+
+static const char *sim_name(const char *path) {
+  if (strncmp(path, IOTCTRL_SIM_PREFIX, strlen(IOTCTRL_SIM_PREFIX)) != 0)
+    return NULL;
+  const char *name = path + strlen(IOTCTRL_SIM_PREFIX);
+  if (strlen(name) >= SIM_NAME_MAX)
+    return NULL;
+  return name;
+}
+
+static struct sim_gpio_chip *find_gpio_chip(const char *path, bool create) {
+  const char *name = sim_name(path);
+  if (name == NULL)
+    return NULL;
+  pthread_mutex_lock(&registry_mutex);
+  struct sim_gpio_chip *c = gpio_chips;
+  while (c != NULL && strcmp(c->name, name) != 0)
+    c = c->next;
+  if (c == NULL && create) {
+    c = calloc(1, sizeof(struct sim_gpio_chip));
+    if (c != NULL) {
+      strcpy(c->name, name);
+      pthread_mutex_init(&c->mutex, NULL);
+      c->next = gpio_chips;
+      gpio_chips = c;
+    }
+  }
+  pthread_mutex_unlock(&registry_mutex);
+  return c;
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sht31_set(struct sim_sht31 *s, float temp_celsius,
+                      float relative_humidity) {
+  // Inverse of the conversion formulas in the SHT3x datasheet
+  s->raw_temp = (uint16_t)((temp_celsius + 45.0f) * 65535.0f / 175.0f + 0.5f);
+  s->raw_rh = (uint16_t)(relative_humidity * 65535.0f / 100.0f + 0.5f);
+}
+
+static struct sim_i2c_bus *find_i2c_bus(const char *path, bool create) {
+  const char *name = sim_name(path);
+  if (name == NULL)
+    return NULL;
+  pthread_mutex_lock(&registry_mutex);
+  struct sim_i2c_bus *b = i2c_buses;
+  while (b != NULL && strcmp(b->name, name) != 0)
+    b = b->next;
+  if (b == NULL && create) {
+    b = calloc(1, sizeof(struct sim_i2c_bus));
+    if (b != NULL) {
+      strcpy(b->name, name);
+      pthread_mutex_init(&b->mutex, NULL);
+      b->sht31[0].addr = SHT31_ADDR_A;
+      b->sht31[1].addr = SHT31_ADDR_B;
+      sht31_set(&b->sht31[0], 25.0f, 50.0f);
+      sht31_set(&b->sht31[1], 25.0f, 50.0f);
+      b->next = i2c_buses;
+      i2c_buses = b;
+    }
+  }
+  pthread_mutex_unlock(&registry_mutex);
+  return b;
+}
+
+struct sim_gpio_output_ctx {
+  struct sim_gpio_chip *chip;
+  unsigned int num_lines;
+  unsigned int offsets[IOTCTRL_GPIO_MAX_LINES];
+};
+
+static void record_values(struct sim_gpio_chip *c, uint64_t values) {
+  const uint64_t rising = ~c->stats.values & values;
+  const uint64_t falling = c->stats.values & ~values;
+  for (int i = 0; i < 64; ++i) {
+    c->stats.rising_edges[i] += (rising >> i) & 1;
+    c->stats.falling_edges[i] += (falling >> i) & 1;
+  }
+  c->stats.values = values;
+  ++c->stats.write_count;
+  struct iotctrl_sim_gpio_event *e =
+      &c->events[c->event_count % SIM_GPIO_EVENT_CAPACITY];
+  e->timestamp_ns = monotonic_ns();
+  e->values = values;
+  ++c->event_count;
+}
+
+static int sim_gpio_set_values(void *ctx, const int *values) {
+  struct sim_gpio_output_ctx *o = ctx;
+  struct sim_gpio_chip *c = o->chip;
+  pthread_mutex_lock(&c->mutex);
+  uint64_t v = c->stats.values;
+  for (unsigned int i = 0; i < o->num_lines; ++i) {
+    if (values[i])
+      v |= 1ULL << o->offsets[i];
+    else
+      v &= ~(1ULL << o->offsets[i]);
+  }
+  record_values(c, v);
+  pthread_mutex_unlock(&c->mutex);
+  return 0;
+}
+
+static void sim_gpio_release(void *ctx) { free(ctx); }
+
+static const struct iotctrl_gpio_ops sim_gpio_ops = {sim_gpio_set_values,
+                                                     sim_gpio_release};
+
+int iotctrl_sim_gpio_output_request(struct iotctrl_gpio_output *out,
+                                    const char *chip_path,
+                                    const unsigned int *offsets,
+                                    unsigned int num_lines,
+                                    const int *default_vals) {
+  for (unsigned int i = 0; i < num_lines; ++i) {
+    if (offsets[i] >= 64) {
+      fprintf(stderr, "Simulated GPIO line %u out of range\n", offsets[i]);
+      return -1;
+    }
+  }
+  struct sim_gpio_chip *c = find_gpio_chip(chip_path, true);
+  if (c == NULL) {
+    fprintf(stderr, "Failed to create simulated GPIO chip %s\n", chip_path);
+    return -1;
+  }
+  struct sim_gpio_output_ctx *o = malloc(sizeof(struct sim_gpio_output_ctx));
+  if (o == NULL) {
+    perror("malloc()");
+    return -1;
+  }
+  o->chip = c;
+  o->num_lines = num_lines;
+  memcpy(o->offsets, offsets, num_lines * sizeof(offsets[0]));
+  out->ops = &sim_gpio_ops;
+  out->ctx = o;
+  // Requesting lines as outputs drives them to their default values, just
+  // like GPIO_GET_LINEHANDLE_IOCTL does
+  return default_vals == NULL ? 0 : sim_gpio_set_values(o, default_vals);
+}
+
+int iotctrl_sim_gpio_get_stats(const char *chip_path,
+                               struct iotctrl_sim_gpio_stats *stats) {
+  struct sim_gpio_chip *c = find_gpio_chip(chip_path, false);
+  if (c == NULL)
+    return -1;
+  pthread_mutex_lock(&c->mutex);
+  *stats = c->stats;
+  pthread_mutex_unlock(&c->mutex);
+  return 0;
+}
+
+size_t iotctrl_sim_gpio_read_events(const char *chip_path,
+                                    struct iotctrl_sim_gpio_event *events,
+                                    size_t max_events) {
+  struct sim_gpio_chip *c = find_gpio_chip(chip_path, false);
+  if (c == NULL)
+    return 0;
+  pthread_mutex_lock(&c->mutex);
+  uint64_t n = c->event_count < SIM_GPIO_EVENT_CAPACITY
+                   ? c->event_count
+                   : SIM_GPIO_EVENT_CAPACITY;
+  if (n > max_events)
+    n = max_events;
+  for (uint64_t i = 0; i < n; ++i)
+    events[i] =
+        c->events[(c->event_count - n + i) % SIM_GPIO_EVENT_CAPACITY];
+  pthread_mutex_unlock(&c->mutex);
+  return n;
+}
+
+void iotctrl_sim_gpio_reset(const char *chip_path) {
+  struct sim_gpio_chip *c = find_gpio_chip(chip_path, false);
+  if (c == NULL)
+    return;
+  pthread_mutex_lock(&c->mutex);
+  // Line values are kept, they are the state of the chip, not a counter
+  const uint64_t values = c->stats.values;
+  memset(&c->stats, 0, sizeof(c->stats));
+  c->stats.values = values;
+  c->event_count = 0;
+  pthread_mutex_unlock(&c->mutex);
+}
+
+static struct sim_sht31 *find_sht31(struct sim_i2c_bus *b, uint16_t addr) {
+  for (size_t i = 0; i < sizeof(b->sht31) / sizeof(b->sht31[0]); ++i)
+    if (b->sht31[i].addr == addr)
+      return &b->sht31[i];
+  return NULL;
+}
+
+static int sht31_write(struct sim_sht31 *s, const uint8_t *buf, uint16_t len) {
+  if (len != 2)
+    return -1;
+  const uint16_t cmd = (buf[0] << 8) | buf[1];
+  const uint8_t msb = buf[0];
+  const uint64_t now_ns = monotonic_ns();
+  if (now_ns < s->converting_until_ns)
+    return -1;
+  if (msb == 0x2C || msb == 0x24) {
+    // Single shot, with or without clock stretching. Typical conversion
+    // times of high, medium and low repeatability.
+    const uint8_t lsb = buf[1];
+    const uint64_t duration_us = lsb == 0x06 || lsb == 0x00   ? 12500
+                                 : lsb == 0x0D || lsb == 0x0B ? 4500
+                                                              : 2500;
+    s->result_ready = true;
+    s->status_requested = false;
+    s->converting_until_ns = now_ns + duration_us * 1000;
+  } else if ((msb >= 0x20 && msb <= 0x23) || msb == 0x27) {
+    // Periodic acquisition at 0.5, 1, 2, 4 or 10 measurements per second
+    static const uint64_t periods_ms[] = {2000, 1000, 500, 250, 0, 0, 0, 100};
+    s->periodic = true;
+    s->result_ready = false;
+    s->periodic_start_ns = now_ns;
+    s->period_ns = periods_ms[msb - 0x20] * 1000000ULL;
+    s->fetched_count = 0;
+  } else if (cmd == 0xE000) {
+    // Fetch data in periodic mode, a measurement can only be fetched once
+    if (!s->periodic)
+      return -1;
+    const uint64_t measured_count =
+        (now_ns - s->periodic_start_ns) / s->period_ns;
+    s->result_ready = measured_count > s->fetched_count;
+    s->fetched_count = measured_count;
+    s->status_requested = false;
+  } else if (cmd == 0x3093 || cmd == 0x30A2) {
+    // Break or soft reset
+    s->periodic = false;
+    s->result_ready = false;
+  } else if (cmd == 0xF32D) {
+    s->status_requested = true;
+  } else if (cmd == 0x3041) {
+    // Clear status register, nothing to clear
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int sht31_read(struct sim_sht31 *s, uint8_t *buf, uint16_t len) {
+  if (s->status_requested) {
+    if (len > 3)
+      return -1;
+    uint8_t status[3] = {0x00, 0x00, 0x00};
+    status[2] = iotctrl_crc8_sht31(status, 2);
+    memcpy(buf, status, len);
+    s->status_requested = false;
+    return 0;
+  }
+  // Like the real sensor, a read without a pending result is NACKed
+  if (!s->result_ready || len > 6)
+    return -1;
+  uint8_t rsp[6] = {s->raw_temp >> 8, s->raw_temp & 0xFF, 0,
+                    s->raw_rh >> 8,   s->raw_rh & 0xFF,   0};
+  rsp[2] = iotctrl_crc8_sht31(rsp, 2);
+  rsp[5] = iotctrl_crc8_sht31(rsp + 3, 2);
+  if (s->crc_errors_to_inject > 0) {
+    --s->crc_errors_to_inject;
+    rsp[2] ^= 0xFF;
+  }
+  memcpy(buf, rsp, len);
+  s->result_ready = false;
+  s->converting_until_ns = 0;
+  return 0;
+}
+
+static int sim_i2c_transfer(void *ctx, struct iotctrl_i2c_msg *msgs,
+                            size_t num_msgs) {
+  struct sim_i2c_bus *b = ctx;
+  int ret = 0;
+  pthread_mutex_lock(&b->mutex);
+  for (size_t i = 0; i < num_msgs; ++i) {
+    struct sim_sht31 *s = find_sht31(b, msgs[i].addr);
+    if (s == NULL ||
+        (msgs[i].flags & IOTCTRL_I2C_M_RD
+             ? sht31_read(s, msgs[i].buf, msgs[i].len)
+             : sht31_write(s, msgs[i].buf, msgs[i].len)) != 0) {
+      errno = ENXIO;
+      ret = -1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&b->mutex);
+  return ret;
+}
+
+static void sim_i2c_close(void *ctx) { (void)ctx; }
+
+static const struct iotctrl_i2c_ops sim_i2c_ops = {sim_i2c_transfer,
+                                                   sim_i2c_close};
+
+int iotctrl_sim_i2c_open(struct iotctrl_i2c_bus *bus, const char *path) {
+  struct sim_i2c_bus *b = find_i2c_bus(path, true);
+  if (b == NULL) {
+    fprintf(stderr, "Failed to create simulated I2C bus %s\n", path);
+    return -1;
+  }
+  bus->ops = &sim_i2c_ops;
+  bus->ctx = b;
+  return 0;
+}
+
+int iotctrl_sim_sht31_set(const char *bus_path, uint8_t addr,
+                          float temp_celsius, float relative_humidity) {
+  struct sim_i2c_bus *b = find_i2c_bus(bus_path, true);
+  if (b == NULL)
+    return -1;
+  pthread_mutex_lock(&b->mutex);
+  struct sim_sht31 *s = find_sht31(b, addr);
+  if (s != NULL)
+    sht31_set(s, temp_celsius, relative_humidity);
+  pthread_mutex_unlock(&b->mutex);
+  return s == NULL ? -1 : 0;
+}
+
+int iotctrl_sim_sht31_inject_crc_errors(const char *bus_path, uint8_t addr,
+                                        unsigned int count) {
+  struct sim_i2c_bus *b = find_i2c_bus(bus_path, true);
+  if (b == NULL)
+    return -1;
+  pthread_mutex_lock(&b->mutex);
+  struct sim_sht31 *s = find_sht31(b, addr);
+  if (s != NULL)
+    s->crc_errors_to_inject = count;
+  pthread_mutex_unlock(&b->mutex);
+  return s == NULL ? -1 : 0;
+}
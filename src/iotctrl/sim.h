@@ -0,0 +1,78 @@
+#ifndef LIBIOTCTRL_SIM_H
+#define LIBIOTCTRL_SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Passing a GPIO chip or I2C bus path that starts with this prefix, e.g.
+// "sim:gpiochip0" or "sim:i2c-1", to any driver makes it talk to an
+// in-process simulated device instead of real hardware. It is meant for
+// benchmarking and regression-testing on machines without the devices.
+#define IOTCTRL_SIM_PREFIX "sim:"
+
+// Simulated GPIO chips record every write. Lines are numbered 0-63.
+struct iotctrl_sim_gpio_event {
+  uint64_t timestamp_ns;
+  // Bit n is the value of line n after the write
+  uint64_t values;
+};
+
+struct iotctrl_sim_gpio_stats {
+  // Number of writes, i.e., what would have been GPIO ioctl()s
+  uint64_t write_count;
+  uint64_t values;
+  uint64_t rising_edges[64];
+  uint64_t falling_edges[64];
+};
+
+/**
+ * @brief Get counters of a simulated GPIO chip
+ * @param chip_path the same path that is passed to the driver, e.g.
+ * "sim:gpiochip0"
+ * @returns 0 on success or -1 if the chip has never been used
+ */
+int iotctrl_sim_gpio_get_stats(const char *chip_path,
+                               struct iotctrl_sim_gpio_stats *stats);
+
+/**
+ * @brief Copy up to max_events most recent writes, oldest first. The chip
+ * keeps the last 4096 writes.
+ * @returns Number of events copied
+ */
+size_t iotctrl_sim_gpio_read_events(const char *chip_path,
+                                    struct iotctrl_sim_gpio_event *events,
+                                    size_t max_events);
+
+/**
+ * @brief Reset counters and the event log of a simulated GPIO chip
+ */
+void iotctrl_sim_gpio_reset(const char *chip_path);
+
+// Simulated I2C buses have scripted SHT31 responders at 0x44 and 0x45 that
+// report 25 °C and 50 %RH unless told otherwise. Other addresses NACK. As
+// with a real sensor, commands are NACKed while a single shot measurement is
+// converting, and in periodic acquisition mode results become available at
+// the commanded rate and fetches in between are NACKed.
+
+/**
+ * @brief Set what a simulated SHT31 reports from now on
+ * @returns 0 on success or -1 on error
+ */
+int iotctrl_sim_sht31_set(const char *bus_path, uint8_t addr,
+                          float temp_celsius, float relative_humidity);
+
+/**
+ * @brief Corrupt the CRC of the next `count` results of a simulated SHT31
+ */
+int iotctrl_sim_sht31_inject_crc_errors(const char *bus_path, uint8_t addr,
+                                        unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBIOTCTRL_SIM_H
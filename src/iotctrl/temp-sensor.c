@@ -1,59 +1,106 @@
 #include "temp-sensor.h"
+#include "crc.h"
 
 #include <modbus/modbus.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 const uint16_t iotctrl_invalid_temp = IOTCTRL_INVALID_TEMP;
 
-// This function can also be found at page 21 of
-// https://github.com/alex-lt-kong/libiotctrl/blob/main/assets/dl11-mc_manual.pdf
-static uint16_t calculate_crc16(const uint8_t *buf, size_t len) {
-  uint16_t crc = 0xFFFF;
+struct iotctrl_temp_sensor_handle {
+  modbus_t *mb_ctx;
+  // Whether modbus_connect() has succeeded and the tty is still considered
+  // usable. It is reset after any I/O error so that the next read reconnects.
+  bool connected;
+  // Whether modbus_connect() has ever succeeded, later connects are retries
+  bool was_connected;
+  struct iotctrl_metrics metrics;
+};
 
-  for (size_t pos = 0; pos < len; pos++) {
-    crc ^= (uint16_t)buf[pos]; // XOR byte into least sig. byte of crc
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    for (int i = 8; i != 0; i--) { // Loop over each bit
-      if ((crc & 0x0001) != 0) {   // If the LSB is set
-        crc >>= 1;                 // Shift right and XOR 0xA001
-        crc ^= 0xA001;
-      } else       // Else LSB is not set
-        crc >>= 1; // Just shift right
-    }
+struct iotctrl_temp_sensor_handle *
+iotctrl_temp_sensor_open(const char *sensor_path,
+                         const int enable_debug_output) {
+  struct iotctrl_temp_sensor_handle *h =
+      calloc(1, sizeof(struct iotctrl_temp_sensor_handle));
+  if (h == NULL) {
+    perror("calloc()");
+    return NULL;
+  }
+  h->mb_ctx = modbus_new_rtu(sensor_path, 9600, 'N', 8, 1);
+  if (h->mb_ctx == NULL) {
+    fprintf(stderr, "modbus_new_rtu() failed: %s\n", modbus_strerror(errno));
+    free(h);
+    return NULL;
+  }
+  if (modbus_set_slave(h->mb_ctx, IOTCTRL_TEMP_SENSOR_DEFAULT_SLAVE) != 0) {
+    fprintf(stderr, "modbus_set_slave() failed: %s\n", modbus_strerror(errno));
+    iotctrl_temp_sensor_close(h);
+    return NULL;
   }
-  // Note, this number has low and high bytes swapped, so use it accordingly (or
-  // swap bytes)
-  return crc;
+  (void)modbus_set_debug(h->mb_ctx, enable_debug_output == 1);
+  return h;
 }
 
-int iotctrl_get_temperature(const char *sensor_path, uint8_t sensor_count,
-                            int16_t *readings, const int enable_debug_output) {
-  int ret = 0;
-  modbus_t *mb_ctx = NULL;
+static void disconnect(struct iotctrl_temp_sensor_handle *h) {
+  if (!h->connected)
+    return;
+  // Can close after checking modbus_connect(ctx) == -1 again:
+  // an established connection could not be established one more time, causing
+  // the test to fail and left the context open.
+  modbus_close(h->mb_ctx);
+  h->connected = false;
+}
 
-  mb_ctx = modbus_new_rtu(sensor_path, 9600, 'N', 8, 1);
-  if (mb_ctx == NULL) {
-    fprintf(stderr, "modbus_new_rtu() failed: %s\n", modbus_strerror(errno));
-    ret = -1;
-    goto finally;
+void iotctrl_temp_sensor_close(struct iotctrl_temp_sensor_handle *h) {
+  if (h == NULL)
+    return;
+  if (h->mb_ctx != NULL) {
+    disconnect(h);
+    modbus_free(h->mb_ctx);
   }
+  free(h);
+}
 
-  if (modbus_set_slave(mb_ctx, 1) != 0) {
-    fprintf(stderr, "modbus_set_slave() failed: %s\n", modbus_strerror(errno));
-    ret = -2;
-    goto finally;
-  }
-  (void)modbus_set_debug(mb_ctx, enable_debug_output == 1);
-  if (modbus_connect(mb_ctx) != 0) {
+static int connect_if_needed(struct iotctrl_temp_sensor_handle *h) {
+  if (h->connected)
+    return 0;
+  if (h->was_connected)
+    iotctrl_metrics_add_retry(&h->metrics, IOTCTRL_METRICS_DL11_READ);
+  if (modbus_connect(h->mb_ctx) != 0) {
     fprintf(stderr, "modbus_connect() failed: %s\n", modbus_strerror(errno));
-    ret = -3;
-    goto finally;
+    return -3;
   }
+  h->connected = true;
+  h->was_connected = true;
+  return 0;
+}
 
-  const uint8_t raw_req[] = {0x01, 0x04, 0x04, 0x00, 0x00, sensor_count};
+static int read_slave(struct iotctrl_temp_sensor_handle *h,
+                      const uint8_t slave_addr, uint8_t sensor_count,
+                      int16_t *readings) {
+  int ret = 0;
+  // errno of the failed libmodbus call, fprintf() may overwrite errno
+  int err;
+
+  const uint8_t raw_req[] = {slave_addr, 0x04, 0x04, 0x00, 0x00, sensor_count};
   // clang-format off
   // Note that we have to truncate the bytes series from 8 to 6 to make it work.
   // Page 12 of the manufacturer manual documents the format of command bytes format:
@@ -66,19 +113,30 @@ int iotctrl_get_temperature(const char *sensor_path, uint8_t sensor_count,
 
   uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
 
+  // libmodbus checks the response's address against the context's slave
+  if (modbus_set_slave(h->mb_ctx, slave_addr) == -1) {
+    fprintf(stderr, "modbus_set_slave(%#04x) failed: %s\n", slave_addr,
+            modbus_strerror(errno));
+    return -1;
+  }
   const int req_length = modbus_send_raw_request(
-      mb_ctx, raw_req, sizeof(raw_req) / sizeof(raw_req[0]));
+      h->mb_ctx, raw_req, sizeof(raw_req) / sizeof(raw_req[0]));
   if (req_length == -1) {
+    err = errno;
     fprintf(stderr, "modbus_send_raw_request() failed: %s\n",
-            modbus_strerror(errno));
+            modbus_strerror(err));
     ret = -3;
-    goto finally;
+    goto err_io;
   }
-  if (modbus_receive_confirmation(mb_ctx, rsp) == -1) {
-    fprintf(stderr, "modbus_receive_confirmation() failed: %s\n",
-            modbus_strerror(errno));
+  const int rsp_length = modbus_receive_confirmation(h->mb_ctx, rsp);
+  if (rsp_length <= 0) {
+    // 0 means nothing was received, e.g., with a response timeout of 0, and
+    // leaves errno alone
+    err = rsp_length == 0 ? ETIMEDOUT : errno;
+    fprintf(stderr, "modbus_receive_confirmation(%#04x) failed: %s\n",
+            slave_addr, modbus_strerror(err));
     ret = -4;
-    goto finally;
+    goto err_io;
   }
   // clang-format off
   // Page 12 of the manufacturer manual documents the format of reply bytes format:
@@ -89,14 +147,17 @@ int iotctrl_get_temperature(const char *sensor_path, uint8_t sensor_count,
   // 2 bytes: CRC
   // clang-format on
 
-  if (rsp[0] == 0x01 || rsp[1] == 0x04 || rsp[2] == 0x02) {
-    const uint16_t calculated_crc = calculate_crc16(rsp, 3 + sensor_count * 2);
+  if (rsp[0] == slave_addr && rsp[1] == 0x04 && rsp[2] == sensor_count * 2) {
+    const uint16_t calculated_crc =
+        iotctrl_crc16_modbus(rsp, 3 + sensor_count * 2);
     const uint16_t expected_crc =
         (rsp[4 + sensor_count * 2] << 8) + rsp[3 + sensor_count * 2];
     if (calculated_crc != expected_crc) {
       fprintf(stderr, "CRC value does not match!\n");
-      ret = -5;
-      goto finally;
+      iotctrl_metrics_add_crc_error(&h->metrics, IOTCTRL_METRICS_DL11_READ);
+      // A corrupted frame may leave trailing bytes in the input queue
+      (void)modbus_flush(h->mb_ctx);
+      return -5;
     }
     for (uint8_t i = 0; i < sensor_count; ++i) {
       readings[i] = (rsp[3 + i * 2] << 8) + rsp[4 + i * 2];
@@ -105,25 +166,402 @@ int iotctrl_get_temperature(const char *sensor_path, uint8_t sensor_count,
                 "Sensor no. %u (index from 0) returns is INVALID_TEMP(%d). The "
                 "sensor might be non-existent or malfunctional\n",
                 i + 1, IOTCTRL_INVALID_TEMP);
-        ret = -6;
-        goto finally;
+        return -6;
       }
     }
   } else {
     ret = -7;
     fprintf(stderr,
-            "Invalid response header, expecting 0x01, 0x04, 0x02, but gets "
+            "Invalid response header, expecting %#04x, 0x04, %#04x, but gets "
             "%#04x, %#04x, %#04x\n",
-            rsp[0], rsp[1], rsp[2]);
+            slave_addr, sensor_count * 2, rsp[0], rsp[1], rsp[2]);
+    (void)modbus_flush(h->mb_ctx);
   }
+  return ret;
+
+err_io:
+  // A slave that does not answer says nothing about the bus, other errors
+  // suggest the tty might have been unplugged or is otherwise in a bad state,
+  // start over with a fresh modbus_connect() on the next read.
+  if (err != ETIMEDOUT)
+    disconnect(h);
+  return ret;
+}
 
-finally:
-  if (mb_ctx != NULL) {
-    // Can close after checking modbus_connect(ctx) == -1 again:
-    // an established connection could not be established one more time, causing
-    // the test to fail and left the context open.
-    modbus_close(mb_ctx);
-    modbus_free(mb_ctx);
+// A failed connect counts as a failed read, the caller sees no difference
+static int read_device(struct iotctrl_temp_sensor_handle *h,
+                       const uint8_t slave_addr, uint8_t sensor_count,
+                       int16_t *readings) {
+  const uint64_t start_ns = monotonic_ns();
+  int ret = connect_if_needed(h);
+  if (ret == 0)
+    ret = read_slave(h, slave_addr, sensor_count, readings);
+  iotctrl_metrics_record(&h->metrics, IOTCTRL_METRICS_DL11_READ, ret,
+                         monotonic_ns() - start_ns);
+  return ret;
+}
+
+int iotctrl_temp_sensor_read(struct iotctrl_temp_sensor_handle *h,
+                             uint8_t sensor_count, int16_t *readings) {
+  return read_device(h, IOTCTRL_TEMP_SENSOR_DEFAULT_SLAVE, sensor_count,
+                     readings);
+}
+
+int iotctrl_temp_sensor_read_slaves(struct iotctrl_temp_sensor_handle *h,
+                                    const uint8_t *slave_addrs,
+                                    size_t slave_count, uint8_t sensor_count,
+                                    int16_t *readings, int *results) {
+  int failed_count = 0;
+  for (size_t i = 0; i < slave_count; ++i) {
+    // Each request goes out as soon as the previous response is complete, so
+    // a sweep is bounded by the wire time plus the slaves' response latency
+    results[i] = read_device(h, slave_addrs[i], sensor_count,
+                             readings + i * sensor_count);
+    if (results[i] != 0)
+      ++failed_count;
   }
+  return failed_count;
+}
+
+const struct iotctrl_metrics *
+iotctrl_temp_sensor_get_metrics(const struct iotctrl_temp_sensor_handle *h) {
+  return &h->metrics;
+}
+
+int iotctrl_get_temperature(const char *sensor_path, uint8_t sensor_count,
+                            int16_t *readings, const int enable_debug_output) {
+  struct iotctrl_temp_sensor_handle *h =
+      iotctrl_temp_sensor_open(sensor_path, enable_debug_output);
+  if (h == NULL)
+    return -1;
+  const int ret = iotctrl_temp_sensor_read(h, sensor_count, readings);
+  iotctrl_temp_sensor_close(h);
   return ret;
 }
+
+// One shared memory object per (user, sensor_path, sensor_count), e.g.,
+// /dev/shm/iotctrl-temp-1000-0123456789abcdef-2. Fields are only accessed
+// while the object is flock()ed.
+#define TEMP_CACHE_MAGIC 0x49544332 // "ITC2"
+#define TEMP_CACHE_MAX_PATH 128
+// How long a failed read is handed to callers that did not wait for it
+#define TEMP_CACHE_FAILURE_TTL_MS 1000
+
+struct temp_cache_shared {
+  uint32_t magic;
+  uint8_t sensor_count;
+  // Whether readings/updated_ns hold a successful read
+  bool has_readings;
+  // CLOCK_MONOTONIC is system-wide, so it can be compared across processes
+  uint64_t updated_ns;
+  // Result of the last read and when it finished
+  int32_t result;
+  uint64_t attempted_ns;
+  // To tell apart paths whose names hash to the same object
+  char sensor_path[TEMP_CACHE_MAX_PATH];
+  int16_t readings[UINT8_MAX];
+};
+
+// A process-wide mapping of one shared object. flock() only excludes other
+// open file descriptions, so threads of the process are serialized by the
+// mutex instead.
+struct temp_cache_entry {
+  struct temp_cache_entry *next;
+  char sensor_path[TEMP_CACHE_MAX_PATH];
+  uint8_t sensor_count;
+  // flock() is tied to the open file description, which a forked child
+  // shares with its parent, so children open the object again
+  pid_t pid;
+  int fd;
+  struct temp_cache_shared *shared;
+  pthread_mutex_t mutex;
+};
+
+// Entries live as long as the process, there is one per device at most
+static struct temp_cache_entry *temp_cache_entries = NULL;
+static pthread_mutex_t temp_cache_entries_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t fnv1a64(const char *s) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (; *s != '\0'; ++s) {
+    hash ^= (uint8_t)*s;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static int open_temp_cache_fd(const char *sensor_path, uint8_t sensor_count,
+                              char *name, size_t name_size) {
+  // The name is predictable, so another user may have created it first. The
+  // uid in the name keeps such a user from locking everyone else out, the
+  // owner check from planting readings.
+  const uid_t uid = geteuid();
+  snprintf(name, name_size, "/iotctrl-temp-%u-%016llx-%u", (unsigned int)uid,
+           (unsigned long long)fnv1a64(sensor_path), sensor_count);
+  const int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "shm_open(%s) failed: %d(%s)\n", name, errno,
+            strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "fstat(%s) failed: %d(%s)\n", name, errno,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (st.st_uid != uid || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+    fprintf(stderr, "%s is not owned by uid %u or writable by others\n", name,
+            (unsigned int)uid);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static struct temp_cache_entry *open_temp_cache_entry(const char *sensor_path,
+                                                      uint8_t sensor_count) {
+  char name[NAME_MAX];
+  const int fd =
+      open_temp_cache_fd(sensor_path, sensor_count, name, sizeof(name));
+  if (fd < 0)
+    return NULL;
+  // Every process truncates to the same size, a fresh object is zero-filled
+  // and thus has no valid magic yet
+  if (ftruncate(fd, sizeof(struct temp_cache_shared)) != 0) {
+    fprintf(stderr, "ftruncate(%s) failed: %d(%s)\n", name, errno,
+            strerror(errno));
+    goto err_close;
+  }
+  struct temp_cache_entry *e = malloc(sizeof(struct temp_cache_entry));
+  if (e == NULL) {
+    perror("malloc()");
+    goto err_close;
+  }
+  e->shared = mmap(NULL, sizeof(struct temp_cache_shared),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (e->shared == MAP_FAILED) {
+    fprintf(stderr, "mmap(%s) failed: %d(%s)\n", name, errno,
+            strerror(errno));
+    free(e);
+    goto err_close;
+  }
+  strcpy(e->sensor_path, sensor_path);
+  e->sensor_count = sensor_count;
+  e->pid = getpid();
+  e->fd = fd;
+  pthread_mutex_init(&e->mutex, NULL);
+  return e;
+
+err_close:
+  close(fd);
+  return NULL;
+}
+
+static struct temp_cache_entry *get_temp_cache_entry(const char *sensor_path,
+                                                     uint8_t sensor_count) {
+  pthread_mutex_lock(&temp_cache_entries_mutex);
+  struct temp_cache_entry *e = temp_cache_entries;
+  for (; e != NULL; e = e->next)
+    if (e->sensor_count == sensor_count &&
+        strcmp(e->sensor_path, sensor_path) == 0)
+      break;
+  if (e == NULL) {
+    e = open_temp_cache_entry(sensor_path, sensor_count);
+    if (e != NULL) {
+      e->next = temp_cache_entries;
+      temp_cache_entries = e;
+    }
+  } else if (e->pid != getpid()) {
+    char name[NAME_MAX];
+    const int fd =
+        open_temp_cache_fd(sensor_path, sensor_count, name, sizeof(name));
+    if (fd < 0) {
+      e = NULL;
+    } else {
+      // The mapping is inherited and still valid
+      close(e->fd);
+      e->fd = fd;
+      e->pid = getpid();
+    }
+  }
+  pthread_mutex_unlock(&temp_cache_entries_mutex);
+  return e;
+}
+
+// Serve a reading at most max_age_ms old, or the failure of a read that
+// finished after waiting_since_ns, i.e., while the caller was waiting for it,
+// or not longer than TEMP_CACHE_FAILURE_TTL_MS ago. Failures are never served
+// for a longer time than readings, e.g., not at all for max_age_ms 0.
+static bool serve_from_cache(const struct temp_cache_entry *e,
+                             uint32_t max_age_ms, uint64_t waiting_since_ns,
+                             int16_t *readings, int *ret) {
+  const struct temp_cache_shared *s = e->shared;
+  if (max_age_ms == 0 || s->magic != TEMP_CACHE_MAGIC ||
+      s->sensor_count != e->sensor_count ||
+      strcmp(s->sensor_path, e->sensor_path) != 0)
+    return false;
+  const uint64_t now_ns = monotonic_ns();
+  const uint64_t max_age_ns = max_age_ms * 1000000ULL;
+  if (s->result != 0) {
+    const uint64_t ttl_ns = TEMP_CACHE_FAILURE_TTL_MS * 1000000ULL;
+    if (s->attempted_ns < waiting_since_ns &&
+        now_ns - s->attempted_ns > (ttl_ns < max_age_ns ? ttl_ns : max_age_ns))
+      return false;
+    *ret = s->result;
+    return true;
+  }
+  if (!s->has_readings || now_ns - s->updated_ns > max_age_ns)
+    return false;
+  memcpy(readings, s->readings, e->sensor_count * sizeof(int16_t));
+  *ret = 0;
+  return true;
+}
+
+static int temp_cache_flock(const struct temp_cache_entry *e, int operation) {
+  while (flock(e->fd, operation) != 0) {
+    if (errno != EINTR) {
+      fprintf(stderr, "flock() failed: %d(%s)\n", errno, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int iotctrl_get_temperature_cached(const char *sensor_path,
+                                   uint8_t sensor_count, int16_t *readings,
+                                   uint32_t max_age_ms,
+                                   const int enable_debug_output) {
+  struct temp_cache_entry *e = NULL;
+  int ret;
+  if (strlen(sensor_path) >= TEMP_CACHE_MAX_PATH)
+    fprintf(stderr, "sensor_path is too long to be cached\n");
+  else
+    e = get_temp_cache_entry(sensor_path, sensor_count);
+  if (e == NULL)
+    goto uncached;
+
+  const uint64_t waiting_since_ns = monotonic_ns();
+  pthread_mutex_lock(&e->mutex);
+  // A fresh reading only needs a shared lock, so readers of other processes
+  // do not wait for each other
+  if (temp_cache_flock(e, LOCK_SH) != 0)
+    goto unlock_mutex_uncached;
+  if (serve_from_cache(e, max_age_ms, waiting_since_ns, readings, &ret))
+    goto unlock;
+  // flock() does not upgrade atomically, another process may have refreshed
+  // the reading in between, which is checked again below
+  if (temp_cache_flock(e, LOCK_EX) != 0)
+    goto unlock_uncached;
+  if (serve_from_cache(e, max_age_ms, waiting_since_ns, readings, &ret))
+    goto unlock;
+
+  // Only one caller gets here at a time, everyone else queued up behind the
+  // exclusive lock and is served from the cache afterwards, a failure
+  // included, so that a dead device costs one response timeout rather than
+  // one per caller
+  ret = iotctrl_get_temperature(sensor_path, sensor_count, readings,
+                                enable_debug_output);
+  struct temp_cache_shared *s = e->shared;
+  if (s->magic != TEMP_CACHE_MAGIC || s->sensor_count != sensor_count ||
+      strcmp(s->sensor_path, sensor_path) != 0) {
+    s->sensor_count = sensor_count;
+    strcpy(s->sensor_path, sensor_path);
+    s->has_readings = false;
+    s->magic = TEMP_CACHE_MAGIC;
+  }
+  s->result = ret;
+  s->attempted_ns = monotonic_ns();
+  if (ret == 0) {
+    memcpy(s->readings, readings, sensor_count * sizeof(int16_t));
+    s->updated_ns = s->attempted_ns;
+    s->has_readings = true;
+  }
+
+unlock:
+  (void)flock(e->fd, LOCK_UN);
+  pthread_mutex_unlock(&e->mutex);
+  return ret;
+
+unlock_uncached:
+  (void)flock(e->fd, LOCK_UN);
+unlock_mutex_uncached:
+  pthread_mutex_unlock(&e->mutex);
+uncached:
+  // Without the cache callers are not coalesced, but still get a reading
+  return iotctrl_get_temperature(sensor_path, sensor_count, readings,
+                                 enable_debug_output);
+}
+
+struct batch {
+  const char *const *sensor_paths;
+  const uint8_t *sensor_counts;
+  int16_t *const *readings;
+  int *results;
+  size_t device_count;
+  int enable_debug_output;
+  // Index of the next device to be read, shared by all workers
+  size_t next;
+};
+
+static void read_batch_device(struct batch *b, size_t i) {
+  b->results[i] =
+      iotctrl_get_temperature(b->sensor_paths[i], b->sensor_counts[i],
+                              b->readings[i], b->enable_debug_output);
+}
+
+static void *batch_worker(void *arg) {
+  struct batch *b = arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) <
+         b->device_count) {
+    // Requests to one tty must not interleave, so every occurrence of a path
+    // is read by the worker that claimed its first one
+    bool duplicate = false;
+    for (size_t j = 0; j < i && !duplicate; ++j)
+      duplicate = strcmp(b->sensor_paths[j], b->sensor_paths[i]) == 0;
+    if (duplicate)
+      continue;
+    read_batch_device(b, i);
+    for (size_t j = i + 1; j < b->device_count; ++j)
+      if (strcmp(b->sensor_paths[j], b->sensor_paths[i]) == 0)
+        read_batch_device(b, j);
+  }
+  return NULL;
+}
+
+int iotctrl_get_temperatures(const char *const *sensor_paths,
+                             const uint8_t *sensor_counts, size_t device_count,
+                             int16_t *const *readings, int *results,
+                             const int enable_debug_output) {
+  struct batch b = {sensor_paths, sensor_counts,  readings, results,
+                    device_count, enable_debug_output, 0};
+  // Reading a device is almost entirely waiting for 9600 baud I/O, so
+  // workers are cheap and a sweep takes about as long as the slowest device.
+  // The caller's thread reads devices, too, so one fewer is started.
+  pthread_t workers[IOTCTRL_TEMP_SENSOR_MAX_WORKERS];
+  const size_t others = device_count > 0 ? device_count - 1 : 0;
+  size_t worker_count = others < IOTCTRL_TEMP_SENSOR_MAX_WORKERS
+                            ? others
+                            : IOTCTRL_TEMP_SENSOR_MAX_WORKERS;
+  size_t started = 0;
+  for (; started < worker_count; ++started) {
+    if (pthread_create(&workers[started], NULL, batch_worker, &b) != 0) {
+      fprintf(stderr, "pthread_create() failed, continuing with %zu workers\n",
+              started);
+      break;
+    }
+  }
+  // The caller's thread works too, so the batch completes even if no worker
+  // could be started
+  batch_worker(&b);
+  for (size_t i = 0; i < started; ++i)
+    pthread_join(workers[i], NULL);
+
+  int failed_count = 0;
+  for (size_t i = 0; i < device_count; ++i)
+    if (results[i] != 0)
+      ++failed_count;
+  return failed_count;
+}
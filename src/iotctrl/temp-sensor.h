@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include "metrics.h"
+
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,7 +15,68 @@ extern "C" {
 // language bindings
 extern const uint16_t iotctrl_invalid_temp;
 
+// Modbus address DL11-MC devices ship with
+#define IOTCTRL_TEMP_SENSOR_DEFAULT_SLAVE 0x01
+
+// Opaque handle that owns a Modbus RTU session to one DL11-MC device. The tty
+// is kept open across reads and only reconnected after I/O errors.
+struct iotctrl_temp_sensor_handle;
+
+/**
+ * @brief Prepare a persistent session to a DL11-MC temperature sensor. The
+ * port is opened lazily by the first iotctrl_temp_sensor_read() call.
+ * @param sensor_path path of the temperature sensor, typically something like
+ * "/dev/ttyUSB0". The function does not take ownership of this variable.
+ * @param enable_debug_output pass 1 to print debug info to stdout/stderr
+ * @returns a handle on success or NULL on error
+ */
+struct iotctrl_temp_sensor_handle *
+iotctrl_temp_sensor_open(const char *sensor_path, const int enable_debug_output);
+
+/**
+ * @brief Query sensors of the device at IOTCTRL_TEMP_SENSOR_DEFAULT_SLAVE over
+ * an opened session. If the bus transaction fails for any reason other than a
+ * timeout, the port is closed and will be reconnected by the next call.
+ * @param h handle returned by iotctrl_temp_sensor_open()
+ * @param sensor_count number of sensors, typically 1 or 2
+ * @param readings same as iotctrl_get_temperature()
+ * @returns same as iotctrl_get_temperature()
+ */
+int iotctrl_temp_sensor_read(struct iotctrl_temp_sensor_handle *h,
+                             uint8_t sensor_count, int16_t *readings);
+
+/**
+ * @brief Query several DL11-MC devices chained on one RS-485 bus, one after
+ * another without reopening the port
+ * @param slave_addrs Modbus addresses of the devices
+ * @param sensor_count number of sensors per device
+ * @param readings an pre-allocated array with slave_count * sensor_count
+ * elements, readings of slave_addrs[i] start at readings[i * sensor_count]
+ * @param results an pre-allocated array with slave_count elements, results[i]
+ * is what iotctrl_temp_sensor_read() would have returned for slave_addrs[i]
+ * @returns Number of devices that failed
+ */
+int iotctrl_temp_sensor_read_slaves(struct iotctrl_temp_sensor_handle *h,
+                                    const uint8_t *slave_addrs,
+                                    size_t slave_count, uint8_t sensor_count,
+                                    int16_t *readings, int *results);
+
+/**
+ * @brief Metrics of the reads made over the handle, valid until
+ * iotctrl_temp_sensor_close(). Read them with iotctrl_metrics_read().
+ */
+const struct iotctrl_metrics *
+iotctrl_temp_sensor_get_metrics(const struct iotctrl_temp_sensor_handle *h);
+
+/**
+ * @brief Close the port and release resources held by the handle
+ */
+void iotctrl_temp_sensor_close(struct iotctrl_temp_sensor_handle *h);
+
 /**
+ * @brief A one-off read, it opens a session, reads once and closes it again.
+ * Prefer the iotctrl_temp_sensor_open()/_read()/_close() family if sensors are
+ * polled repeatedly.
  * @param sensor_path path of the temperature sensor, typically something like
  * "/dev/ttyUSB0"
  * @param sensor_count number of sensors, typically 1 or 2
@@ -28,6 +91,47 @@ extern const uint16_t iotctrl_invalid_temp;
 int iotctrl_get_temperature(const char *sensor_path, uint8_t sensor_count,
                             int16_t *readings, const int enable_debug_output);
 
+/**
+ * @brief Same as iotctrl_get_temperature(), but returns the last reading of
+ * the same sensor_path and sensor_count if it is at most max_age_ms old. The
+ * cache lives in POSIX shared memory and is guarded by flock(), so it is
+ * shared by all threads and processes. Callers that find the reading stale at
+ * the same time wait for one of them to query the device instead of each
+ * paying for a bus transaction. A failed read is returned to the callers that
+ * waited for it and, for up to a second, to later ones. The cache is
+ * private to the effective user, if it cannot be used, e.g., because someone
+ * else owns its shared memory object, the device is queried directly.
+ * @param max_age_ms 0 always queries the device, but still updates the cache
+ * and serializes with other callers of this function
+ * @returns same as iotctrl_get_temperature()
+ */
+int iotctrl_get_temperature_cached(const char *sensor_path,
+                                   uint8_t sensor_count, int16_t *readings,
+                                   uint32_t max_age_ms,
+                                   const int enable_debug_output);
+
+// Upper bound of threads iotctrl_get_temperatures() starts in addition to
+// the caller's
+#define IOTCTRL_TEMP_SENSOR_MAX_WORKERS 16
+
+/**
+ * @brief Read many DL11-MC devices, e.g., one per /dev/ttyUSB*, concurrently.
+ * Each device is read as if by iotctrl_get_temperature() on a small pool of
+ * threads, so the call takes about as long as the slowest device instead of
+ * the sum of all of them. A path that appears more than once is read in turn,
+ * never concurrently with itself.
+ * @param sensor_paths, sensor_counts arrays with device_count elements
+ * @param readings an array of device_count pre-allocated arrays, readings[i]
+ * has sensor_counts[i] elements
+ * @param results an pre-allocated array with device_count elements, results[i]
+ * is what iotctrl_get_temperature() returns for sensor_paths[i]
+ * @returns Number of devices that failed
+ */
+int iotctrl_get_temperatures(const char *const *sensor_paths,
+                             const uint8_t *sensor_counts, size_t device_count,
+                             int16_t *const *readings, int *results,
+                             const int enable_debug_output);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,211 @@
+#include "transport.h"
+#include "sim.h"
+
+#include <gpiod.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+static bool is_sim_path(const char *path) {
+  return strncmp(path, IOTCTRL_SIM_PREFIX, strlen(IOTCTRL_SIM_PREFIX)) == 0;
+}
+
+struct gpiod_output_ctx {
+  struct gpiod_chip *chip;
+  struct gpiod_line_bulk bulk;
+};
+
+static int gpiod_output_set_values(void *ctx, const int *values) {
+  struct gpiod_output_ctx *c = ctx;
+  // All lines in one GPIOHANDLE_SET_LINE_VALUES_IOCTL
+  return gpiod_line_set_value_bulk(&c->bulk, values);
+}
+
+static void gpiod_output_release(void *ctx) {
+  struct gpiod_output_ctx *c = ctx;
+  gpiod_line_release_bulk(&c->bulk);
+  gpiod_chip_close(c->chip);
+  free(c);
+}
+
+static const struct iotctrl_gpio_ops gpiod_output_ops = {
+    gpiod_output_set_values, gpiod_output_release};
+
+int iotctrl_gpio_output_request(struct iotctrl_gpio_output *out,
+                                const char *chip_path,
+                                const unsigned int *offsets,
+                                unsigned int num_lines, const char *consumer,
+                                const int *default_vals) {
+  out->ops = NULL;
+  out->ctx = NULL;
+  out->num_lines = 0;
+  if (num_lines == 0 || num_lines > IOTCTRL_GPIO_MAX_LINES) {
+    fprintf(stderr, "Invalid number of GPIO lines (%u)\n", num_lines);
+    return -1;
+  }
+  if (is_sim_path(chip_path)) {
+    if (iotctrl_sim_gpio_output_request(out, chip_path, offsets, num_lines,
+                                        default_vals) != 0)
+      return -1;
+    out->num_lines = num_lines;
+    return 0;
+  }
+
+  struct gpiod_output_ctx *c = malloc(sizeof(struct gpiod_output_ctx));
+  if (c == NULL) {
+    perror("malloc()");
+    return -1;
+  }
+  // Per
+  // https://git.kernel.org/pub/scm/libs/libgpiod/libgpiod.git/tree/lib/chip.c
+  // Internally it uses fopen()/malloc()/ioctl() and all of them set errno on
+  // error
+  c->chip = gpiod_chip_open(chip_path);
+  if (!c->chip) {
+    fprintf(stderr, "gpiod_chip_open(%s) failed: %d(%s)\n", chip_path, errno,
+            strerror(errno));
+    free(c);
+    return -1;
+  }
+  gpiod_line_bulk_init(&c->bulk);
+  // Lines are got one by one so that in case of incorrect wiring, we will
+  // know which one is wrong
+  for (unsigned int i = 0; i < num_lines; ++i) {
+    struct gpiod_line *line = gpiod_chip_get_line(c->chip, offsets[i]);
+    if (line == NULL) {
+      fprintf(stderr, "gpiod_chip_get_line(%s, %u) failed: %d(%s)\n",
+              chip_path, offsets[i], errno, strerror(errno));
+      gpiod_chip_close(c->chip);
+      free(c);
+      return -1;
+    }
+    gpiod_line_bulk_add(&c->bulk, line);
+  }
+  if (gpiod_line_request_bulk_output(&c->bulk, consumer, default_vals) != 0) {
+    fprintf(stderr, "gpiod_line_request_bulk_output(%s) failed: %d(%s)\n",
+            chip_path, errno, strerror(errno));
+    gpiod_chip_close(c->chip);
+    free(c);
+    return -1;
+  }
+  out->ops = &gpiod_output_ops;
+  out->ctx = c;
+  out->num_lines = num_lines;
+  return 0;
+}
+
+void iotctrl_gpio_output_release(struct iotctrl_gpio_output *out) {
+  if (out->ops == NULL)
+    return;
+  out->ops->release(out->ctx);
+  out->ops = NULL;
+  out->ctx = NULL;
+  out->num_lines = 0;
+}
+
+struct i2c_dev_ctx {
+  int fd;
+  bool owns_fd;
+  // Slave address last set with I2C_SLAVE, -1 if unknown
+  int slave_addr;
+};
+
+static int i2c_dev_transfer(void *ctx, struct iotctrl_i2c_msg *msgs,
+                            size_t num_msgs) {
+  struct i2c_dev_ctx *c = ctx;
+  if (num_msgs == 1) {
+    // Plain read()/write() also work on adapters without I2C_FUNC_I2C
+    // support for I2C_RDWR, e.g., some SMBus-only controllers
+    if (c->slave_addr != msgs[0].addr) {
+      if (ioctl(c->fd, I2C_SLAVE, msgs[0].addr) != 0)
+        return -1;
+      c->slave_addr = msgs[0].addr;
+    }
+    const ssize_t n = msgs[0].flags & IOTCTRL_I2C_M_RD
+                          ? read(c->fd, msgs[0].buf, msgs[0].len)
+                          : write(c->fd, msgs[0].buf, msgs[0].len);
+    if (n != msgs[0].len) {
+      if (n >= 0)
+        errno = EIO;
+      return -1;
+    }
+    return 0;
+  }
+  if (num_msgs > I2C_RDWR_IOCTL_MAX_MSGS) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct i2c_msg kmsgs[I2C_RDWR_IOCTL_MAX_MSGS];
+  for (size_t i = 0; i < num_msgs; ++i) {
+    kmsgs[i].addr = msgs[i].addr;
+    kmsgs[i].flags = msgs[i].flags;
+    kmsgs[i].len = msgs[i].len;
+    kmsgs[i].buf = msgs[i].buf;
+  }
+  struct i2c_rdwr_ioctl_data data = {.msgs = kmsgs, .nmsgs = num_msgs};
+  return ioctl(c->fd, I2C_RDWR, &data) < 0 ? -1 : 0;
+}
+
+static void i2c_dev_close(void *ctx) {
+  struct i2c_dev_ctx *c = ctx;
+  if (c->owns_fd)
+    close(c->fd);
+  free(c);
+}
+
+static const struct iotctrl_i2c_ops i2c_dev_ops = {i2c_dev_transfer,
+                                                   i2c_dev_close};
+
+static int i2c_dev_wrap(struct iotctrl_i2c_bus *bus, int fd, bool owns_fd) {
+  struct i2c_dev_ctx *c = malloc(sizeof(struct i2c_dev_ctx));
+  if (c == NULL) {
+    perror("malloc()");
+    return -1;
+  }
+  c->fd = fd;
+  c->owns_fd = owns_fd;
+  c->slave_addr = -1;
+  bus->ops = &i2c_dev_ops;
+  bus->ctx = c;
+  return 0;
+}
+
+int iotctrl_i2c_open(struct iotctrl_i2c_bus *bus, const char *path) {
+  bus->ops = NULL;
+  bus->ctx = NULL;
+  if (is_sim_path(path))
+    return iotctrl_sim_i2c_open(bus, path);
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open(%s): %d(%s)\n", path, errno,
+            strerror(errno));
+    return -1;
+  }
+  if (i2c_dev_wrap(bus, fd, true) != 0) {
+    close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+int iotctrl_i2c_from_fd(struct iotctrl_i2c_bus *bus, int fd) {
+  bus->ops = NULL;
+  bus->ctx = NULL;
+  return i2c_dev_wrap(bus, fd, false);
+}
+
+void iotctrl_i2c_close(struct iotctrl_i2c_bus *bus) {
+  if (bus->ops == NULL)
+    return;
+  bus->ops->close(bus->ctx);
+  bus->ops = NULL;
+  bus->ctx = NULL;
+}
@@ -0,0 +1,103 @@
+#ifndef LIBIOTCTRL_TRANSPORT_H
+#define LIBIOTCTRL_TRANSPORT_H
+
+// Internal transport layer. Drivers talk to GPIO lines and I2C buses through
+// these small vtables instead of calling libgpiod/ioctl() directly, so that
+// in-process simulated backends (sim.h) can stand in for real hardware.
+//
+// Paths starting with IOTCTRL_SIM_PREFIX ("sim:") select the simulated
+// backends, everything else is opened as a real device.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IOTCTRL_GPIO_MAX_LINES 64
+
+struct iotctrl_gpio_ops {
+  // Set all requested lines at once, values[i] is for the i-th offset passed
+  // to iotctrl_gpio_output_request(). Returns 0 on success.
+  int (*set_values)(void *ctx, const int *values);
+  void (*release)(void *ctx);
+};
+
+struct iotctrl_gpio_output {
+  const struct iotctrl_gpio_ops *ops;
+  void *ctx;
+  unsigned int num_lines;
+};
+
+/**
+ * @brief Request lines of a GPIO chip as outputs
+ * @param chip_path e.g. /dev/gpiochip0 or sim:<name>
+ * @param default_vals initial values of the lines
+ * @returns 0 on success or -1 on error, out is left empty on error
+ */
+int iotctrl_gpio_output_request(struct iotctrl_gpio_output *out,
+                                const char *chip_path,
+                                const unsigned int *offsets,
+                                unsigned int num_lines, const char *consumer,
+                                const int *default_vals);
+
+static inline int iotctrl_gpio_output_set(struct iotctrl_gpio_output *out,
+                                          const int *values) {
+  return out->ops->set_values(out->ctx, values);
+}
+
+/**
+ * @brief Release the lines, it is a no-op for an empty/released output
+ */
+void iotctrl_gpio_output_release(struct iotctrl_gpio_output *out);
+
+// Same value as the kernel's I2C_M_RD, so that messages map 1:1 onto
+// struct i2c_msg
+#define IOTCTRL_I2C_M_RD 0x0001
+
+struct iotctrl_i2c_msg {
+  uint16_t addr;
+  uint16_t flags;
+  uint16_t len;
+  uint8_t *buf;
+};
+
+struct iotctrl_i2c_ops {
+  // Execute msgs as one combined transaction (i.e., repeated starts between
+  // messages). Returns 0 on success or -1 with errno set, e.g., ENXIO if a
+  // device does not acknowledge.
+  int (*transfer)(void *ctx, struct iotctrl_i2c_msg *msgs, size_t num_msgs);
+  void (*close)(void *ctx);
+};
+
+struct iotctrl_i2c_bus {
+  const struct iotctrl_i2c_ops *ops;
+  void *ctx;
+};
+
+/**
+ * @brief Open an I2C bus, e.g. /dev/i2c-1 or sim:<name>
+ * @returns 0 on success or -1 on error
+ */
+int iotctrl_i2c_open(struct iotctrl_i2c_bus *bus, const char *path);
+
+/**
+ * @brief Wrap an already opened i2c-dev file descriptor, the fd is not closed
+ * by iotctrl_i2c_close()
+ */
+int iotctrl_i2c_from_fd(struct iotctrl_i2c_bus *bus, int fd);
+
+static inline int iotctrl_i2c_transfer(struct iotctrl_i2c_bus *bus,
+                                       struct iotctrl_i2c_msg *msgs,
+                                       size_t num_msgs) {
+  return bus->ops->transfer(bus->ctx, msgs, num_msgs);
+}
+
+void iotctrl_i2c_close(struct iotctrl_i2c_bus *bus);
+
+// Simulated backends, implemented in sim.c
+int iotctrl_sim_gpio_output_request(struct iotctrl_gpio_output *out,
+                                    const char *chip_path,
+                                    const unsigned int *offsets,
+                                    unsigned int num_lines,
+                                    const int *default_vals);
+int iotctrl_sim_i2c_open(struct iotctrl_i2c_bus *bus, const char *path);
+
+#endif // LIBIOTCTRL_TRANSPORT_H
@@ -4,8 +4,10 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -50,15 +52,22 @@ void print_help_then_exit(char **argv) {
   printf("Usage: %s\n"
          "    -p, --device-path  <device_path> The path of the GPIO device. For Raspberry Pi 3B+, it should be /dev/gpiochip0 (This chip controls all 40 GPIO pins)\n"
          "    -d, --data-pin     <pin_number>  The GPIO pin number in GPIO/BCM schema that connects to the DIO pin (default: 17)\n"
-         "    -c, --chain-count  <count>       Number of four-digit displays that are daisy chained together, it should typically be 1 or 2\n"
+         "    -c, --chain-count  <count>       Number of four-digit displays that are daisy chained together, e.g., 2 for an eight-digit display\n"
          "    -s, --clock-pin    <pin_number>  The GPIO pin number in GPIO/BCM schema that connects to the SCLK (clock signal) pin (default: 11)\n"
          "    -l, --latch-pin    <pin_number>  The GPIO pin number in GPIO/BCM schema that connects to the RCLK (register clock) (default: 18)\n"
          "    -r, --refresh-rate <rate>        How frequent are single digits being refreshed. (default: 1KHz)\n"
+         "    -f, --rt-priority  <priority>    Run the refresh thread under SCHED_FIFO with the given priority (1-99)\n"
+         "    -a, --cpu-affinity <mask>        Pin the refresh thread to CPUs in the mask, e.g. 0x8 for CPU 3\n"
+         "    -t, --transport    <transport>   gpio (bit-banging, default), spi (DIO/SCLK wired to MOSI/SCLK) or mock (no hardware)\n"
+         "    -S, --spidev-path  <device_path> The path of the SPI device for --transport spi (default: /dev/spidev0.0)\n"
+         "    -b, --spi-speed    <hz>          SPI clock speed for --transport spi (default: 1MHz)\n"
          "Note: the following are two tested combinations of parameters that (with proper wiring) work:\n"
          "    1. -d7  -s5  -l6\n"
          "    2. -d17 -s11 -l18\n",
          argv[0]);
   // clang-format on
+  // _exit() does not flush stdio buffers, e.g., when stdout is a pipe
+  fflush(stdout);
   _exit(0);
 }
 
@@ -74,12 +83,18 @@ void parse_arguments(int argc, char **argv,
         {"clock-pin", required_argument, 0, 's'},
         {"latch-pin", required_argument, 0, 'l'},
         {"refresh-rate", required_argument, 0, 'r'},
+        {"rt-priority", required_argument, 0, 'f'},
+        {"cpu-affinity", required_argument, 0, 'a'},
+        {"transport", required_argument, 0, 't'},
+        {"spidev-path", required_argument, 0, 'S'},
+        {"spi-speed", required_argument, 0, 'b'},
         {"help", no_argument, 0, 'h'},
         {NULL, 0, NULL, 0}};
     /* getopt_long stores the option index here. */
     int option_index = 0;
 
-    c = getopt_long(argc, argv, "p:d:c:s:l:r:h", long_options, &option_index);
+    c = getopt_long(argc, argv, "p:d:c:s:l:r:f:a:t:S:b:h", long_options,
+                    &option_index);
 
     /* Detect the end of the options. */
     if (c == -1)
@@ -103,6 +118,30 @@ void parse_arguments(int argc, char **argv,
     case 'r':
       conn->refresh_rate_hz = atoi(optarg);
       break;
+    case 'f':
+      conn->rt_priority = atoi(optarg);
+      break;
+    case 'a':
+      conn->cpu_affinity_mask = strtoull(optarg, NULL, 0);
+      break;
+    case 't':
+      if (strcmp(optarg, "gpio") == 0)
+        conn->transport = IOTCTRL_7SEG_DISP_TRANSPORT_GPIO;
+      else if (strcmp(optarg, "spi") == 0)
+        conn->transport = IOTCTRL_7SEG_DISP_TRANSPORT_SPI;
+      else if (strcmp(optarg, "mock") == 0)
+        conn->transport = IOTCTRL_7SEG_DISP_TRANSPORT_MOCK;
+      else {
+        fprintf(stderr, "Invalid transport %s\n", optarg);
+        print_help_then_exit(argv);
+      }
+      break;
+    case 'S':
+      strncpy(conn->spidev_path, optarg, PATH_MAX);
+      break;
+    case 'b':
+      conn->spi_speed_hz = strtoul(optarg, NULL, 10);
+      break;
     case 'h':
       print_help_then_exit(argv);
       break;
@@ -118,13 +157,14 @@ int main(int argc, char **argv) {
     retval = -1;
     goto err_signal_handler_install;
   }
-  struct iotctrl_7seg_disp_connection conn;
+  struct iotctrl_7seg_disp_connection conn = {0};
   conn.data_pin_num = 17;
   conn.clock_pin_num = 11;
   conn.latch_pin_num = 18;
   conn.chain_num = 2;
   conn.refresh_rate_hz = 1000;
   strcpy(conn.gpiochip_path, "/dev/gpiochip0");
+  strcpy(conn.spidev_path, "/dev/spidev0.0");
   parse_arguments(argc, argv, &conn);
 
   printf("Parameters:\n");
@@ -133,7 +173,13 @@ int main(int argc, char **argv) {
   printf("latch_pin_num: %d\n", conn.latch_pin_num);
   printf("chain_num: %d\n", conn.chain_num);
   printf("refresh_rate_hz: %d\n", conn.refresh_rate_hz);
+  printf("rt_priority: %d\n", conn.rt_priority);
+  printf("cpu_affinity_mask: %#" PRIx64 "\n", conn.cpu_affinity_mask);
   printf("gpiochip_path: %s\n", conn.gpiochip_path);
+  printf("transport: %d\n", conn.transport);
+  if (conn.transport == IOTCTRL_7SEG_DISP_TRANSPORT_SPI)
+    printf("spidev_path: %s, spi_speed_hz: %u\n", conn.spidev_path,
+           conn.spi_speed_hz);
 
   struct iotctrl_7seg_disp_handle *handle;
 
@@ -155,17 +201,23 @@ int main(int argc, char **argv) {
     printf("Turning on all segments for %d seconds\n", sec);
     iotctrl_7seg_disp_turn_on_all_segments(handle, sec);
     for (size_t i = 0; i < len && !ev_flag; ++i) {
-      if (conn.chain_num == 2) {
-        printf("Now showing: %.1f, %.1f\n", values[i][0], values[i][1]);
-        iotctrl_7seg_disp_update_as_four_digit_float(handle, values[i][0], 0);
-        iotctrl_7seg_disp_update_as_four_digit_float(handle, values[i][1], 1);
-      } else {
-        printf("Now showing: %.1f\n", values[i][0]);
-        iotctrl_7seg_disp_update_as_four_digit_float(handle, values[i][0], 0);
-      }
+      printf("Now showing: %.1f, %.1f on alternating modules\n", values[i][0],
+             values[i][1]);
+      // Show all modules' new values at once
+      iotctrl_7seg_disp_begin_frame(handle);
+      for (int j = 0; j < conn.chain_num; ++j)
+        iotctrl_7seg_disp_update_as_four_digit_float(handle, values[i][j % 2],
+                                                     j);
+      iotctrl_7seg_disp_commit_frame(handle);
       sleep(2);
     }
   }
+  struct iotctrl_7seg_disp_stats stats;
+  iotctrl_7seg_disp_get_stats(handle, &stats);
+  printf("Digits refreshed: %" PRIu64 ", deadline misses: %" PRIu64
+         ", jitter (mean/max): %" PRIu64 "ns/%" PRIu64 "ns\n",
+         stats.digit_refresh_count, stats.deadline_miss_count,
+         stats.mean_jitter_ns, stats.max_jitter_ns);
   printf("Done\n");
   iotctrl_7seg_disp_destroy(handle);
 err_signal_handler_install:
@@ -65,14 +65,20 @@ int main(int argc, char **argv) {
   const size_t iter_count = 10;
   printf("Making a test buzz for %zu times using pin %ld...\n", iter_count,
          pin_num);
+  struct iotctrl_buzzer_handle *h =
+      iotctrl_buzzer_open(gpio_device_path, (size_t)pin_num);
+  if (h == NULL) {
+    fprintf(stderr, "iotctrl_buzzer_open() failed\n");
+    return 1;
+  }
   for (size_t i = 0; i < iter_count; ++i) {
     printf("Iteration %zu\n", i);
-    if (iotctrl_make_a_buzz(gpio_device_path, (size_t)pin_num, sequence,
-                            length) != 0) {
-      fprintf(stderr, "iotctrl_make_a_buzz() failed\n");
+    if (iotctrl_buzzer_play(h, sequence, length) != 0) {
+      fprintf(stderr, "iotctrl_buzzer_play() failed\n");
       break;
     }
   }
+  iotctrl_buzzer_close(h);
 
   return 0;
 }
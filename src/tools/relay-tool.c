@@ -8,12 +8,23 @@ void print_help_then_exit() {
   printf("Usage: relay-tool\n"
          "    -d, --device-path <device_path>   The path of the device, "
          "typically /dev/ttyUSB0\n"
-         "    --on, --off                       Turn the switch on/off\n");
+         "    --on, --off                       Turn the switch on/off\n"
+         "    -c, --channel <channel>           The channel to switch, "
+         "starting from 1 (default: 1)\n"
+         "    -m, --mask <mask>                 Set all channels at once "
+         "instead, bit n turns\n"
+         "                                      channel n + 1 on, e.g. "
+         "0x05\n"
+         "    -n, --channel-count <count>       Number of channels set by "
+         "--mask (default: 8)\n");
 }
 
 int main(int argc, char **argv) {
   char *device_path = NULL;
   static int switch_on = 0;
+  int channel = 1;
+  int mask = -1;
+  int channel_count = IOTCTRL_RELAY_MAX_CHANNELS;
   int c;
   // https://www.gnu.org/software/libc/manual/html_node/Getopt-Long-Option-Example.html
   while (1) {
@@ -22,12 +33,15 @@ int main(int argc, char **argv) {
         {"on", no_argument, &switch_on, 1},
         {"off", no_argument, &switch_on, 0},
         {"device-path", required_argument, 0, 'd'},
+        {"channel", required_argument, 0, 'c'},
+        {"mask", required_argument, 0, 'm'},
+        {"channel-count", required_argument, 0, 'n'},
         {"help", no_argument, 0, 'h'},
         {NULL, 0, NULL, 0}};
     /* getopt_long stores the option index here. */
     int option_index = 0;
 
-    c = getopt_long(argc, argv, "d:s:h", long_options, &option_index);
+    c = getopt_long(argc, argv, "d:c:m:n:s:h", long_options, &option_index);
 
     /* Detect the end of the options. */
     if (c == -1)
@@ -45,6 +59,31 @@ int main(int argc, char **argv) {
     case 'd':
       device_path = optarg;
       break;
+    case 'c':
+      channel = atoi(optarg);
+      break;
+    case 'm': {
+      char *end;
+      const long val = strtol(optarg, &end, 0);
+      if (*optarg == '\0' || *end != '\0' || val < 0 || val > 0xFF) {
+        fprintf(stderr, "Invalid mask %s\n", optarg);
+        print_help_then_exit();
+        return 1;
+      }
+      mask = val;
+      break;
+    }
+    case 'n': {
+      char *end;
+      const long val = strtol(optarg, &end, 10);
+      if (*end != '\0' || val < 1 || val > IOTCTRL_RELAY_MAX_CHANNELS) {
+        fprintf(stderr, "Invalid channel count %s\n", optarg);
+        print_help_then_exit();
+        return 1;
+      }
+      channel_count = val;
+      break;
+    }
     case 's':
       print_help_then_exit();
       return 0;
@@ -72,6 +111,12 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  iotctrl_control_relay("/dev/ttyUSB0", switch_on);
-  return 0;
+  struct iotctrl_relay_handle *h = iotctrl_relay_open(device_path);
+  if (h == NULL)
+    return 1;
+  const int ret = mask >= 0
+                      ? iotctrl_relay_set_mask(h, channel_count, mask)
+                      : iotctrl_relay_set_channel(h, channel, switch_on);
+  iotctrl_relay_close(h);
+  return ret == 0 ? 0 : 1;
 }
@@ -14,13 +14,15 @@ void print_help_then_exit() {
   printf("Usage: temp-sensor-tool\n"
          "    -d, --device-path  <device_path>  The path of the device, typically /dev/ttyUSB0\n"
          "    -c, --sensor-count <number>       The number of sensors from DL11-MC series devices, typical numbers are 1 or 2\n"
+         "    [-s, --slaves <addr,addr,...>]    Modbus addresses of devices chained on one RS-485 bus (default: 1)\n"
          "    [-v, --verbose]                   Enable verbose mode\n");
   // clang-format on
   _exit(0);
 }
 
 void parse_arguments(int argc, char **argv, char **device_path,
-                     uint8_t *sensor_count, bool *verbose_mode) {
+                     uint8_t *sensor_count, bool *verbose_mode,
+                     uint8_t *slave_addrs, size_t *slave_count) {
   int c;
   // https://www.gnu.org/software/libc/manual/html_node/Getopt-Long-Option-Example.html
   while (1) {
@@ -28,12 +30,13 @@ void parse_arguments(int argc, char **argv, char **device_path,
         {"verbose", no_argument, 0, 'v'},
         {"device-path", required_argument, 0, 'd'},
         {"sensor-count", required_argument, 0, 'c'},
+        {"slaves", required_argument, 0, 's'},
         {"help", no_argument, 0, 'h'},
         {NULL, 0, NULL, 0}};
     /* getopt_long stores the option index here. */
     int option_index = 0;
 
-    c = getopt_long(argc, argv, "d:h:c:v", long_options, &option_index);
+    c = getopt_long(argc, argv, "d:h:c:s:v", long_options, &option_index);
 
     /* Detect the end of the options. */
     if (c == -1)
@@ -48,6 +51,22 @@ void parse_arguments(int argc, char **argv, char **device_path,
     case 'v':
       *verbose_mode = true;
       break;
+    case 's':
+      *slave_count = 0;
+      for (char *tok = strtok(optarg, ","); tok != NULL;
+           tok = strtok(NULL, ",")) {
+        char *end;
+        const long addr = strtol(tok, &end, 0);
+        // 0 is the broadcast address, which no slave answers
+        if (*end != '\0' || addr < 1 || addr > 247 || *slave_count == 247) {
+          fprintf(stderr, "Invalid slave address %s\n", tok);
+          print_help_then_exit();
+        }
+        slave_addrs[(*slave_count)++] = addr;
+      }
+      if (*slave_count == 0)
+        print_help_then_exit();
+      break;
     default:
       print_help_then_exit();
     }
@@ -61,16 +80,34 @@ int main(int argc, char **argv) {
   char *device_path = NULL;
   bool verbose_mode = false;
   uint8_t sensor_count = 0;
-  parse_arguments(argc, argv, &device_path, &sensor_count, &verbose_mode);
-  int16_t readings[sensor_count];
-  if (iotctrl_get_temperature(device_path, sensor_count, readings,
-                              verbose_mode) != 0) {
-    fprintf(stderr, "iotctrl_get_temperature() returns non-zero code\n");
-  } else {
-    for (uint8_t i = 0; i < sensor_count; ++i) {
-      float temp_parsed = readings[i] / 10.0;
+  // Valid Modbus slave addresses are 1-247
+  uint8_t slave_addrs[247] = {IOTCTRL_TEMP_SENSOR_DEFAULT_SLAVE};
+  size_t slave_count = 1;
+  parse_arguments(argc, argv, &device_path, &sensor_count, &verbose_mode,
+                  slave_addrs, &slave_count);
+  struct iotctrl_temp_sensor_handle *h =
+      iotctrl_temp_sensor_open(device_path, verbose_mode);
+  if (h == NULL) {
+    fprintf(stderr, "iotctrl_temp_sensor_open() failed\n");
+    return 1;
+  }
+  int16_t readings[slave_count * sensor_count];
+  int results[slave_count];
+  const int failed_count = iotctrl_temp_sensor_read_slaves(
+      h, slave_addrs, slave_count, sensor_count, readings, results);
+  for (size_t i = 0; i < slave_count; ++i) {
+    if (results[i] != 0) {
+      fprintf(stderr, "Reading slave %u returns non-zero code %d\n",
+              slave_addrs[i], results[i]);
+      continue;
+    }
+    for (uint8_t j = 0; j < sensor_count; ++j) {
+      float temp_parsed = readings[i * sensor_count + j] / 10.0;
+      if (slave_count > 1)
+        printf("[%u] ", slave_addrs[i]);
       printf("%.1f °C\n", temp_parsed);
     }
   }
-  return 0;
+  iotctrl_temp_sensor_close(h);
+  return failed_count == 0 ? 0 : 1;
 }